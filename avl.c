@@ -8,17 +8,43 @@
 */
 #include "Python.h"
 #include "structmember.h"
+#include "marshal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 typedef unsigned char uchar;
 typedef unsigned int uint;
 typedef unsigned short ushort;
 
 static PyTypeObject NodeType;
+static PyTypeObject CursorType;
+static PyTypeObject AvlTreeType;
+static PyTypeObject SharedTreeType;
+
+static PyObject * avl_merge(PyObject *module, PyObject *args, PyObject *kwargs);
+
+static PyObject *BalanceError;
 
 #define SIGN(n) ((n >= 0) - (n < 0))
 #define MAX(a,b) (a > b ? a : b)
+#define MIN(a,b) (a < b ? a : b)
 #define NOT_NONE(n) ((PyObject *)n != Py_None)
 #define IS_NONE(n) ((PyObject *)n == Py_None)
+#define NODE_ITEM(n) (n->item ? n->item : n->key)
+
+// Tree flags
+#define TREE_MULTI 1        // Multiset, duplicates bump the node count
+#define TREE_PINNED 2       // Node API tree, the root node object stays on top
+#define TREE_LAZY 4         // Deletes leave tombstones, nodes with no occurrences
+#define TREE_FROZEN 8       // Read-only snapshot
+#define TREE_SHARED 16      // Shares nodes with snapshots or copies, see AvlTree__own
+
+// Nodes visited by a purge step, see AvlTree__purge
+#define PURGE_STEPS 8
 
 typedef struct Node {
     PyObject_HEAD
@@ -26,10 +52,39 @@ typedef struct Node {
     struct Node *left;
     struct Node *right;
     PyObject *key;
+    PyObject *item;         // Object the key was derived from, if any
     struct Node *parent;
     int bf;
+    int hashed;             // Hash is up to date, see Node__hash
+    int weighed;            // Weight is up to date, see Node__weight
+    Py_ssize_t count;       // Key multiplicity
+    unsigned PY_LONG_LONG hash; // Subtree hash
+    Py_ssize_t weight;      // Subtree occurrences
+    struct AvlTree *tree;   // Owning tree, set on the root only
+    Py_ssize_t gen;         // Generation of the tree that made the node
 } Node;
 
+typedef struct AvlTree {
+    PyObject_HEAD
+    Node *root;             // NULL if the tree is empty
+    Py_ssize_t size;        // Number of keys, duplicates included
+    PyTypeObject *node_type;
+    int flags;
+    Node *finger;           // Last insert/delete position
+    PyObject *keyfunc;
+    double garbage;         // Tombstone fraction to start purging at
+    Py_ssize_t dead;        // Number of tombstones
+    Py_ssize_t live;        // Number of nodes holding keys
+    Node *sweep;            // Purge position, NULL if not purging
+    PyObject *index;        // Key to node dict for point lookups, if any
+    struct Log *log;        // Write-ahead log of the changes, if any
+    Py_ssize_t version;     // Bumped on changes, iterators check it
+    Py_ssize_t gen;         // Generation of the nodes the tree may change
+} AvlTree;
+
+// Last tree generation handed out, see AvlTree_snapshot
+static Py_ssize_t generations;
+
 Node * Node__new(PyTypeObject *type,
                  PyObject *key,
                  Node *left,
@@ -45,6 +100,7 @@ Node * Node__new(PyTypeObject *type,
     node->left = left;
     node->right = right;
     node->parent = parent;
+    node->count = 1;
 
     Py_INCREF(key);
     Py_INCREF(left);
@@ -54,29 +110,163 @@ Node * Node__new(PyTypeObject *type,
     return node;
 }
 
+static int Node__compare(PyObject *a, PyObject *b)
+{
+    /*
+        PyObject_Compare with shortcuts for the common key types
+    */
+
+    Py_ssize_t la, lb;
+    double da, db;
+    long ia, ib;
+    int c;
+
+    if (a == b)
+        return 0;
+
+    if (a->ob_type == b->ob_type) {
+        if (PyInt_CheckExact(a)) {
+            ia = PyInt_AS_LONG(a);
+            ib = PyInt_AS_LONG(b);
+            return (ia > ib) - (ia < ib);
+        } else if (PyFloat_CheckExact(a)) {
+            da = PyFloat_AS_DOUBLE(a);
+            db = PyFloat_AS_DOUBLE(b);
+            // NaNs take the generic path
+            if (da < db)
+                return -1;
+            else if (da > db)
+                return 1;
+            else if (da == db)
+                return 0;
+        } else if (PyString_CheckExact(a)) {
+            la = PyString_GET_SIZE(a);
+            lb = PyString_GET_SIZE(b);
+            c = memcmp(PyString_AS_STRING(a), PyString_AS_STRING(b),
+                       la < lb ? la : lb);
+            if (c)
+                return c < 0 ? -1 : 1;
+            return (la > lb) - (la < lb);
+        }
+    }
+
+    return PyObject_Compare(a, b);
+}
+
+static Node * Node__root(Node *self)
+{
+    while (NOT_NONE(self->parent))
+        self = self->parent;
+
+    return self;
+}
+
+static AvlTree * Node__tree(Node *self)
+{
+    /*
+        Returns the tree the node belongs to, NULL for unlinked nodes
+    */
+
+    return Node__root(self)->tree;
+}
+
+static PyObject * AvlTree__key(AvlTree *self, PyObject *item)
+{
+    /*
+        Returns a new reference to the key the tree orders the item by,
+        calling the tree key function if there is one
+    */
+
+    if (self && self->keyfunc)
+        return PyObject_CallFunctionObjArgs(self->keyfunc, item, NULL);
+
+    Py_INCREF(item);
+    return item;
+}
+
+static PyObject * Node__key(Node *self, PyObject *item)
+{
+    return AvlTree__key(Node__tree(self), item);
+}
+
 static void Node__rebalance(Node *self)
 {
     if (self->rebalance)
         self->rebalance(self);
 }
 
-static Node * Node__search(Node *self, PyObject *key)
+static Py_ssize_t Node__mismatch(const uchar *s, const uchar *t,
+                                 Py_ssize_t i, Py_ssize_t len)
+{
+    /*
+        Returns the first position from i on where the strings differ,
+        len if they don't. Compares a word at a time
+    */
+
+    unsigned PY_LONG_LONG a, b;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&a, s + i, 8);
+        memcpy(&b, t + i, 8);
+        if (a != b) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + __builtin_ctzll(a ^ b) / 8;
+#else
+            break;
+#endif
+        }
+    }
+
+    for (; i < len && s[i] == t[i]; i++);
+
+    return i;
+}
+
+static Node * Node__locate_str(Node *self, PyObject *key, int *c)
 {
     /*
-        Returns the corresponding node if found, the last checked otherwise
+        Node__locate for str keys. The keys below a node lie between the
+        nodes the search last went right and left from, so they share the
+        shorter of those two common prefixes with the key, and comparisons
+        start past it. Keys with long common prefixes, like URLs, are then
+        mostly compared from where they differ
     */
 
+    const uchar *s = (uchar *)PyString_AS_STRING(key), *t;
+    Py_ssize_t len = PyString_GET_SIZE(key), lo = 0, hi = 0, i, m;
     Node *n = self;
     Node *last = NULL;
 
+    *c = 0;
     while (NOT_NONE(n)) {
         last = n;
 
-        switch (PyObject_Compare(key, n->key)) {
+        if (PyString_CheckExact(n->key)) {
+            t = (uchar *)PyString_AS_STRING(n->key);
+            m = MIN(len, PyString_GET_SIZE(n->key));
+            i = Node__mismatch(s, t, MIN(lo, hi), m);
+            if (i < m)
+                *c = s[i] < t[i] ? -1 : 1;
+            else
+                *c = (len > PyString_GET_SIZE(n->key)) -
+                     (len < PyString_GET_SIZE(n->key));
+        } else {
+            // Other keys leave the bounds as they are, looser but valid
+            i = -1;
+            *c = Node__compare(key, n->key);
+        }
+
+        switch (*c) {
             case -1:
+                if (i < 0 && PyErr_Occurred())
+                    return last;
+                if (i >= 0)
+                    hi = i;
                 n = n->left;
                 break;
             case 1:
+                if (i >= 0)
+                    lo = i;
                 n = n->right;
                 break;
             default:
@@ -87,261 +277,815 @@ static Node * Node__search(Node *self, PyObject *key)
     return last;
 }
 
-static int Node__get_child_place(Node *self, Node *child)
+static Node * Node__locate(Node *self, PyObject *key, int *c)
 {
-    return PyObject_Compare(self->key, child->key);
-}
+    /*
+        Returns the corresponding node if found, the last checked otherwise.
+        Sets how the key compares to it, so that inserts know the side
+        to hang the new node on without comparing again. Stops at a
+        failed comparison, leaving the error set
+    */
 
-static int Node__connect(Node *self, Node *node)
-{
-    int bf;
+    Node *n = self;
+    Node *last = NULL;
 
-    bf = Node__get_child_place(self, node);
+    if (PyString_CheckExact(key))
+        return Node__locate_str(self, key, c);
 
-    Py_INCREF(node);
-    if (bf == 1) {
-        Py_DECREF(self->left);
-        self->left = node;
-    } else {
-        Py_DECREF(self->right);
-        self->right = node;
+    *c = 0;
+    while (NOT_NONE(n)) {
+        last = n;
+
+        switch (*c = Node__compare(key, n->key)) {
+            case -1:
+                // The comparison failed, no point going on
+                if (PyErr_Occurred())
+                    return last;
+                n = n->left;
+                break;
+            case 1:
+                n = n->right;
+                break;
+            default:
+                return n;
+        }
     }
 
-    return bf;
+    return last;
 }
 
-static int Node__connect_to_parent(Node *self, Node *parent)
+static Node * Node__search(Node *self, PyObject *key)
 {
-    int bf;
+    int c;
 
-    bf = Node__connect(parent, self);
+    return Node__locate(self, key, &c);
+}
 
-    Py_DECREF(self->parent);
-    Py_INCREF(parent);
-    self->parent = parent;
+static Node * Node__finger_search(Node *finger, PyObject *key, int *c)
+{
+    /*
+        Same as Node__search, but starts from an arbitrary node of the tree.
+        Climbs up only as far as needed to find the subtree the key belongs
+        to, so the cost is O(log d) in the distance d from the finger.
+        Climbing along the right (left) spine takes no comparisons at all,
+        which makes appending past the maximum (minimum) key O(1).
+        Sets how the key compares to the node returned, see Node__locate
+    */
+
+    Node *start = finger, *m, *p;
+
+    *c = Node__compare(key, finger->key);
+    if (!*c)
+        return finger;
+
+    for (m = finger; NOT_NONE(m->parent); m = p) {
+        p = m->parent;
+
+        if ((*c > 0 && p->right == m) || (*c < 0 && p->left == m))
+            // The key lies beyond p as well, keep climbing
+            continue;
+
+        // p bounds the subtree of start on the side the key goes to
+        switch (Node__compare(key, p->key)) {
+            case 0:
+                *c = 0;
+                return p;
+            case -1:
+                if (*c > 0)
+                    goto descend;
+                break;
+            case 1:
+                if (*c < 0)
+                    goto descend;
+                break;
+        }
+        start = p;
+    }
 
-    return bf;
+    descend:
+    m = *c > 0 ? start->right : start->left;
+    if (NOT_NONE(m))
+        return Node__locate(m, key, c);
+    else
+        return start;
 }
 
-static void Node__update_bf_on_increase(Node *self, int delta, int dont_rebalance)
+static Node * Node__next(Node *self)
 {
-    int bf;
-    Node *parent;
+    /*
+        Returns in-order successor of the node, NULL if there's none
+    */
 
-    self->bf += delta;
-    bf = self->bf;
+    Node *p;
 
-    if (bf != 0 && SIGN(bf) == SIGN(delta)) {
-        // Subtree height increased
-        parent = self->parent;
-        if (NOT_NONE(parent))
-            Node__update_bf_on_increase(
-                parent,
-                Node__get_child_place(parent, self),
-                abs(bf) > 1 || dont_rebalance
-            );
+    if (NOT_NONE(self->right)) {
+        for (p = self->right; NOT_NONE(p->left); p = p->left);
+        return p;
     }
-    if (abs(bf) > 1 && !dont_rebalance)
-        Node__rebalance(self);
+
+    for (p = self->parent; NOT_NONE(p) && p->right == self; p = p->parent)
+        self = p;
+
+    return NOT_NONE(p) ? p : NULL;
 }
 
-static void Node__update_bf_on_decrease(Node *self, int delta, int dont_rebalance)
+/*
+    Nodes shared with snapshots hang under a parent in every tree they
+    are in, so their parent links can't be followed. Walks that may meet
+    such nodes keep the way down from the root on a stack instead. The
+    stack borrows the nodes, it's good as long as the tree isn't changed
+*/
+
+typedef struct Path {
+    Node **nodes;           // From the root down
+    Py_ssize_t len;
+    Py_ssize_t alloc;
+} Path;
+
+static void Path__clear(Path *self)
 {
-    int bf;
-    Node *parent;
+    PyMem_Free(self->nodes);
+    self->nodes = NULL;
+    self->len = self->alloc = 0;
+}
 
-    self->bf += delta;
-    bf = self->bf;
+static int Path__reserve(Path *self, Py_ssize_t len)
+{
+    Node **tmp;
 
-    if (bf == 0 || SIGN(bf) != SIGN(delta)) {
-        // Subtree height decreased
-        parent = self->parent;
-        if (NOT_NONE(parent))
-            Node__update_bf_on_decrease(
-                parent,
-                -Node__get_child_place(parent, self),
-                (abs(bf) > 1 || dont_rebalance)
-            );
+    if (len <= self->alloc)
+        return 0;
+
+    // AVL trees are shallow, this hardly ever grows past the first
+    len = MAX(len, self->alloc + 64);
+    if (!(tmp = PyMem_Realloc(self->nodes, len * sizeof(Node *)))) {
+        PyErr_NoMemory();
+        return -1;
     }
-    if (abs(bf) > 1 && !dont_rebalance)
-        Node__rebalance(self);
+    self->nodes = tmp;
+    self->alloc = len;
+
+    return 0;
 }
 
-static void Node__disconnect(Node *self, Node *node)
+static int Path__push(Path *self, Node *node)
 {
-    if (self->left == node) {
-        Py_DECREF(self->left);
-        Py_INCREF(Py_None);
-        self->left = (Node *)Py_None;
-    } else {
-        Py_DECREF(self->right);
-        Py_INCREF(Py_None);
-        self->right = (Node *)Py_None;
-    }
+    if (Path__reserve(self, self->len + 1))
+        return -1;
+    self->nodes[self->len++] = node;
+
+    return 0;
 }
 
-static Node * Node__rightmost(Node *self)
+static Node * Path__top(Path *self)
 {
-    if (NOT_NONE(self->right))
-        return Node__rightmost(self->right);
-    else
-        return self;
+    return self->len ? self->nodes[self->len - 1] : NULL;
 }
 
-static Node * Node__leftmost(Node *self)
+static Node * Path__leftmost(Path *self, Node *node)
 {
-    if (NOT_NONE(self->left))
-        return Node__leftmost(self->left);
-    else
-        return self;
+    /*
+        Goes down to the smallest key under the node, NULL with the error
+        set if the stack can't grow
+    */
+
+    for (; NOT_NONE(node); node = node->left)
+        if (Path__push(self, node))
+            return NULL;
+
+    return Path__top(self);
 }
 
-static int Node__insert(Node *self, PyObject *key)
+static Node * Path__rightmost(Path *self, Node *node)
 {
-    Node *p, *n;
+    for (; NOT_NONE(node); node = node->right)
+        if (Path__push(self, node))
+            return NULL;
 
-    p = Node__search(self, key);
+    return Path__top(self);
+}
 
-    if (!PyObject_Compare(p->key, key)) {
-        PyErr_SetString(PyExc_KeyError, "key already present");
-        return -1;
-    } else {
-        n = Node__new(self->ob_type, key, (Node *)Py_None, (Node *)Py_None, self);
-        Node__update_bf_on_increase(p, Node__connect_to_parent(n, p), 0);
-        Py_DECREF(n);
-    }
+static Node * Path__first(Path *self, Node *root)
+{
+    // root may be NULL for an empty tree
+    self->len = 0;
+    return root ? Path__leftmost(self, root) : NULL;
+}
 
-    return 0;
+static Node * Path__last(Path *self, Node *root)
+{
+    self->len = 0;
+    return root ? Path__rightmost(self, root) : NULL;
 }
 
-static uint Node__height(Node *self)
+static Node * Path__next(Path *self)
 {
-    uint h_left=0, h_right=0;
+    /*
+        Moves on to the in-order successor, NULL if there's none
+    */
 
-    if (NOT_NONE(self->left))
-        h_left = Node__height(self->left);
+    Node *n = self->nodes[self->len - 1];
 
-    if (NOT_NONE(self->right))
-        h_right = Node__height(self->right);
+    if (NOT_NONE(n->right))
+        return Path__leftmost(self, n->right);
 
-    return 1 + MAX(h_left, h_right);
+    do
+        n = self->nodes[--self->len];
+    while (self->len && self->nodes[self->len - 1]->right == n);
+
+    return Path__top(self);
 }
 
-static int Node__calc_bf(Node *self)
+static Node * Path__prev(Path *self)
 {
-    uint h_left=0, h_right=0;
+    Node *n = self->nodes[self->len - 1];
 
-    if (NOT_NONE(self->left))
-        h_left = Node__height(self->left);
+    if (NOT_NONE(n->left))
+        return Path__rightmost(self, n->left);
 
-    if (NOT_NONE(self->right))
-        h_right = Node__height(self->right);
+    do
+        n = self->nodes[--self->len];
+    while (self->len && self->nodes[self->len - 1]->left == n);
 
-    return h_left - h_right;
+    return Path__top(self);
 }
 
-static Node * Node__from_list_raw(PyTypeObject *type, PyObject *l, Node *parent)
+static Node * Path__descend(Path *self, Node *node, PyObject *key, int *c)
 {
-    PyObject *key, *left, *right;
-    Node *node, *tnode;
+    /*
+        Node__locate keeping the way down, stops at a failed comparison
+        or allocation with the error set
+    */
 
-    if (!PyArg_ParseTuple(l, "OOO", &key, &left, &right)) {
-        return NULL;
+    *c = 0;
+    for (; NOT_NONE(node); node = *c < 0 ? node->left : node->right) {
+        if (Path__push(self, node))
+            return NULL;
+        *c = Node__compare(key, node->key);
+        if (!*c || (*c == -1 && PyErr_Occurred()))
+            break;
     }
 
-    node = Node__new(type, key, (Node *)Py_None, (Node *)Py_None, parent);
+    return Path__top(self);
+}
 
-    if (left != Py_None) {
-        tnode = Node__from_list_raw(type, left, node);
-        if (tnode) {
-            Py_DECREF(node->left);
-            node->left = tnode;
-        }
-    }
+static Node * Path__locate(Path *self, Node *root, PyObject *key, int *c)
+{
+    // root may be NULL for an empty tree
+    self->len = 0;
+    *c = 0;
+    return root ? Path__descend(self, root, key, c) : NULL;
+}
+
+static Node * Path__finger_search(Path *self, PyObject *key, int *c)
+{
+    /*
+        Node__finger_search from the node on top, popping the stack
+        instead of following parent links
+    */
+
+    Node **nodes = self->nodes, *m;
+    Py_ssize_t start = self->len - 1, i;
+
+    *c = Node__compare(key, nodes[start]->key);
+    if (!*c || (*c == -1 && PyErr_Occurred()))
+        return nodes[start];
+
+    for (i = start; i > 0; i--) {
+        if ((*c > 0 && nodes[i-1]->right == nodes[i]) ||
+                (*c < 0 && nodes[i-1]->left == nodes[i]))
+            continue;
 
-    if (right != Py_None) {
-        tnode = Node__from_list_raw(type, right, node);
-        if (tnode) {
-            Py_DECREF(node->right);
-            node->right = tnode;
+        switch (Node__compare(key, nodes[i-1]->key)) {
+            case 0:
+                *c = 0;
+                self->len = i;
+                return nodes[i-1];
+            case -1:
+                if (PyErr_Occurred())
+                    return nodes[self->len - 1];
+                if (*c > 0)
+                    goto descend;
+                break;
+            case 1:
+                if (*c < 0)
+                    goto descend;
+                break;
         }
+        start = i - 1;
     }
 
-    node->bf = Node__calc_bf(node);
-    return node;
+    descend:
+    self->len = start + 1;
+    m = *c > 0 ? nodes[start]->right : nodes[start]->left;
+    if (NOT_NONE(m))
+        return Path__descend(self, m, key, c);
+    else
+        return nodes[start];
 }
 
-static void Node__move(Node *self, Node *node)
+static Node * Path__ceil(Path *self, int c)
 {
-    node->key = self->key;
-    node->left = self->left;
-    node->right = self->right;
-    node->bf = self->bf;
+    /*
+        Takes how the key compared to the node on top after a search,
+        moves on to the smallest key not less than the key
+    */
+
+    return c > 0 ? Path__next(self) : Path__top(self);
 }
 
-#if 0
-                    PARENT                  PARENT
-                    /    \                  /     \
-                RIGHT           =>      PIVOT
-                /   \                   /   \
-            PIVOT    A              LEFT    RIGHT
-            /   \                          /    \
-        LEFT     B                        B      A
-#endif
+static Node * Path__floor(Path *self, int c)
+{
+    return c < 0 ? Path__prev(self) : Path__top(self);
+}
 
-static Node * Node__rotate_cw(Node *self)
+static Node * Path__skip_dead(Path *self, Node *node, int reverse)
 {
-    Node *right = self->parent;
-    Node *a, *pivot, *parent;
-    PyObject *r_key;
-    int old_bf, delta;
+    /*
+        Moves on from the node on top past the tombstones of lazy deletes
+    */
 
-    if (IS_NONE(right)) {
-        PyErr_SetString(PyExc_RuntimeError, "can't rotate root node");
-        return NULL;
-    } else if (right->right == self) {
-        PyErr_SetString(PyExc_RuntimeError, "can't rotate right subtree CW");
-        return NULL;
-    }
+    while (node && !node->count)
+        node = reverse ? Path__prev(self) : Path__next(self);
 
-    // Save old subtree bf
-    old_bf = right->bf;
-    // Save the subtree
-    a = right->right;
-    r_key = right->key;
-    // Move PIVOT into RIGHT
-    Node__move(self, right);
+    return node;
+}
 
-    // Manually reconnect LEFT to the new PIVOT
-    if (NOT_NONE(self->left)) {
-        // Disconnect old PIVOT from LEFT
-        Py_DECREF(self->left->parent);
-        // Reconnect LEFT to the new PIVOT, no incref needed
-        self->left->parent = right;
-    }
+static int Path__climb(Path *self, Node *node)
+{
+    /*
+        Rebuilds the way down to a node by its parent links, which only
+        holds for nodes the tree owns
+    */
 
-    // old PIVOT is the new RIGHT
-    self->key = r_key;
-    right->right = self;
-    Py_INCREF(self->parent);
-    // Move B to the left subtree
-    self->left = self->right;
+    Py_ssize_t len = 0, i;
+    Node *n;
 
-    // Reconnect A to the new RIGHT
-    if (NOT_NONE(a)) {
-        a->parent = self;
-        Py_INCREF(a->parent);
-    }
-    self->right = a;
+    for (n = node; NOT_NONE(n); n = n->parent)
+        len++;
 
-    // Update bf's
-    // Redefine variables to catch up with the rotation changes
-    pivot = right;
-    right = self;
-    parent = pivot->parent;
-    // RIGHT's left subtree is 1 node shorter now (minus PIVOT)
-    right->bf = old_bf - 1;
-    if (pivot->bf > 0)
+    self->len = 0;
+    if (Path__reserve(self, len))
+        return -1;
+
+    for (n = node, i = len - 1; i >= 0; n = n->parent, i--)
+        self->nodes[i] = n;
+    self->len = len;
+
+    return 0;
+}
+
+static int Node__attached(Node *root, Node *node)
+{
+    // Unlinked nodes get their links reset, see Node__delete
+    return node == root || NOT_NONE(node->parent);
+}
+
+static int Node__get_child_place(Node *self, Node *child)
+{
+    // 1 if the child hangs on the left, -1 on the right
+    return self->left == child ? 1 : -1;
+}
+
+static void Node__stale(Node *self)
+{
+    /*
+        Marks the subtree hashes and weights of the node and its ancestors
+        out of date. Ancestors of a node with no hash have none either,
+        the same for weights, so trees nobody asks for them stop at the
+        first node
+    */
+
+    for (; NOT_NONE(self) && (self->hashed || self->weighed);
+         self = self->parent)
+        self->hashed = self->weighed = 0;
+}
+
+static void Node__set_parent(Node *self, Node *parent)
+{
+    Node *tmp = self->parent;
+
+    Py_INCREF(parent);
+    self->parent = parent;
+    Py_DECREF(tmp);
+}
+
+static void Node__link(Node *self, Node *child, int left)
+{
+    /*
+        Hangs the child (may be None) on the given side of the node. A
+        child of an older generation is shared with a snapshot and may
+        hang under several parents, its parent link is left alone
+    */
+
+    Node *tmp, **place = left ? &self->left : &self->right;
+
+    tmp = *place;
+    Py_INCREF(child);
+    *place = child;
+    Py_DECREF(tmp);
+    Node__stale(self);
+
+    if (NOT_NONE(child) && child->gen == self->gen)
+        Node__set_parent(child, self);
+}
+
+static void Node__replace(Node *self, Node *node)
+{
+    /*
+        Puts the node (may be None) in place of self. Self's own links
+        are left alone, it's up to the caller to reuse or reset them
+    */
+
+    Node *p = self->parent;
+    AvlTree *tree;
+
+    if (NOT_NONE(p)) {
+        Node__link(p, node, p->left == self);
+        return;
+    }
+
+    // New root, hand the tree over
+    tree = self->tree;
+    self->tree = NULL;
+
+    if (NOT_NONE(node)) {
+        Node__set_parent(node, (Node *)Py_None);
+        node->tree = tree;
+    } else
+        node = NULL;
+
+    if (tree) {
+        Py_XINCREF(node);
+        Py_XDECREF(tree->root);
+        tree->root = node;
+    }
+}
+
+static void Node__detach(Node *self)
+{
+    /*
+        Resets links of a node taken out of the tree, so that cursors
+        and the finger can tell it's gone
+    */
+
+    Node *parent = self->parent, *left = self->left, *right = self->right;
+
+    Py_INCREF(Py_None);
+    Py_INCREF(Py_None);
+    Py_INCREF(Py_None);
+    self->parent = self->left = self->right = (Node *)Py_None;
+    self->hashed = self->weighed = 0;
+
+    Py_DECREF(parent);
+    Py_DECREF(left);
+    Py_DECREF(right);
+}
+
+static void Node__relink(Node *self, Node *old)
+{
+    /*
+        Points the neighbours of the place self took over from old at self
+    */
+
+    Node **links[3] = {&self->parent, &self->left, &self->right};
+    Node *n;
+    int i;
+
+    for (i=0; i<3; i++) {
+        n = *links[i];
+
+        if (n == self) {
+            // Link between the two exchanged nodes
+            Py_INCREF(old);
+            *links[i] = old;
+            Py_DECREF(self);
+        } else if (NOT_NONE(n)) {
+            if (i)
+                Node__set_parent(n, self);
+            else if (n->left == old)
+                Node__link(n, self, 1);
+            else
+                Node__link(n, self, 0);
+        }
+    }
+}
+
+static void Node__exchange(Node *a, Node *b)
+{
+    /*
+        Swaps the places of two node objects. Keys, balance factors and
+        links stay where they are, only the objects holding them move
+    */
+
+    char body[sizeof(Node)];
+    size_t off = offsetof(Node, rebalance), len = sizeof(Node) - off;
+
+    memcpy(body, (char *)a + off, len);
+    memcpy((char *)a + off, (char *)b + off, len);
+    memcpy((char *)b + off, body, len);
+
+    Node__relink(a, b);
+    Node__relink(b, a);
+}
+
+static void Node__update_bf_on_increase(Node *self, int delta, int dont_rebalance)
+{
+    int bf;
+    Node *parent;
+
+    self->bf += delta;
+    bf = self->bf;
+
+    if (bf != 0 && SIGN(bf) == SIGN(delta)) {
+        // Subtree height increased
+        parent = self->parent;
+        if (NOT_NONE(parent))
+            Node__update_bf_on_increase(
+                parent,
+                Node__get_child_place(parent, self),
+                abs(bf) > 1 || dont_rebalance
+            );
+    }
+    if (abs(bf) > 1 && !dont_rebalance)
+        Node__rebalance(self);
+}
+
+static void Node__update_bf_on_decrease(Node *self, int delta, int dont_rebalance)
+{
+    int bf;
+    Node *parent;
+
+    self->bf += delta;
+    bf = self->bf;
+
+    if (bf == 0 || SIGN(bf) != SIGN(delta)) {
+        // Subtree height decreased
+        parent = self->parent;
+        if (NOT_NONE(parent))
+            Node__update_bf_on_decrease(
+                parent,
+                -Node__get_child_place(parent, self),
+                (abs(bf) > 1 || dont_rebalance)
+            );
+    }
+    if (abs(bf) > 1 && !dont_rebalance)
+        Node__rebalance(self);
+}
+
+static Node * Node__rightmost(Node *self)
+{
+    if (NOT_NONE(self->right))
+        return Node__rightmost(self->right);
+    else
+        return self;
+}
+
+static Node * Node__leftmost(Node *self)
+{
+    if (NOT_NONE(self->left))
+        return Node__leftmost(self->left);
+    else
+        return self;
+}
+
+static uint Node__height(Node *self)
+{
+    uint h_left=0, h_right=0;
+
+    if (NOT_NONE(self->left))
+        h_left = Node__height(self->left);
+
+    if (NOT_NONE(self->right))
+        h_right = Node__height(self->right);
+
+    return 1 + MAX(h_left, h_right);
+}
+
+static int Node__calc_bf(Node *self)
+{
+    uint h_left=0, h_right=0;
+
+    if (NOT_NONE(self->left))
+        h_left = Node__height(self->left);
+
+    if (NOT_NONE(self->right))
+        h_right = Node__height(self->right);
+
+    return h_left - h_right;
+}
+
+typedef struct RawImport {
+    PyTypeObject *type;
+    PyObject *keyfunc;
+    PyObject *stream;       // Iterator of pre-order entries, NULL for tuples
+    int validate;
+    Node *last;             // Last node imported in key order
+    Py_ssize_t size;        // Number of keys imported, duplicates included
+    Py_ssize_t dead;        // Number of tombstones imported
+    Py_ssize_t live;        // Number of nodes imported holding keys
+    Py_ssize_t gen;         // Generation of the tree imported into
+} RawImport;
+
+static PyObject * RawImport__child(RawImport *im, PyObject *desc)
+{
+    /*
+        Returns a new reference to the entry of a child described in its
+        parent entry, None if there's no child
+    */
+
+    PyObject *entry;
+    int present;
+
+    if (!im->stream) {
+        Py_INCREF(desc);
+        return desc;
+    }
+
+    // Streamed entries only tell whether the child is there
+    if ((present = PyObject_IsTrue(desc)) <= 0) {
+        if (present < 0)
+            return NULL;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    if (!(entry = PyIter_Next(im->stream)) && !PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "tree stream ended early");
+
+    return entry;
+}
+
+static Node * Node__from_list_raw(RawImport *im, PyObject *l, Node *parent,
+                                  int *height)
+{
+    /*
+        Imports a subtree in one pass, heights are computed bottom-up.
+        With validation on, checks that keys come in order and that AVL
+        nodes are balanced along the way
+    */
+
+    PyObject *key, *item, *left, *right, *child;
+    Py_ssize_t count = 1;
+    int h_left = 0, h_right = 0;
+    Node *node, *tnode;
+
+    if (!PyTuple_Check(l)) {
+        PyErr_SetString(PyExc_TypeError, "tree entries must be tuples");
+        return NULL;
+    }
+
+    if (!PyArg_ParseTuple(l, "OOO|n", &item, &left, &right, &count)) {
+        return NULL;
+    }
+
+    if (im->keyfunc) {
+        if (!(key = PyObject_CallFunctionObjArgs(im->keyfunc, item, NULL)))
+            return NULL;
+    } else {
+        key = item;
+        Py_INCREF(key);
+    }
+
+    node = Node__new(im->type, key, (Node *)Py_None, (Node *)Py_None, parent);
+    node->gen = im->gen;
+    node->count = count;
+    if (key != item) {
+        Py_INCREF(item);
+        node->item = item;
+    }
+    Py_DECREF(key);
+
+    if (!(child = RawImport__child(im, left)))
+        goto err;
+    if (NOT_NONE(child)) {
+        tnode = Node__from_list_raw(im, child, node, &h_left);
+        Py_DECREF(child);
+        if (!tnode)
+            goto err;
+        Py_DECREF(node->left);
+        node->left = tnode;
+    } else
+        Py_DECREF(child);
+
+    if (im->validate && im->last &&
+            Node__compare(im->last->key, node->key) >= 0) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "keys out of order");
+        goto err;
+    }
+    im->last = node;
+    im->size += count;
+    im->dead += !count;
+    im->live += !!count;
+
+    if (!(child = RawImport__child(im, right)))
+        goto err;
+    if (NOT_NONE(child)) {
+        tnode = Node__from_list_raw(im, child, node, &h_right);
+        Py_DECREF(child);
+        if (!tnode)
+            goto err;
+        Py_DECREF(node->right);
+        node->right = tnode;
+    } else
+        Py_DECREF(child);
+
+    node->bf = h_left - h_right;
+    if (im->validate && node->rebalance && abs(node->bf) > 1) {
+        PyErr_SetString(BalanceError, "unbalanced node");
+        goto err;
+    }
+    *height = 1 + MAX(h_left, h_right);
+
+    return node;
+
+    err:
+        Py_DECREF(node);
+        return NULL;
+}
+
+static Node * RawImport__run(RawImport *im, PyObject *l, Node *parent)
+{
+    /*
+        Imports a tuple tree, or an iterable of (item, has_left, has_right
+        [, count]) entries listing the nodes in pre-order
+    */
+
+    PyObject *entry;
+    Node *root;
+    int height;
+
+    if (PyTuple_Check(l))
+        return Node__from_list_raw(im, l, parent, &height);
+
+    if (!(im->stream = PyObject_GetIter(l)))
+        return NULL;
+
+    if ((entry = PyIter_Next(im->stream))) {
+        root = Node__from_list_raw(im, entry, parent, &height);
+        Py_DECREF(entry);
+    } else {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "tree stream is empty");
+        root = NULL;
+    }
+
+    if (root && (entry = PyIter_Next(im->stream))) {
+        Py_DECREF(entry);
+        PyErr_SetString(PyExc_ValueError, "tree stream has extra entries");
+    }
+    if (root && PyErr_Occurred()) {
+        Py_DECREF(root);
+        root = NULL;
+    }
+    Py_CLEAR(im->stream);
+
+    return root;
+}
+
+#if 0
+                    PARENT                  PARENT
+                    /    \                  /     \
+                RIGHT           =>      PIVOT
+                /   \                   /   \
+            PIVOT    A              LEFT    RIGHT
+            /   \                          /    \
+        LEFT     B                        B      A
+#endif
+
+static Node * Node__rotate_cw(Node *self)
+{
+    Node *right = self->parent;
+    Node *pivot = self, *parent;
+    int old_bf, delta;
+
+    if (IS_NONE(right)) {
+        PyErr_SetString(PyExc_RuntimeError, "can't rotate root node");
+        return NULL;
+    } else if (right->right == self) {
+        PyErr_SetString(PyExc_RuntimeError, "can't rotate right subtree CW");
+        return NULL;
+    }
+
+    // Keep both alive while they are being relinked
+    Py_INCREF(pivot);
+    Py_INCREF(right);
+
+    // Save old subtree bf
+    old_bf = right->bf;
+    // Move B to RIGHT's left subtree
+    Node__link(right, pivot->right, 1);
+    // PIVOT takes RIGHT's place
+    Node__replace(right, pivot);
+    // RIGHT is PIVOT's right child now
+    Node__link(pivot, right, 0);
+
+    // Update bf's
+    parent = pivot->parent;
+    // RIGHT's left subtree is 1 node shorter now (minus PIVOT)
+    right->bf = old_bf - 1;
+    if (pivot->bf > 0)
         // If PIVOT bf > 0, PIVOT subtree height was represented by LEFT
         // LEFT is no longer RIGHT's successor, so compensate for it
         right->bf -= pivot->bf;
@@ -350,559 +1094,7183 @@ static Node * Node__rotate_cw(Node *self)
     if (right->bf < 0)
         // If RIGHT bf < 0, RIGHT subtree height is represented by A
         // A is now PIVOT's successor, update bf accordingly
-        pivot->bf += right->bf;
+        pivot->bf += right->bf;
+
+    delta = abs(pivot->bf) - abs(old_bf);
+    if (NOT_NONE(parent)) {
+        // When rotating, every height change in one node is accounted
+        // for double change in bf, e.g. when rotating tree with bf = 2 CW,
+        // the new bf will be 0, height will decrease by 1
+        if (delta > 1)
+            // Subtree height increased
+            Node__update_bf_on_increase(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
+        else if (delta < -1)
+            // Subtree height decreased
+            Node__update_bf_on_decrease(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
+    }
+
+    Py_DECREF(right);
+    Py_DECREF(pivot);
+
+    return pivot;
+}
+
+#if 0
+        PARENT                    PARENT
+        /    \                   /     \
+             LEFT         =>          PIVOT
+            /    \                    /   \
+           A    PIVOT              LEFT    RIGHT
+               /     \            /    \
+              B     RIGHT        A      B
+#endif
+
+static Node * Node__rotate_ccw(Node *self)
+{
+    Node *left = self->parent;
+    Node *pivot = self, *parent;
+    int old_bf, delta;
+
+    if (IS_NONE(left)) {
+        PyErr_SetString(PyExc_RuntimeError, "can't rotate root node");
+        return NULL;
+    } else if (left->left == self) {
+        PyErr_SetString(PyExc_RuntimeError, "can't rotate left subtree CCW");
+        return NULL;
+    }
+
+    // Keep both alive while they are being relinked
+    Py_INCREF(pivot);
+    Py_INCREF(left);
+
+    // Save old subtree bf
+    old_bf = left->bf;
+    // Move B to LEFT's right subtree
+    Node__link(left, pivot->left, 0);
+    // PIVOT takes LEFT's place
+    Node__replace(left, pivot);
+    // LEFT is PIVOT's left child now
+    Node__link(pivot, left, 1);
+
+    // Update bf's
+    parent = pivot->parent;
+    // LEFT's right subtree is 1 node shorter now (minus PIVOT)
+    left->bf = old_bf + 1;
+    if (pivot->bf < 0)
+        // If PIVOT bf < 0 PIVOT subtree height was represented by RIGHT
+        // RIGHT is no longer LEFT's successor, so compensate for it
+        left->bf -= pivot->bf;
+
+    // PIVOT's left subtree is 1 node longer now (plus LEFT)
+    pivot->bf += 1;
+    if (left->bf > 0)
+        // If LEFT bf > 0 LEFT subtree height is represented by A
+        // A is now PIVOT's successor, update bf accordingly
+        pivot->bf += left->bf;
+
+    delta = abs(pivot->bf) - abs(old_bf);
+    if (NOT_NONE(parent)) {
+        // When rotating, every height change in one node is accounted
+        // for double change in bf, e.g. when rotating tree with bf = 2 CW,
+        // the new bf will be 0, height will decrease by 1
+        if (delta > 1)
+            // Subtree height increased
+            Node__update_bf_on_increase(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
+        else if (delta < -1)
+            // Subtree height decreased
+            Node__update_bf_on_decrease(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
+    }
+
+    Py_DECREF(left);
+    Py_DECREF(pivot);
+
+    return pivot;
+}
+
+static Node * Node__delete(Node *self)
+{
+    /*
+        Unlinks the node from the tree in one pass. Returns the node the
+        removal took place next to, NULL if the tree is empty now
+    */
+
+    Node *p = self->parent, *pred, *start = NULL, *child;
+    int delta = 0;
+
+    // Keep the node alive until it is detached
+    Py_INCREF(self);
+
+    if (NOT_NONE(self->left) && NOT_NONE(self->right)) {
+        // Both children exist, the in-order predecessor takes the node's place
+        pred = Node__rightmost(self->left);
+        Py_INCREF(pred);
+
+        if (pred->parent == self) {
+            // The predecessor keeps its left subtree, which is one
+            // level shorter than the node's left subtree was
+            start = pred;
+            delta = -1;
+        } else {
+            // Predecessor's left subtree takes its place
+            start = pred->parent;
+            delta = 1;
+            Node__link(start, pred->left, 0);
+            Node__link(pred, self->left, 1);
+        }
+        Node__link(pred, self->right, 0);
+        pred->bf = self->bf;
+        Node__replace(self, pred);
+
+        Py_DECREF(pred);
+    } else {
+        child = NOT_NONE(self->left) ? self->left : self->right;
+        if (NOT_NONE(p)) {
+            start = p;
+            delta = p->left == self ? -1 : 1;
+        } else if (NOT_NONE(child))
+            // Root node, the only child is the new root
+            start = child;
+        Node__replace(self, child);
+    }
+
+    Node__detach(self);
+    Py_DECREF(self);
+
+    if (delta)
+        Node__update_bf_on_decrease(start, delta, 0);
+
+    return start;
+}
+
+static Py_ssize_t Node__len(Node *self)
+{
+    Py_ssize_t len = self->count;
+
+    if (NOT_NONE(self->left))
+        len += Node__len(self->left);
+    if (NOT_NONE(self->right))
+        len += Node__len(self->right);
+
+    return len;
+}
+
+static unsigned PY_LONG_LONG Node__mix(unsigned PY_LONG_LONG h)
+{
+    // SplitMix64 step, spreads the bits of the byte hashes. The increment
+    // keeps the empty entry off 0
+    h += 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+
+    return h ^ (h >> 31);
+}
+
+static unsigned PY_LONG_LONG Node__fnv(unsigned PY_LONG_LONG h,
+                                       const char *data, Py_ssize_t len)
+{
+    // FNV-1a over the bytes
+    Py_ssize_t i;
+
+    for (i=0; i<len; i++)
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+static unsigned PY_LONG_LONG Node__fnv_word(unsigned PY_LONG_LONG h, char tag,
+                                            unsigned PY_LONG_LONG v)
+{
+    // A tag and a little endian 64 bit word, the same on every host
+    char buf[9];
+    int i;
+
+    buf[0] = tag;
+    for (i=1; i<9; i++, v >>= 8)
+        buf[i] = (char)(v & 0xff);
+
+    return Node__fnv(h, buf, 9);
+}
+
+static int Node__stable_hash(PyObject *o, unsigned PY_LONG_LONG *h)
+{
+    /*
+        Feeds an encoding of the object into the FNV-1a hash h. Numbers,
+        strings, unicodes and tuples of them are encoded by value, so
+        they hash the same in every process and on every host, whatever
+        the hash seed. Equal numbers hash the same whatever their types.
+        Other objects are hashed by hash(), as stable as their __hash__
+    */
+
+    PY_LONG_LONG v;
+    PyObject *b;
+    double d;
+    long x;
+    Py_ssize_t i;
+    int overflow;
+
+    if (PyInt_Check(o))
+        *h = Node__fnv_word(*h, 'i', (PY_LONG_LONG)PyInt_AS_LONG(o));
+    else if (PyLong_Check(o)) {
+        v = PyLong_AsLongLongAndOverflow(o, &overflow);
+        if (v == -1 && PyErr_Occurred())
+            return -1;
+        if (overflow) {
+            // Too big for a word, marshal writes its digits the same everywhere
+            if (!(b = PyMarshal_WriteObjectToString(o, Py_MARSHAL_VERSION)))
+                return -1;
+            *h = Node__fnv(*h, PyString_AS_STRING(b), PyString_GET_SIZE(b));
+            Py_DECREF(b);
+        } else
+            *h = Node__fnv_word(*h, 'i', v);
+    } else if (PyFloat_Check(o)) {
+        d = PyFloat_AS_DOUBLE(o);
+        if (d == floor(d) && d >= -9223372036854775808.0 &&
+                d < 9223372036854775808.0)
+            // Whole floats are equal to ints, -0.0 to 0 as well
+            *h = Node__fnv_word(*h, 'i', (PY_LONG_LONG)d);
+        else if (d == floor(d) && !Py_IS_INFINITY(d)) {
+            // Bigger ones are hashed as the long they are equal to
+            if (!(b = PyLong_FromDouble(d)))
+                return -1;
+            i = Node__stable_hash(b, h);
+            Py_DECREF(b);
+            return i;
+        } else {
+            memcpy(&v, &d, 8);
+            *h = Node__fnv_word(*h, 'f', v);
+        }
+    } else if (PyString_Check(o)) {
+        *h = Node__fnv_word(*h, 's', PyString_GET_SIZE(o));
+        *h = Node__fnv(*h, PyString_AS_STRING(o), PyString_GET_SIZE(o));
+    } else if (PyUnicode_Check(o)) {
+        if (!(b = PyUnicode_AsUTF8String(o)))
+            return -1;
+        *h = Node__fnv_word(*h, 's', PyString_GET_SIZE(b));
+        *h = Node__fnv(*h, PyString_AS_STRING(b), PyString_GET_SIZE(b));
+        Py_DECREF(b);
+    } else if (PyTuple_Check(o)) {
+        *h = Node__fnv_word(*h, '(', PyTuple_GET_SIZE(o));
+        for (i=0; i<PyTuple_GET_SIZE(o); i++)
+            if (Node__stable_hash(PyTuple_GET_ITEM(o, i), h))
+                return -1;
+    } else if (o == Py_None)
+        *h = Node__fnv_word(*h, 'N', 0);
+    else {
+        if ((x = PyObject_Hash(o)) == -1)
+            return -1;
+        *h = Node__fnv_word(*h, 'h', (PY_LONG_LONG)x);
+    }
+
+    return 0;
+}
+
+static int Node__entry_hash(Node *self, unsigned PY_LONG_LONG *h)
+{
+    /*
+        Hash of the node's own entry, the key, the item if it's not the
+        key and the number of occurrences. Tombstones hash to 0
+    */
+
+    unsigned PY_LONG_LONG k = 0xcbf29ce484222325ULL, i = k;
+
+    *h = 0;
+    if (!self->count)
+        return 0;
+
+    if (Node__stable_hash(self->key, &k))
+        return -1;
+    *h = Node__mix(k);
+
+    if (self->item) {
+        if (Node__stable_hash(self->item, &i))
+            return -1;
+        *h = Node__mix(*h ^ Node__mix(i));
+    }
+    *h *= self->count;
+
+    return 0;
+}
+
+static int Node__hash(Node *self, unsigned PY_LONG_LONG *h)
+{
+    /*
+        Subtree hash, the sum of the entry hashes. Sums don't depend on
+        the shape, so trees with the same entries hash the same however
+        they were built and any key range hashes the same in both. Kept
+        in the nodes until they change, see Node__stale
+    */
+
+    unsigned PY_LONG_LONG left, right;
+
+    if (IS_NONE(self)) {
+        *h = 0;
+        return 0;
+    }
+    if (self->hashed) {
+        *h = self->hash;
+        return 0;
+    }
+
+    if (Node__hash(self->left, &left) || Node__hash(self->right, &right) ||
+            Node__entry_hash(self, h))
+        return -1;
+
+    *h += left + right;
+    self->hash = *h;
+    self->hashed = 1;
+
+    return 0;
+}
+
+static Py_ssize_t Node__weight(Node *self)
+{
+    /*
+        Number of keys in the subtree, duplicates included, tombstones
+        not. Kept in the nodes like the hash
+    */
+
+    if (IS_NONE(self))
+        return 0;
+
+    if (!self->weighed) {
+        self->weight = Node__weight(self->left) + Node__weight(self->right) +
+                       self->count;
+        self->weighed = 1;
+    }
+
+    return self->weight;
+}
+
+static Py_ssize_t Node__rank(Node *self, PyObject *key)
+{
+    /*
+        Number of keys less than the key in the subtree, duplicates
+        included. -1 if comparing fails
+    */
+
+    Py_ssize_t rank = 0;
+    int c;
+
+    while (NOT_NONE(self)) {
+        c = Node__compare(key, self->key);
+        if (c == -1 && PyErr_Occurred())
+            return -1;
+        if (!c)
+            return rank + Node__weight(self->left);
+        if (c > 0) {
+            rank += Node__weight(self->left) + self->count;
+            self = self->right;
+        } else
+            self = self->left;
+    }
+
+    return rank;
+}
+
+static int Node__above(Node *self, PyObject *lo, int open)
+{
+    // Whether the key is past the lower bound, -1 on errors
+    int c;
+
+    if (!lo)
+        return 1;
+
+    if ((c = Node__compare(self->key, lo)) == -1 && PyErr_Occurred())
+        return -1;
+
+    return c > 0 || (!c && !open);
+}
+
+static int Node__below(Node *self, PyObject *hi, int open)
+{
+    int c;
+
+    if (!hi)
+        return 1;
+
+    if ((c = Node__compare(self->key, hi)) == -1 && PyErr_Occurred())
+        return -1;
+
+    return c < 0 || (!c && !open);
+}
+
+static int Node__range_hash(Node *self, PyObject *lo, PyObject *hi, int open,
+                            unsigned PY_LONG_LONG *h)
+{
+    /*
+        Hash of the entries with keys between lo and hi, NULL for no
+        bound, exclusive if open is set. Takes whole subtree hashes off
+        the paths to the two bounds, O(log n)
+    */
+
+    unsigned PY_LONG_LONG part;
+    int in;
+
+    *h = 0;
+    while (NOT_NONE(self)) {
+        if (!lo && !hi) {
+            if (Node__hash(self, &part))
+                return -1;
+            *h += part;
+            break;
+        }
+
+        if ((in = Node__above(self, lo, open)) <= 0) {
+            if (in < 0)
+                return -1;
+            self = self->right;
+            continue;
+        }
+        if ((in = Node__below(self, hi, open)) <= 0) {
+            if (in < 0)
+                return -1;
+            self = self->left;
+            continue;
+        }
+
+        // In range, the bounds part ways here
+        if (Node__entry_hash(self, &part))
+            return -1;
+        *h += part;
+        if (Node__range_hash(self->left, lo, NULL, open, &part))
+            return -1;
+        *h += part;
+        self = self->right;
+        lo = NULL;
+    }
+
+    return 0;
+}
+
+static int Node__collect(Node *self, PyObject *lo, PyObject *hi, PyObject *keys)
+{
+    /*
+        Appends the live keys strictly between lo and hi in order
+    */
+
+    int above, below;
+
+    if (IS_NONE(self))
+        return 0;
+
+    if ((above = Node__above(self, lo, 1)) < 0 ||
+            (below = Node__below(self, hi, 1)) < 0)
+        return -1;
+
+    if (above && Node__collect(self->left, lo, hi, keys))
+        return -1;
+    if (above && below && self->count && PyList_Append(keys, self->key))
+        return -1;
+    if (below && Node__collect(self->right, lo, hi, keys))
+        return -1;
+
+    return 0;
+}
+
+static int Node__diff(Node *self, Node *other, PyObject *lo, PyObject *hi,
+                      PyObject *keys)
+{
+    /*
+        Appends the keys of the subtree, and of the other tree between
+        lo and hi, exclusive, with entries not the same in both. Stops
+        where the subtree hashes the same as the other tree range, so
+        only the paths to the differences are visited
+    */
+
+    unsigned PY_LONG_LONG a, b;
+    Node *n;
+
+    if (Node__hash(self, &a) || Node__range_hash(other, lo, hi, 1, &b))
+        return -1;
+    if (a == b)
+        return 0;
+
+    if (IS_NONE(self))
+        return Node__collect(other, lo, hi, keys);
+
+    if (Node__diff(self->left, other, lo, self->key, keys))
+        return -1;
+
+    if (Node__entry_hash(self, &a))
+        return -1;
+    b = 0;
+    n = Node__search(other, self->key);
+    if (n && !Node__compare(n->key, self->key) && Node__entry_hash(n, &b))
+        return -1;
+    if (PyErr_Occurred())
+        return -1;
+    if (a != b && PyList_Append(keys, self->key))
+        return -1;
+
+    return Node__diff(self->right, other, self->key, hi, keys);
+}
+
+/********************* Log ********************************/
+
+// Log sync policies
+#define SYNC_NONE 0         // Records are written out as the buffer fills up
+#define SYNC_BATCH 1        // Every batch of records is written and synced at once
+#define SYNC_ALWAYS 2       // Every change is synced before it returns
+
+// Record types
+#define REC_INSERT '+'
+#define REC_DELETE '-'
+#define REC_MULTI '*'       // Snapshot key with more occurrences, (item, count)
+
+#define LOG_MAGIC "AVLLOG1\n"
+#define SNAPSHOT_MAGIC "AVLSNP1\n"
+#define LOG_HEADER 16       // Magic and snapshot generation
+#define REC_HEADER 9        // Type, payload length and checksum
+#define LOG_BUFFER 65536    // Buffered bytes to write out at
+
+#ifdef __linux__
+#define LOG_FSYNC fdatasync
+#else
+#define LOG_FSYNC fsync
+#endif
+
+typedef struct LogBuffer {
+    char *data;
+    Py_ssize_t len;
+    Py_ssize_t alloc;
+} LogBuffer;
+
+typedef struct Log {
+    int fd;                 // -1 once a write has failed
+    PyObject *path;
+    PyObject *snapshot;     // Snapshot file the log goes on from
+    PY_LONG_LONG gen;       // Snapshot generation
+    int sync;
+    Py_ssize_t batch;       // Records per sync, SYNC_BATCH only
+    LogBuffer buf;          // Records not written yet
+    Py_ssize_t seq;         // Records since the snapshot
+    Py_ssize_t synced;      // Records on disk
+} Log;
+
+static void Log__put(char *p, unsigned PY_LONG_LONG v, int len)
+{
+    // Little endian
+    int i;
+
+    for (i=0; i<len; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static unsigned PY_LONG_LONG Log__get(const char *p, int len)
+{
+    unsigned PY_LONG_LONG v = 0;
+
+    while (len--)
+        v = (v << 8) | (uchar)p[len];
+
+    return v;
+}
+
+static uint Log__checksum(char op, const char *data, Py_ssize_t len)
+{
+    // FNV-1a over the record type and payload
+    uint h = (2166136261u ^ (uchar)op) * 16777619u;
+    Py_ssize_t i;
+
+    for (i=0; i<len; i++)
+        h = (h ^ (uchar)data[i]) * 16777619u;
+
+    return h;
+}
+
+static int Log__write(int fd, const char *data, Py_ssize_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static char * Log__reserve(LogBuffer *buf, Py_ssize_t len)
+{
+    /*
+        Returns the place for len more bytes at the end of the buffer
+    */
+
+    Py_ssize_t alloc = buf->alloc ? buf->alloc : 4096;
+    char *p;
+
+    if (buf->len + len > buf->alloc) {
+        while (alloc < buf->len + len)
+            alloc *= 2;
+        if (!(p = PyMem_Realloc(buf->data, alloc))) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        buf->data = p;
+        buf->alloc = alloc;
+    }
+
+    return buf->data + buf->len;
+}
+
+static int Log__encode(LogBuffer *buf, char op, PyObject *rec)
+{
+    /*
+        Adds a record with the marshalled payload to the buffer
+    */
+
+    Py_ssize_t len = PyString_GET_SIZE(rec);
+    char *p;
+
+    if (!(p = Log__reserve(buf, REC_HEADER + len)))
+        return -1;
+
+    p[0] = op;
+    Log__put(p + 1, len, 4);
+    Log__put(p + 5, Log__checksum(op, PyString_AS_STRING(rec), len), 4);
+    memcpy(p + REC_HEADER, PyString_AS_STRING(rec), len);
+    buf->len += REC_HEADER + len;
+
+    return 0;
+}
+
+static int Log__read(FILE *f, PY_LONG_LONG *left, char *op, PyObject **item)
+{
+    /*
+        Reads the next record of a file with left bytes to go. Returns 0
+        at the end of the file or at a record cut short by a crash, -1
+        on errors
+    */
+
+    char head[REC_HEADER], *data;
+    Py_ssize_t len;
+
+    if (*left < REC_HEADER || fread(head, 1, REC_HEADER, f) != REC_HEADER)
+        return 0;
+
+    len = Log__get(head + 1, 4);
+    if (len > *left - REC_HEADER)
+        return 0;
+
+    if (!(data = PyMem_Malloc(len ? len : 1))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (fread(data, 1, len, f) != (size_t)len ||
+            Log__checksum(head[0], data, len) != Log__get(head + 5, 4)) {
+        PyMem_Free(data);
+        return 0;
+    }
+
+    *item = PyMarshal_ReadObjectFromString(data, len);
+    PyMem_Free(data);
+    if (!*item)
+        return -1;
+
+    *op = head[0];
+    *left -= REC_HEADER + len;
+
+    return 1;
+}
+
+static FILE * Log__open_file(PyObject *path, const char *magic,
+                             PY_LONG_LONG *gen, PY_LONG_LONG *left)
+{
+    /*
+        Opens a log or snapshot file to read the records from. Sets gen
+        to the file generation, -1 if the header is cut short. Returns
+        NULL with no error set if there's no file
+    */
+
+    char head[LOG_HEADER];
+    struct stat st;
+    FILE *f;
+
+    if (!(f = fopen(PyString_AS_STRING(path), "rb"))) {
+        if (errno != ENOENT)
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                           PyString_AS_STRING(path));
+        return NULL;
+    }
+
+    if (fstat(fileno(f), &st)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyString_AS_STRING(path));
+        fclose(f);
+        return NULL;
+    }
+
+    *left = st.st_size - LOG_HEADER;
+    if (fread(head, 1, LOG_HEADER, f) != LOG_HEADER)
+        *gen = -1;
+    else if (memcmp(head, magic, 8)) {
+        // Not ours, don't go writing over it
+        PyErr_Format(PyExc_ValueError, "%s is not a tree %s",
+                     PyString_AS_STRING(path),
+                     memcmp(magic, LOG_MAGIC, 8) ? "snapshot" : "log");
+        fclose(f);
+        return NULL;
+    } else
+        *gen = Log__get(head + 8, 8);
+
+    return f;
+}
+
+static int Log__generation(PyObject *path, const char *magic,
+                           PY_LONG_LONG *gen)
+{
+    /*
+        Raises gen to the generation of the file, if there's one
+    */
+
+    PY_LONG_LONG g, left;
+    FILE *f;
+
+    if (!(f = Log__open_file(path, magic, &g, &left)))
+        return PyErr_Occurred() ? -1 : 0;
+    fclose(f);
+
+    *gen = MAX(*gen, g);
+    return 0;
+}
+
+static void Log__sync_dir(const char *path)
+{
+    /*
+        Makes a file rename in the directory of the path durable. Not
+        every file system can sync directories, that's not an error
+    */
+
+    const char *slash = strrchr(path, '/');
+    PyObject *dir;
+    int fd;
+
+    if (slash)
+        dir = PyString_FromStringAndSize(path, slash - path + 1);
+    else
+        dir = PyString_FromString(".");
+    if (!dir) {
+        PyErr_Clear();
+        return;
+    }
+
+    if ((fd = open(PyString_AS_STRING(dir), O_RDONLY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    Py_DECREF(dir);
+}
+
+static Log * Log__new(PyObject *path, PyObject *snapshot, PY_LONG_LONG gen,
+                      PY_LONG_LONG keep, int sync, Py_ssize_t batch)
+{
+    /*
+        Opens the log to append records after the first keep bytes of
+        them, cutting off the rest. A negative keep starts the log over
+        on top of the snapshot of generation gen
+    */
+
+    const char *name = PyString_AS_STRING(path);
+    char head[LOG_HEADER];
+    Log *log;
+    int fd;
+
+    if ((fd = open(name, O_WRONLY | O_CREAT, 0644)) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+        return NULL;
+    }
+
+    if (keep < 0) {
+        memcpy(head, LOG_MAGIC, 8);
+        Log__put(head + 8, gen, 8);
+        if (ftruncate(fd, 0) || Log__write(fd, head, LOG_HEADER))
+            goto err;
+    } else if (ftruncate(fd, LOG_HEADER + keep) ||
+               lseek(fd, LOG_HEADER + keep, SEEK_SET) < 0)
+        goto err;
+
+    // New records must not end up after what's cut off
+    if (LOG_FSYNC(fd))
+        goto err;
+
+    if (!(log = PyMem_New(Log, 1))) {
+        close(fd);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(log, 0, sizeof(Log));
+
+    log->fd = fd;
+    Py_INCREF(path);
+    log->path = path;
+    Py_INCREF(snapshot);
+    log->snapshot = snapshot;
+    log->gen = gen;
+    log->sync = sync;
+    log->batch = batch;
+
+    return log;
+
+    err:
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+        close(fd);
+        return NULL;
+}
+
+static void Log__free(Log *self)
+{
+    if (self->fd >= 0)
+        close(self->fd);
+    Py_DECREF(self->path);
+    Py_DECREF(self->snapshot);
+    PyMem_Free(self->buf.data);
+    PyMem_Free(self);
+}
+
+static int Log__flush(Log *self, int sync)
+{
+    /*
+        Writes out the buffered records, syncing the file if asked
+    */
+
+    int rc;
+
+    if (self->fd < 0) {
+        PyErr_SetString(PyExc_IOError, "log is broken by a failed write");
+        return -1;
+    }
+
+    rc = Log__write(self->fd, self->buf.data, self->buf.len);
+    if (!rc && sync)
+        rc = LOG_FSYNC(self->fd);
+    if (rc) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                       PyString_AS_STRING(self->path));
+        // Part of a record might be in the file, nothing can go after it
+        close(self->fd);
+        self->fd = -1;
+        return -1;
+    }
+
+    self->buf.len = 0;
+    if (sync)
+        self->synced = self->seq;
+
+    return 0;
+}
+
+static PyObject * Log__pack(Log *self, PyObject *item)
+{
+    /*
+        Returns the record payload for the item. Made before the change,
+        so an item the log can't take leaves the tree as it is
+    */
+
+    PyObject *rec;
+
+    if (self->fd < 0) {
+        PyErr_SetString(PyExc_IOError, "log is broken by a failed write");
+        return NULL;
+    }
+
+    if (!(rec = PyMarshal_WriteObjectToString(item, Py_MARSHAL_VERSION)))
+        return NULL;
+
+    if (PyString_GET_SIZE(rec) > 0x7fffffff) {
+        Py_DECREF(rec);
+        PyErr_SetString(PyExc_ValueError, "item is too big for the log");
+        return NULL;
+    }
+
+    return rec;
+}
+
+static int Log__append(Log *self, char op, PyObject *rec)
+{
+    /*
+        Logs a change about to be made, stealing the record payload. The
+        records are written out and synced as the sync policy says
+    */
+
+    int rc = Log__encode(&self->buf, op, rec);
+
+    Py_DECREF(rec);
+    if (rc)
+        return -1;
+    self->seq++;
+
+    if (self->sync == SYNC_ALWAYS ||
+            (self->sync == SYNC_BATCH && self->seq - self->synced >= self->batch))
+        return Log__flush(self, 1);
+    else if (self->buf.len >= LOG_BUFFER)
+        return Log__flush(self, 0);
+
+    return 0;
+}
+
+/********************* Tree functions ********************************/
+
+static AvlTree * AvlTree__new(PyTypeObject *type, PyTypeObject *node_type,
+                              int flags, PyObject *keyfunc)
+{
+    AvlTree *tree;
+
+    tree = (AvlTree *)type->tp_alloc(type, 0);
+    if (!tree)
+        return NULL;
+
+    Py_INCREF(node_type);
+    tree->node_type = node_type;
+    tree->flags = flags;
+    // Node API trees are built of nodes made outside, of generation 0
+    tree->gen = flags & TREE_PINNED ? 0 : ++generations;
+    Py_XINCREF(keyfunc);
+    tree->keyfunc = keyfunc;
+
+    return tree;
+}
+
+static void AvlTree__set_root(AvlTree *self, Node *node)
+{
+    /*
+        Makes a node not linked anywhere the root of an empty tree
+    */
+
+    Py_INCREF(node);
+    self->root = node;
+    Py_INCREF(self);
+    node->tree = self;
+}
+
+static void AvlTree__set_finger(AvlTree *self, Node *finger)
+{
+    Node *tmp = self->finger;
+
+    Py_XINCREF(finger);
+    self->finger = finger;
+    Py_XDECREF(tmp);
+}
+
+static void AvlTree__set_sweep(AvlTree *self, Node *sweep)
+{
+    Node *tmp = self->sweep;
+
+    Py_XINCREF(sweep);
+    self->sweep = sweep;
+    Py_XDECREF(tmp);
+}
+
+static Node * Node__fork(Node *self, Py_ssize_t gen)
+{
+    /*
+        Returns an unlinked copy of the node of the given generation,
+        holding the same children. The node stays with the snapshots
+        sharing it, its children's parent links to it are dropped so
+        that it goes away with the last of them
+    */
+
+    Node *n = Node__new(self->ob_type, self->key, self->left, self->right,
+                        (Node *)Py_None);
+
+    n->gen = gen;
+    n->count = self->count;
+    n->bf = self->bf;
+    Py_XINCREF(self->item);
+    n->item = self->item;
+
+    // Same keys, same hash and weight
+    n->hash = self->hash;
+    n->hashed = self->hashed;
+    n->weight = self->weight;
+    n->weighed = self->weighed;
+
+    if (NOT_NONE(self->left) && self->left->parent == self)
+        Node__set_parent(self->left, (Node *)Py_None);
+    if (NOT_NONE(self->right) && self->right->parent == self)
+        Node__set_parent(self->right, (Node *)Py_None);
+
+    return n;
+}
+
+static Node * AvlTree__own(AvlTree *self, Node *parent, int left)
+{
+    /*
+        Snapshots and copies share nodes with the tree. The tree only
+        changes the nodes of its own generation, a shared node is swapped
+        for a copy of the tree's generation on the way down to a change.
+        Takes the parent the tree owns, returns its child on the given
+        side once owned, None if there's no child
+    */
+
+    Node *child = left ? parent->left : parent->right;
+
+    if (IS_NONE(child) || child->gen == self->gen)
+        return child;
+
+    child = Node__fork(child, self->gen);
+    Node__link(parent, child, left);
+    Py_DECREF(child);
+
+    // The copy takes over the index entry, as Node__exchange does
+    if (self->index && PyDict_SetItem(self->index, child->key,
+                                      (PyObject *)child))
+        PyErr_Clear();
+    self->version++;
+
+    return child;
+}
+
+static Node * Node__own(Node *self, int left)
+{
+    /*
+        AvlTree__own for rebalancing, which only has the node to go by.
+        Nodes of the same generation as their parent are owned already,
+        so the tree is looked up only for the shared ones
+    */
+
+    Node *child = left ? self->left : self->right;
+    AvlTree *tree;
+
+    if (IS_NONE(child) || child->gen == self->gen ||
+            !(tree = Node__tree(self)))
+        return child;
+
+    return AvlTree__own(tree, self, left);
+}
+
+static Node * AvlTree__own_path(AvlTree *self, Path *path)
+{
+    /*
+        Takes over the shared nodes on a path from the root down, returns
+        the node on top
+    */
+
+    Node **nodes = path->nodes;
+    Py_ssize_t i;
+
+    for (i=1; i<path->len; i++)
+        nodes[i] = AvlTree__own(self, nodes[i-1], nodes[i-1]->left == nodes[i]);
+
+    return Path__top(path);
+}
+
+static void AvlTree__share(AvlTree *self)
+{
+    /*
+        Moves the tree on to a new generation once its nodes are shared
+        with another tree. The root is swapped for a copy right away, so
+        the tree always owns its root, the other nodes are copied on the
+        way down to the changes. The finger and the sweep can't climb
+        from shared nodes, they start over
+    */
+
+    Node *root = self->root, *n;
+
+    self->gen = ++generations;
+    self->flags |= TREE_SHARED;
+    self->version++;
+    AvlTree__set_finger(self, NULL);
+    AvlTree__set_sweep(self, NULL);
+    if (!root)
+        return;
+
+    // The old root keeps its reference to the tree no more
+    self->root = NULL;
+    root->tree = NULL;
+    Py_DECREF(self);
+
+    n = Node__fork(root, self->gen);
+    AvlTree__set_root(self, n);
+    Py_DECREF(n);
+    Py_DECREF(root);
+
+    if (self->index && PyDict_SetItem(self->index, n->key, (PyObject *)n))
+        PyErr_Clear();
+}
+
+static Node * AvlTree__lookup(AvlTree *self, PyObject *key)
+{
+    /*
+        Returns the node holding the key through the hash index, NULL if
+        there's none or the key can't be hashed. Nodes keep their keys for
+        life, so rotations don't affect the index
+    */
+
+    Node *n;
+
+    // PyDict_GetItem takes an unhashable key for a missing one
+    if (PyObject_Hash(key) == -1)
+        return NULL;
+    n = (Node *)PyDict_GetItem(self->index, key);
+
+    return n && n->count ? n : NULL;
+}
+
+static int AvlTree__reindex(AvlTree *self)
+{
+    /*
+        Rebuilds the hash index of a tree that has one
+    */
+
+    PyObject *index;
+    Node *n;
+
+    if (!self->index)
+        return 0;
+
+    if (!(index = PyDict_New()))
+        return -1;
+
+    for (n = self->root ? Node__leftmost(self->root) : NULL; n; n = Node__next(n))
+        if (PyDict_SetItem(index, n->key, (PyObject *)n)) {
+            Py_DECREF(index);
+            return -1;
+        }
+
+    Py_DECREF(self->index);
+    self->index = index;
+
+    return 0;
+}
+
+static Node * AvlTree__unlink(AvlTree *self, Node *node)
+{
+    /*
+        Node__delete keeping the hash index in step. Takes over the nodes
+        the removal moves, which may be shared with snapshots
+    */
+
+    Node *n;
+
+    if (self->index && PyDict_DelItem(self->index, node->key))
+        PyErr_Clear();
+
+    if (NOT_NONE(node->left) && NOT_NONE(node->right))
+        // The predecessor moves up, and the nodes down to it change
+        for (n = AvlTree__own(self, node, 1); NOT_NONE(n->right);
+             n = AvlTree__own(self, n, 0));
+    else if (IS_NONE(node->parent))
+        // The only child becomes the root
+        AvlTree__own(self, node, NOT_NONE(node->left));
+
+    return Node__delete(node);
+}
+
+static Node * AvlTree__locate(AvlTree *self, PyObject *key, int *c)
+{
+    /*
+        Same as Node__locate on the root, but starts from the last
+        insert/delete position while it's still in the tree. Returns
+        NULL if the tree is empty
+    */
+
+    *c = 0;
+    if (!self->root)
+        return NULL;
+
+    if (self->finger && Node__attached(self->root, self->finger))
+        return Node__finger_search(self->finger, key, c);
+    else
+        return Node__locate(self->root, key, c);
+}
+
+static Node * AvlTree__reach(AvlTree *self, PyObject *key, int *c)
+{
+    /*
+        AvlTree__locate for changes. A tree sharing nodes with snapshots
+        goes down from its root taking the shared nodes over, so that the
+        node returned and the nodes above it can be changed in place. The
+        finger and the nodes above it are owned, so is the node a finger
+        search ends at if it's of the tree's generation
+    */
+
+    Node *n, *child;
+
+    if (!(self->flags & TREE_SHARED))
+        return AvlTree__locate(self, key, c);
+
+    *c = 0;
+    if (!(n = self->root))
+        return NULL;
+
+    if (self->finger && Node__attached(n, self->finger)) {
+        n = Node__finger_search(self->finger, key, c);
+        if (PyErr_Occurred() || n->gen == self->gen)
+            return n;
+        n = self->root;
+    }
+
+    for (;;) {
+        *c = Node__compare(key, n->key);
+        if (!*c || (*c == -1 && PyErr_Occurred()))
+            return n;
+        child = *c < 0 ? n->left : n->right;
+        if (IS_NONE(child))
+            return n;
+        n = AvlTree__own(self, n, *c < 0);
+    }
+}
+
+static void AvlTree__purge_shared(AvlTree *self)
+{
+    /*
+        AvlTree__purge for trees sharing nodes with snapshots, which
+        can't climb from the sweep node. The sweep goes on from its key,
+        found again from the root, and the nodes down to a tombstone are
+        taken over before it's unlinked. A key that fails to compare
+        stops the sweep, it starts over next time
+    */
+
+    Path path = {NULL};
+    PyObject *key;
+    Node *n = self->sweep, *next;
+    int i, c;
+
+    if (n) {
+        Path__locate(&path, self->root, n->key, &c);
+        n = PyErr_Occurred() ? NULL : Path__ceil(&path, c);
+    } else if (self->dead <= self->garbage * (self->live + self->dead))
+        return;
+    else
+        n = Path__first(&path, self->root);
+
+    for (i=0; i<PURGE_STEPS && n; i++) {
+        if (n->count) {
+            n = Path__next(&path);
+            continue;
+        }
+
+        n = AvlTree__own_path(self, &path);
+        next = Path__next(&path);
+        key = next ? next->key : NULL;
+        Py_XINCREF(key);
+
+        AvlTree__unlink(self, n);
+        self->dead--;
+
+        n = key ? Path__locate(&path, self->root, key, &c) : NULL;
+        Py_XDECREF(key);
+    }
+    Path__clear(&path);
+
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        n = NULL;
+    }
+    AvlTree__set_sweep(self, self->dead ? n : NULL);
+}
+
+static void AvlTree__purge(AvlTree *self)
+{
+    /*
+        Physically removes tombstones once they make up more than the
+        garbage fraction of the tree. Only visits a few nodes per call,
+        sweeping the tree in order, so the cost of the removals is spread
+        over the operations that follow
+    */
+
+    Node *n = self->sweep, *next;
+    int i;
+
+    if (!self->dead) {
+        AvlTree__set_sweep(self, NULL);
+        return;
+    }
+
+    if (self->flags & TREE_SHARED) {
+        AvlTree__purge_shared(self);
+        return;
+    }
+
+    if (!n || !Node__attached(self->root, n)) {
+        // Nodes against nodes, duplicate keys share theirs
+        if (self->dead <= self->garbage * (self->live + self->dead))
+            return;
+        n = Node__leftmost(self->root);
+    }
+
+    for (i=0; i<PURGE_STEPS && n; i++) {
+        // Nodes don't move between keys, so the successor stays valid
+        next = Node__next(n);
+        if (!n->count) {
+            AvlTree__unlink(self, n);
+            self->dead--;
+        }
+        n = next;
+    }
+
+    // One pass over the tree per crossing of the threshold
+    AvlTree__set_sweep(self, self->dead ? n : NULL);
+}
+
+static Node * Node__build(Node **nodes, Py_ssize_t len, int *height)
+{
+    /*
+        Hangs sorted unlinked nodes into a perfectly balanced tree,
+        returns its root
+    */
+
+    Py_ssize_t mid = len / 2;
+    Node *root = nodes[mid];
+    int h_left = 0, h_right = 0;
+
+    if (mid > 0)
+        Node__link(root, Node__build(nodes, mid, &h_left), 1);
+    if (len - mid > 1)
+        Node__link(root, Node__build(nodes + mid + 1, len - mid - 1, &h_right), 0);
+
+    root->bf = h_left - h_right;
+    *height = 1 + MAX(h_left, h_right);
+
+    return root;
+}
+
+static int Node__merge_sort(Node **nodes, Node **tmp, Py_ssize_t len)
+{
+    Py_ssize_t mid = len / 2, i = 0, j = mid, k = 0;
+    int c;
+
+    if (len < 2)
+        return 0;
+
+    if (Node__merge_sort(nodes, tmp, mid) ||
+            Node__merge_sort(nodes + mid, tmp, len - mid))
+        return -1;
+
+    // Halves already in order, sorted input takes linear time
+    if ((c = Node__compare(nodes[mid-1]->key, nodes[mid]->key)) <= 0)
+        return c == -1 && PyErr_Occurred() ? -1 : 0;
+
+    while (i < mid && j < len) {
+        if ((c = Node__compare(nodes[j]->key, nodes[i]->key)) == -1 &&
+                PyErr_Occurred())
+            return -1;
+        tmp[k++] = c < 0 ? nodes[j++] : nodes[i++];
+    }
+    while (i < mid)
+        tmp[k++] = nodes[i++];
+
+    // The rest of the right half is in place already
+    memcpy(nodes, tmp, k * sizeof(Node *));
+
+    return 0;
+}
+
+/*
+    Parallel sorts and merges of native keys. Exact int and float keys
+    map to unsigned integers in the same order, which threads can sort
+    and merge without the GIL. Nodes still get built with the GIL held
+*/
+
+#define PARALLEL_MIN 32768      // Fewer keys stay on the calling thread
+#define PARALLEL_MAX 64         // Threads at most
+#define PARALLEL_JOBS 4         // Jobs per thread, for the fast ones to take more
+
+#define NATIVE_FLOATS 1         // Some keys are floats
+#define NATIVE_WIDE 2           // Some int keys don't fit a double exactly
+#define NATIVE_OTHER 4          // Some keys have no native image
+
+#define NATIVE_LESS(x, y) ((x).key < (y).key || \
+                           ((x).key == (y).key && (x).pos < (y).pos))
+
+typedef struct Native {
+    unsigned PY_LONG_LONG key;  // Image of the key, in key order
+    Py_ssize_t pos;             // Position in the input, breaks ties
+} Native;
+
+typedef struct Parallel {
+    void (*run)(void *);
+    char *jobs;
+    size_t size;                // Size of a job
+    Py_ssize_t len;             // Number of jobs
+    Py_ssize_t next;            // Next job to take
+} Parallel;
+
+typedef struct SortJob {
+    Native *keys;
+    Native *tmp;
+    Py_ssize_t len;
+} SortJob;
+
+typedef struct MergeJob {
+    Native *a, *b, *out;
+    Py_ssize_t la, lb;
+    Py_ssize_t k0, k1;          // Range of the merged output to fill
+} MergeJob;
+
+static int Parallel__threads(int threads)
+{
+    // 0 asks for a thread per online CPU
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    return threads < 1 ? 1 : MIN(threads, PARALLEL_MAX);
+}
+
+static void * Parallel__worker(void *arg)
+{
+    Parallel *p = (Parallel *)arg;
+    Py_ssize_t i;
+
+    while ((i = __sync_fetch_and_add(&p->next, 1)) < p->len)
+        p->run(p->jobs + i * p->size);
+
+    return NULL;
+}
+
+static void Parallel__run(void (*run)(void *), void *jobs, size_t size,
+                          Py_ssize_t len, int threads)
+{
+    /*
+        Runs the jobs on up to the given number of threads, the calling
+        one included, each taking the next job left once done with one.
+        Doesn't touch Python objects, call it without the GIL
+    */
+
+    Parallel p = {run, (char *)jobs, size, len, 0};
+    pthread_t tids[PARALLEL_MAX];
+    int n, i;
+
+    // Should threads run out, the ones started take the rest
+    for (n=0; n < threads - 1 && n < len - 1; n++)
+        if (pthread_create(&tids[n], NULL, Parallel__worker, &p))
+            break;
+
+    Parallel__worker(&p);
+    for (i=0; i<n; i++)
+        pthread_join(tids[i], NULL);
+}
+
+static int Native__scan(Node **nodes, Py_ssize_t len, int seen)
+{
+    /*
+        Adds the NATIVE_ flags of the node keys to the seen ones
+    */
+
+    PyObject *key;
+    PY_LONG_LONG v;
+    Py_ssize_t i;
+
+    for (i=0; i<len; i++) {
+        key = nodes[i]->key;
+        if (PyInt_CheckExact(key)) {
+            v = PyInt_AS_LONG(key);
+            if (v > ((PY_LONG_LONG)1 << 53) || v < -((PY_LONG_LONG)1 << 53))
+                seen |= NATIVE_WIDE;
+        } else if (PyFloat_CheckExact(key) &&
+                   !Py_IS_NAN(PyFloat_AS_DOUBLE(key)))
+            seen |= NATIVE_FLOATS;
+        else
+            return seen | NATIVE_OTHER;
+    }
+
+    return seen;
+}
+
+static int Native__usable(int seen)
+{
+    // Ints get compared as doubles as soon as there are floats
+    return !(seen & NATIVE_OTHER) &&
+           (seen & (NATIVE_FLOATS | NATIVE_WIDE)) !=
+                (NATIVE_FLOATS | NATIVE_WIDE);
+}
+
+static unsigned PY_LONG_LONG Native__image(PyObject *key, int seen)
+{
+    /*
+        Maps a key to an unsigned integer keeping the order of the keys
+        scanned. Ints flip their sign bit, doubles flip all their bits
+        when negative and the sign bit otherwise
+    */
+
+    union { double d; unsigned PY_LONG_LONG u; } v;
+    unsigned PY_LONG_LONG sign = (unsigned PY_LONG_LONG)1 << 63;
+
+    if (!(seen & NATIVE_FLOATS))
+        return (unsigned PY_LONG_LONG)(PY_LONG_LONG)PyInt_AS_LONG(key) ^ sign;
+
+    v.d = PyInt_CheckExact(key) ? (double)PyInt_AS_LONG(key)
+                                : PyFloat_AS_DOUBLE(key);
+    // -0.0 == 0.0
+    if (v.d == 0)
+        v.d = 0;
+
+    return v.u & sign ? ~v.u : v.u | sign;
+}
+
+static void Native__msort(Native *keys, Native *tmp, Py_ssize_t len)
+{
+    Py_ssize_t mid = len / 2, i = 0, j = mid, k = 0;
+
+    if (len < 2)
+        return;
+
+    Native__msort(keys, tmp, mid);
+    Native__msort(keys + mid, tmp, len - mid);
+
+    if (NATIVE_LESS(keys[mid-1], keys[mid]))
+        return;
+
+    while (i < mid && j < len)
+        tmp[k++] = NATIVE_LESS(keys[j], keys[i]) ? keys[j++] : keys[i++];
+    while (i < mid)
+        tmp[k++] = keys[i++];
+
+    memcpy(keys, tmp, k * sizeof(Native));
+}
+
+static void Native__sort_job(void *arg)
+{
+    SortJob *job = (SortJob *)arg;
+
+    Native__msort(job->keys, job->tmp, job->len);
+}
+
+static Py_ssize_t Native__corank(Native *a, Py_ssize_t la,
+                                 Native *b, Py_ssize_t lb, Py_ssize_t k)
+{
+    /*
+        Number of keys of a among the first k keys of the merge
+    */
+
+    Py_ssize_t lo = MAX(0, k - lb), hi = MIN(k, la), i;
+
+    while (lo < hi) {
+        i = lo + (hi - lo) / 2;
+        if (NATIVE_LESS(a[i], b[k-i-1]))
+            lo = i + 1;
+        else
+            hi = i;
+    }
+
+    return lo;
+}
+
+static void Native__merge_job(void *arg)
+{
+    MergeJob *job = (MergeJob *)arg;
+    Native *a = job->a, *b = job->b, *out = job->out;
+    Py_ssize_t i = Native__corank(a, job->la, b, job->lb, job->k0),
+               j = job->k0 - i,
+               i1 = Native__corank(a, job->la, b, job->lb, job->k1),
+               j1 = job->k1 - i1,
+               k = job->k0;
+
+    while (i < i1 && j < j1)
+        out[k++] = NATIVE_LESS(b[j], a[i]) ? b[j++] : a[i++];
+    while (i < i1)
+        out[k++] = a[i++];
+    while (j < j1)
+        out[k++] = b[j++];
+}
+
+static void Native__sort(Native *keys, Native *tmp, Py_ssize_t len,
+                         int threads)
+{
+    /*
+        Stable sort on the given number of threads, tmp holds len keys.
+        Each thread sorts a run, then pairs of runs get merged, every
+        merge split between the threads by rank. Call it without the GIL
+    */
+
+    SortJob sorts[PARALLEL_MAX];
+    MergeJob merges[2 * PARALLEL_MAX], *job;
+    Py_ssize_t bounds[PARALLEL_MAX + 1], lo, mid, hi;
+    Native *src = keys, *dst = tmp, *swap;
+    int runs = threads, pairs, pieces, i, p, n;
+
+    for (i=0; i<=runs; i++)
+        bounds[i] = len / runs * i + len % runs * i / runs;
+
+    for (i=0; i<runs; i++) {
+        sorts[i].keys = keys + bounds[i];
+        sorts[i].tmp = tmp + bounds[i];
+        sorts[i].len = bounds[i+1] - bounds[i];
+    }
+    Parallel__run(Native__sort_job, sorts, sizeof(SortJob), runs, threads);
+
+    while (runs > 1) {
+        pairs = runs / 2;
+        pieces = MAX(1, threads / pairs);
+        n = 0;
+
+        // An odd run out gets merged with nothing, that is copied over
+        for (p=0; p < (runs + 1) / 2; p++) {
+            lo = bounds[2*p];
+            mid = bounds[MIN(2*p + 1, runs)];
+            hi = bounds[MIN(2*p + 2, runs)];
+            for (i=0; i < (p < pairs ? pieces : 1); i++) {
+                job = &merges[n++];
+                job->a = src + lo;
+                job->la = mid - lo;
+                job->b = src + mid;
+                job->lb = hi - mid;
+                job->out = dst + lo;
+                job->k0 = (hi - lo) * i / (p < pairs ? pieces : 1);
+                job->k1 = (hi - lo) * (i + 1) / (p < pairs ? pieces : 1);
+            }
+            // Runs ahead are read already
+            bounds[p] = lo;
+        }
+        runs = (runs + 1) / 2;
+        bounds[runs] = len;
+
+        Parallel__run(Native__merge_job, merges, sizeof(MergeJob), n, threads);
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != keys)
+        memcpy(keys, src, len * sizeof(Native));
+}
+
+static int Node__native_sort(Node **nodes, Py_ssize_t len, int threads)
+{
+    /*
+        Node__sort on several threads if the keys are native ones.
+        Returns 1 leaving the nodes alone if they aren't
+    */
+
+    Native *keys;
+    Node **sorted;
+    Py_ssize_t i;
+    int seen = Native__scan(nodes, len, 0);
+
+    if (!Native__usable(seen))
+        return 1;
+
+    // The keys, then room for the merges and the sorted nodes
+    if (!(keys = PyMem_New(Native, 2 * len))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i=0; i<len; i++) {
+        keys[i].key = Native__image(nodes[i]->key, seen);
+        keys[i].pos = i;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    Native__sort(keys, keys + len, len, threads);
+    Py_END_ALLOW_THREADS
+
+    sorted = (Node **)(keys + len);
+    for (i=0; i<len; i++)
+        sorted[i] = nodes[keys[i].pos];
+    memcpy(nodes, sorted, len * sizeof(Node *));
+    PyMem_Free(keys);
+
+    return 0;
+}
+
+static int Node__sort(Node **nodes, Py_ssize_t len, int threads)
+{
+    /*
+        Stable sort of unlinked nodes by key, native keys get sorted on
+        the given number of threads
+    */
+
+    Node **tmp;
+    int rc;
+
+    threads = Parallel__threads(threads);
+    if (threads > 1 && len >= PARALLEL_MIN &&
+            (rc = Node__native_sort(nodes, len, threads)) <= 0)
+        return rc;
+
+    if (!(tmp = PyMem_New(Node *, len))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    rc = Node__merge_sort(nodes, tmp, len);
+    PyMem_Free(tmp);
+
+    return rc;
+}
+
+static Node * Node__clone(PyTypeObject *type, Node *node, Py_ssize_t count)
+{
+    /*
+        Returns an unlinked copy of the node with the given key count
+    */
+
+    Node *n = Node__new(type, node->key, (Node *)Py_None, (Node *)Py_None,
+                        (Node *)Py_None);
+
+    n->count = count;
+    Py_XINCREF(node->item);
+    n->item = node->item;
+
+    return n;
+}
+
+static int AvlTree__plant(AvlTree *self, Node **nodes, Py_ssize_t len)
+{
+    /*
+        Fills the empty tree with sorted unlinked nodes, taking over
+        the array references
+    */
+
+    Py_ssize_t i;
+    int height;
+
+    self->version++;
+    for (i=0; i<len; i++)
+        nodes[i]->gen = self->gen;
+    if (len)
+        AvlTree__set_root(self, Node__build(nodes, len, &height));
+
+    for (i=0; i<len; i++) {
+        self->size += nodes[i]->count;
+        self->dead += !nodes[i]->count;
+        self->live += !!nodes[i]->count;
+        Py_DECREF(nodes[i]);
+    }
+
+    return AvlTree__reindex(self);
+}
+
+static int AvlTree__writable(AvlTree *self)
+{
+    /*
+        Makes sure the tree can be changed
+    */
+
+    if (self->flags & TREE_FROZEN) {
+        PyErr_SetString(PyExc_RuntimeError, "snapshot is read-only");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int AvlTree__compact(AvlTree *self)
+{
+    /*
+        Rebuilds the tree in linear time dropping all the tombstones. A
+        tree sharing nodes with snapshots is rebuilt of copies, leaving
+        the shared nodes alone, and owns all its nodes after
+    */
+
+    Path path = {NULL};
+    Node **nodes, *n, *root;
+    Py_ssize_t len = 0, live = 0, i;
+    int shared = self->flags & TREE_SHARED;
+
+    if (AvlTree__writable(self))
+        return -1;
+
+    if (!(root = self->root))
+        return 0;
+
+    for (n = Path__first(&path, root); n; n = Path__next(&path))
+        len++;
+
+    if (PyErr_Occurred() || !(nodes = PyMem_New(Node *, len))) {
+        Path__clear(&path);
+        if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        return -1;
+    }
+
+    // The stack is as deep as it gets already
+    for (n = Path__first(&path, root), i = 0; n; n = Path__next(&path), i++)
+        if (shared)
+            nodes[i] = Node__clone(n->ob_type, n, n->count);
+        else {
+            Py_INCREF(n);
+            nodes[i] = n;
+        }
+    Path__clear(&path);
+
+    // Take the tree apart, the array keeps the nodes alive
+    self->root = NULL;
+    root->tree = NULL;
+    Py_DECREF(self);
+    Py_DECREF(root);
+    if (shared) {
+        // Old nodes of the tree may linger, the new ones are told apart
+        self->gen = ++generations;
+        self->flags &= ~TREE_SHARED;
+    } else
+        for (i=0; i<len; i++)
+            Node__detach(nodes[i]);
+    AvlTree__set_finger(self, NULL);
+
+    for (i=0; i<len; i++)
+        if (nodes[i]->count)
+            nodes[live++] = nodes[i];
+        else
+            Py_DECREF(nodes[i]);
+
+    self->size = self->dead = self->live = 0;
+    i = AvlTree__plant(self, nodes, live);
+    PyMem_Free(nodes);
+
+    AvlTree__set_sweep(self, NULL);
+
+    return i;
+}
+
+static Node * AvlTree__insert_at(AvlTree *self, Node *p, int c,
+                                 PyObject *key, PyObject *item)
+{
+    /*
+        Inserts the key next to p, the last node checked by a search for
+        the key, NULL if the tree is empty. c is how the key compared to
+        p, so no more comparisons are needed. Returns the node holding
+        the key
+    */
+
+    PyObject *tmp, *rec = NULL;
+    Node *n;
+
+    // The search may have failed comparing keys
+    if (PyErr_Occurred())
+        return NULL;
+
+    // Fail before linking anything if the key can't be indexed or logged
+    if (self->index && PyObject_Hash(key) == -1)
+        return NULL;
+    if (p && !c && p->count && !(self->flags & TREE_MULTI)) {
+        PyErr_SetString(PyExc_KeyError, "key already present");
+        return NULL;
+    }
+    if (self->log && !(rec = Log__pack(self->log, item)))
+        return NULL;
+
+    self->version++;
+    if (p && !c) {
+        // The change is logged before the tree sees it
+        if (rec && Log__append(self->log, REC_INSERT, rec))
+            return NULL;
+
+        if (!p->count) {
+            // Tombstone, the node comes back to life with the new item
+            tmp = p->item;
+            p->item = NULL;
+            if (item != key) {
+                Py_INCREF(item);
+                p->item = item;
+            }
+            Py_XDECREF(tmp);
+            self->dead--;
+            self->live++;
+        }
+        p->count++;
+        Node__stale(p);
+        n = p;
+    } else {
+        n = Node__new(self->node_type, key, (Node *)Py_None, (Node *)Py_None,
+                      p ? p : (Node *)Py_None);
+        n->gen = self->gen;
+        if (item != key) {
+            Py_INCREF(item);
+            n->item = item;
+        }
+
+        if (self->index && PyDict_SetItem(self->index, key, (PyObject *)n)) {
+            Py_XDECREF(rec);
+            Py_DECREF(n);
+            return NULL;
+        }
+        if (rec && Log__append(self->log, REC_INSERT, rec)) {
+            // Take the node back out of the index, the tree stays as it was
+            if (self->index)
+                PyDict_DelItem(self->index, key);
+            Py_DECREF(n);
+            return NULL;
+        }
+
+        if (p) {
+            Node__link(p, n, c < 0);
+            Node__update_bf_on_increase(p, c < 0 ? 1 : -1, 0);
+        } else
+            AvlTree__set_root(self, n);
+        Py_DECREF(n);
+        self->live++;
+    }
+
+    self->size++;
+    AvlTree__purge(self);
+
+    return n;
+}
+
+static int AvlTree__insert(AvlTree *self, PyObject *item)
+{
+    PyObject *key;
+    Node *n;
+    int c = 0;
+
+    if (AvlTree__writable(self))
+        return -1;
+
+    if (!(key = AvlTree__key(self, item)))
+        return -1;
+
+    // A key already in the index needs no search, unless the node
+    // is shared with a snapshot
+    n = self->index ? (Node *)PyDict_GetItem(self->index, key) : NULL;
+    if (!n || n->gen != self->gen)
+        n = AvlTree__reach(self, key, &c);
+    n = AvlTree__insert_at(self, n, c, key, item);
+    Py_DECREF(key);
+    if (!n)
+        return -1;
+
+    AvlTree__set_finger(self, n);
+    return 0;
+}
+
+static int AvlTree__fill(AvlTree *self, PyObject *items, int sorted,
+                         int threads)
+{
+    /*
+        Builds the empty tree from a bulk of items in linear time once
+        they are sorted. Unless told the items are sorted already, sorts
+        them by key first, keeping the first of equal items on top
+    */
+
+    PyObject *seq, **arr, *key;
+    Py_ssize_t len, i, j = 0;
+    Node **nodes, *n;
+    int c;
+
+    if (!(seq = PySequence_Fast(items, "iterable is required")))
+        return -1;
+
+    len = PySequence_Fast_GET_SIZE(seq);
+    arr = PySequence_Fast_ITEMS(seq);
+
+    if (!(nodes = PyMem_New(Node *, len))) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i=0; i<len; i++) {
+        if (!(key = AvlTree__key(self, arr[i])))
+            goto err;
+        n = Node__new(self->node_type, key, (Node *)Py_None, (Node *)Py_None,
+                      (Node *)Py_None);
+        if (key != arr[i]) {
+            Py_INCREF(arr[i]);
+            n->item = arr[i];
+        }
+        Py_DECREF(key);
+        nodes[j++] = n;
+    }
+
+    if (!sorted && Node__sort(nodes, len, threads))
+        goto err;
+
+    // Merge equal keys
+    for (i=j=0; i<len; i++) {
+        n = nodes[i];
+        c = j ? Node__compare(nodes[j-1]->key, n->key) : -1;
+        if (c == -1 && PyErr_Occurred())
+            break;
+
+        if (c < 0) {
+            nodes[j++] = n;
+            continue;
+        } else if (c > 0) {
+            PyErr_SetString(PyExc_ValueError, "items are not sorted");
+            break;
+        } else if (!(self->flags & TREE_MULTI)) {
+            PyErr_SetString(PyExc_KeyError, "key already present");
+            break;
+        }
+        nodes[j-1]->count++;
+        Py_DECREF(n);
+    }
+    if (i < len) {
+        // The unmerged rest has to go as well
+        for (; i<len; i++)
+            nodes[j++] = nodes[i];
+        goto err;
+    }
+
+    i = AvlTree__plant(self, nodes, j);
+    PyMem_Free(nodes);
+    Py_DECREF(seq);
+
+    return i;
+
+    err:
+        for (i=0; i<j; i++)
+            Py_DECREF(nodes[i]);
+        PyMem_Free(nodes);
+        Py_DECREF(seq);
+        return -1;
+}
+
+static int AvlTree__remove(AvlTree *self, Node *node)
+{
+    /*
+        Takes one occurrence of the node's key out of the tree
+    */
+
+    PyObject *rec = NULL;
+    int unlink = node->count <= 1 && !(self->flags & TREE_LAZY);
+
+    if (unlink && (self->flags & TREE_PINNED) && node == self->root &&
+            IS_NONE(node->left) && IS_NONE(node->right)) {
+        // Nothing would be left to refer to the tree by
+        PyErr_SetString(PyExc_RuntimeError, "can't remove the last node");
+        return -1;
+    }
+
+    // The change is logged before the tree sees it
+    if (self->log && (!(rec = Log__pack(self->log, NODE_ITEM(node))) ||
+                      Log__append(self->log, REC_DELETE, rec)))
+        return -1;
+
+    self->version++;
+    if (!unlink) {
+        // The last occurrence of a lazy tree key leaves a tombstone
+        if (!--node->count) {
+            self->dead++;
+            self->live--;
+        }
+        Node__stale(node);
+    } else {
+        node = AvlTree__unlink(self, node);
+        self->live--;
+    }
+
+    self->size--;
+    AvlTree__set_finger(self, node);
+    AvlTree__purge(self);
+
+    return 0;
+}
+
+static Node * AvlTree__hold(AvlTree *self)
+{
+    /*
+        Node API trees are referred to by their root node objects. Returns
+        a new reference to the root of such a tree, to be put back on top
+        by AvlTree__pin once the tree is changed, NULL for other trees
+    */
+
+    if (!(self->flags & TREE_PINNED))
+        return NULL;
+
+    Py_XINCREF(self->root);
+    return self->root;
+}
+
+static int AvlTree__pin(AvlTree *self, Node *handle)
+{
+    /*
+        Returns 1 if the handle had to be exchanged with the new root
+    */
+
+    Node *root = self->root;
+    int moved = 0;
+
+    if (!handle)
+        return 0;
+
+    if (root && root != handle) {
+        Node__exchange(handle, root);
+        Py_INCREF(handle);
+        self->root = handle;
+        Py_DECREF(root);
+        moved = 1;
+    }
+    Py_DECREF(handle);
+
+    return moved;
+}
+
+/********************* Export functions ********************************/
+
+static int Node_init(Node *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"item", "left", "right", "parent", "multi", "key",
+                             NULL};
+    PyObject *item, *key, *tmp, *keyfunc = NULL;
+    AvlTree *tree;
+    Node *left = NULL;
+    Node *right = NULL;
+    Node *parent = NULL;
+    int multi = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOiO", kwlist,
+                                     &item, &left, &right, &parent, &multi,
+                                     &keyfunc))
+        return -1;
+
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+
+    if (keyfunc) {
+        if (!(key = PyObject_CallFunctionObjArgs(keyfunc, item, NULL)))
+            return -1;
+    } else {
+        key = item;
+        Py_INCREF(key);
+    }
+
+    // Attached nodes take their ancestors' hashes along
+    Node__stale(self);
+    self->count = 1;
+
+    tmp = self->item;
+    self->item = NULL;
+    if (key != item) {
+        Py_INCREF(item);
+        self->item = item;
+    }
+    Py_XDECREF(tmp);
+
+    if (!left)
+        left = (Node *)Py_None;
+    if (!right)
+        right = (Node *)Py_None;
+    if (!parent)
+        parent = (Node *)Py_None;
+
+    tmp = self->key;
+    self->key = key;
+    Py_XDECREF(tmp);
+
+    tmp = (PyObject *)self->left;
+    Py_INCREF(left);
+    self->left = left;
+    Py_XDECREF(tmp);
+
+    tmp = (PyObject *)self->right;
+    Py_INCREF(right);
+    self->right = right;
+    Py_XDECREF(tmp);
+
+    tmp = (PyObject *)self->parent;
+    Py_INCREF(parent);
+    self->parent = parent;
+    Py_XDECREF(tmp);
+
+    if (IS_NONE(parent)) {
+        // Root node, the tree is referred to by it
+        tree = AvlTree__new(&AvlTreeType, self->ob_type,
+                            TREE_PINNED | (multi ? TREE_MULTI : 0), keyfunc);
+        if (!tree)
+            return -1;
+
+        tmp = (PyObject *)self->tree;
+        AvlTree__set_root(tree, self);
+        tree->size = Node__len(self);
+        Py_DECREF(tree);
+        Py_XDECREF(tmp);
+    }
+
+    return 0;
+}
+
+static Node * Node_search(Node *self, PyObject *args)
+{
+    Node *n;
+    PyObject *item, *key;
+    int c;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(key = Node__key(self, item)))
+        return NULL;
+
+    n = Node__locate(self, key, &c);
+    Py_DECREF(key);
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (n->count && !c) {
+        Py_INCREF(n);
+        return n;
+    } else {
+        PyErr_SetString(PyExc_KeyError, "key not found");
+        return NULL;
+    }
+}
+
+static AvlTree * Node__get_tree(Node *self)
+{
+    /*
+        Nodes shared with snapshots are in several trees at once, their
+        parent links may lead to any of them or to none, so the Node API
+        only goes through the nodes a tree owns
+    */
+
+    AvlTree *tree = Node__tree(self);
+
+    if (!tree)
+        PyErr_SetString(PyExc_RuntimeError, "node is not in a tree");
+    else if (tree->gen != self->gen) {
+        PyErr_SetString(PyExc_RuntimeError, "node is shared with a snapshot");
+        tree = NULL;
+    }
+
+    return tree;
+}
+
+static PyObject * Node_insert(Node *self, PyObject *args)
+{
+    PyObject *item;
+    AvlTree *tree;
+    Node *handle;
+    int rc;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(tree = Node__get_tree(self)))
+        return NULL;
+
+    // The node's tree might be referred to by its nodes only
+    Py_INCREF(tree);
+    handle = AvlTree__hold(tree);
+    rc = AvlTree__insert(tree, item);
+    AvlTree__pin(tree, handle);
+    Py_DECREF(tree);
+    if (rc)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static int AvlTree__delete(AvlTree *self, PyObject *item)
+{
+    PyObject *key;
+    Node *node;
+    int c = 0;
+
+    if (AvlTree__writable(self))
+        return -1;
+
+    if (!(key = AvlTree__key(self, item)))
+        return -1;
+
+    if (self->index)
+        node = AvlTree__lookup(self, key);
+    if (!self->index || (node && node->gen != self->gen))
+        node = AvlTree__reach(self, key, &c);
+    Py_DECREF(key);
+    if (PyErr_Occurred())
+        return -1;
+    if (!node || !node->count || c) {
+        PyErr_SetString(PyExc_KeyError, "key not found");
+        return -1;
+    }
+
+    return AvlTree__remove(self, node);
+}
+
+static PyObject * Node_delete(Node *self, PyObject *args)
+{
+    PyObject *item;
+    AvlTree *tree;
+    Node *handle;
+    int rc;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(tree = Node__get_tree(self)))
+        return NULL;
+
+    // The node's tree might be referred to by its nodes only
+    Py_INCREF(tree);
+    handle = AvlTree__hold(tree);
+    rc = AvlTree__delete(tree, item);
+    AvlTree__pin(tree, handle);
+    Py_DECREF(tree);
+    if (rc)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * Node_from_list(PyTypeObject *type, PyObject *args,
+                                 PyObject *kwargs)
+{
+    static char *kwlist[] = {"l", "multi", "key", NULL};
+    PyObject *o, *l, *root, *keyfunc = NULL;
+    Py_ssize_t len, i;
+    PyObject **arr;
+    AvlTree *tree;
+    int multi = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO", kwlist,
+                                     &o, &multi, &keyfunc))
+        return NULL;
+
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+
+    l = PySequence_Fast(o, "sequence is required");
+    if (!l)
+        return NULL;
+
+    len = PySequence_Fast_GET_SIZE(l);
+    arr = PySequence_Fast_ITEMS(l);
+
+    tree = AvlTree__new(&AvlTreeType, type,
+                        TREE_PINNED | (multi ? TREE_MULTI : 0), keyfunc);
+    if (!tree) {
+        Py_DECREF(l);
+        return NULL;
+    }
+
+    for (i=0; i<len; i++)
+        if (AvlTree__insert(tree, arr[i])) {
+            Py_DECREF(l);
+            Py_DECREF(tree);
+            return NULL;
+        }
+    Py_DECREF(l);
+
+    // The root keeps the tree alive, an empty one is gone with it
+    root = tree->root ? (PyObject *)tree->root : Py_None;
+    Py_INCREF(root);
+    Py_DECREF(tree);
+
+    return root;
+}
+
+static PyObject * Node_from_list_raw(PyTypeObject *type, PyObject *args,
+                                     PyObject *kwargs)
+{
+    static char *kwlist[] = {"l", "parent", "multi", "key", "validate", NULL};
+    PyObject *l, *parent=NULL, *keyfunc=NULL;
+    RawImport im = {type};
+    AvlTree *tree;
+    Node *node;
+    int multi = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOi", kwlist,
+                                     &l, &parent, &multi, &keyfunc,
+                                     &im.validate))
+        return NULL;
+
+    if (!parent)
+        parent = Py_None;
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+
+    im.keyfunc = keyfunc;
+    node = RawImport__run(&im, l, (Node *)parent);
+    if (!node)
+        return NULL;
+
+    if (IS_NONE(parent)) {
+        tree = AvlTree__new(&AvlTreeType, type,
+                            TREE_PINNED | (multi ? TREE_MULTI : 0), keyfunc);
+        if (!tree) {
+            Py_DECREF(node);
+            return NULL;
+        }
+        AvlTree__set_root(tree, node);
+        tree->size = im.size;
+        tree->live = im.live;
+        Py_DECREF(tree);
+    }
+
+    return (PyObject *)node;
+}
+
+static PyObject * Node__to_list(Node *self, int multi)
+{
+    PyObject *left=Py_None, *right=Py_None;
+
+    if (NOT_NONE(self->left))
+        left = Node__to_list(self->left, multi);
+    else
+        Py_INCREF(left);
+
+    if (NOT_NONE(self->right))
+        right = Node__to_list(self->right, multi);
+    else
+        Py_INCREF(right);
+
+    if (multi)
+        return Py_BuildValue("ONNn", NODE_ITEM(self), left, right, self->count);
+    else
+        return Py_BuildValue("ONN", NODE_ITEM(self), left, right);
+}
+
+static PyObject * Node_to_list(Node *self)
+{
+    AvlTree *tree = Node__tree(self);
+
+    return Node__to_list(self, tree && (tree->flags & TREE_MULTI));
+}
+
+static PyObject * Node_count(Node *self, PyObject *args)
+{
+    PyObject *item, *key;
+    Node *n;
+    int c;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(key = Node__key(self, item)))
+        return NULL;
+
+    n = Node__locate(self, key, &c);
+    Py_DECREF(key);
+    if (PyErr_Occurred())
+        return NULL;
+
+    return PyInt_FromSsize_t(c ? 0 : n->count);
+}
+
+static PyObject * Node_rank(Node *self, PyObject *args)
+{
+    PyObject *item, *key;
+    Py_ssize_t rank;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(key = Node__key(self, item)))
+        return NULL;
+
+    rank = Node__rank(self, key);
+    Py_DECREF(key);
+    if (rank < 0)
+        return NULL;
+
+    return PyInt_FromSsize_t(rank);
+}
+
+static PyObject * Node_iter(Node *self)
+{
+    // Items of the node's tree in key order, repeated by multiplicity
+    PyObject *args, *it;
+
+    if (!(args = PyTuple_Pack(1, self)))
+        return NULL;
+    it = avl_merge(NULL, args, NULL);
+    Py_DECREF(args);
+
+    return it;
+}
+
+static PyObject * Node_to_dict(Node *self, PyObject *args)
+{
+    PyObject *vargs, *d = NULL;
+    
+    if (!PyArg_ParseTuple(args, "|O", &d))
+        return NULL;
+    
+    if (!d) {
+        if (!(d = PyDict_New()))
+            return NULL;
+    } else
+        Py_INCREF(d);
+
+    // Tombstones are skipped
+    if (self->count && PyDict_SetItem(d, self->key, (PyObject *)self))
+        goto e2;
+    
+    vargs = Py_BuildValue("(O)", d);
+    if (NOT_NONE(self->left))
+        if (!Node_to_dict(self->left, vargs))
+            goto e1;
+    if (NOT_NONE(self->right))
+        if (!Node_to_dict(self->right, vargs))
+            goto e1;
+
+    Py_DECREF(vargs);
+    return d;
+    
+    e1:
+        Py_DECREF(vargs);
+    e2:
+        Py_DECREF(d);
+        return NULL;
+}
+
+static PyObject * Node_rightmost(Node *self)
+{
+    PyObject * node;
+
+    node = (PyObject *)Node__rightmost(self);
+    Py_INCREF(node);
+
+    return node;
+}
+
+static PyObject * Node_height(Node *self)
+{
+    return Py_BuildValue("I", Node__height(self));
+}
+
+static PyObject * Node_calc_bf(Node *self)
+{
+    return Py_BuildValue("i", Node__calc_bf(self));
+}
+
+static PyObject * Node__rotate(Node *self, Node * (*rotate)(Node *))
+{
+    AvlTree *tree = NULL;
+    Node *handle, *pivot;
+
+    // Nodes made outside of trees are of generation 0 and may be rotated
+    // on their own, the others only in a tree that owns them
+    if ((self->gen || Node__tree(self)) &&
+            (!(tree = Node__get_tree(self)) || AvlTree__writable(tree)))
+        return NULL;
+
+    if (tree)
+        tree->version++;
+    handle = tree ? AvlTree__hold(tree) : NULL;
+    pivot = rotate(self);
+    if (tree)
+        AvlTree__pin(tree, handle);
+
+    if (pivot) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    } else
+        return NULL;
+}
+
+static PyObject * Node_rotate_cw(Node *self)
+{
+    return Node__rotate(self, Node__rotate_cw);
+}
+
+static PyObject * Node_rotate_ccw(Node *self)
+{
+    return Node__rotate(self, Node__rotate_ccw);
+}
+
+static PyObject * Node_traverse(Node *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *f, *nargs, *it, *rc;
+
+    f = PyTuple_GetItem(args, 0);
+    if (!f) {
+        PyErr_SetString(PyExc_TypeError, "function takes at least 1 argument");
+        return NULL;
+    }
+
+    if (!PyCallable_Check(f)) {
+        PyErr_SetString(PyExc_TypeError, "first parameter must be a callable object");
+        return NULL;
+    }
+
+    it = PyObject_GetIter(args);
+    nargs = PySequence_Tuple(it);
+    Py_DECREF(it);
+
+    Py_INCREF(self);
+    if (PyTuple_SetItem(nargs, 0, (PyObject *)self))
+        goto err;
+
+    if (!(rc = PyObject_Call(f, nargs, kwargs)))
+        goto err;
+
+    Py_DECREF(rc);
+    Py_DECREF(nargs);
+
+    if (NOT_NONE(self->left)) {
+        rc = Node_traverse(self->left, args, kwargs);
+        if (rc)
+            Py_DECREF(rc);
+        else
+            return NULL;
+    }
+    if (NOT_NONE(self->right)) {
+        rc = Node_traverse(self->right, args, kwargs);
+        if (rc)
+            Py_DECREF(rc);
+        else
+            return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+    err:
+        Py_DECREF(nargs);
+        return NULL;
+}
+
+static PyObject * Node_cursor(Node *self)
+{
+    AvlTree *tree;
+
+    if (!(tree = Node__get_tree(self)))
+        return NULL;
+
+    return PyObject_CallFunctionObjArgs((PyObject *)&CursorType, tree, NULL);
+}
+
+static PyObject * Node_get_item(Node *self, void *closure)
+{
+    PyObject *item = NODE_ITEM(self);
+
+    Py_INCREF(item);
+    return item;
+}
+
+static PyGetSetDef Node_getset[] = {
+    {"item", (getter)Node_get_item, NULL,
+     "object the key was derived from, the key itself without a key function"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef Node_members[] = {
+    {"left", T_OBJECT_EX, offsetof(Node, left), 0, "left child"},
+    {"right", T_OBJECT_EX, offsetof(Node, right), 0, "right child"},
+    {"key", T_OBJECT_EX, offsetof(Node, key), 0, "node key"},
+    {"parent", T_OBJECT_EX, offsetof(Node, parent), 0, "node parent"},
+    {"bf", T_INT, offsetof(Node, bf), 0, "balance factor"},
+    {"multiplicity", T_PYSSIZET, offsetof(Node, count), READONLY,
+     "number of occurrences of the key"},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject * Node_Repr(PyObject *o)
+{
+    PyObject *s;
+    Node *self = (Node *)o;
+    PyObject *r_key = PyObject_Repr(self->key);
+    PyObject *r_left = PyObject_Repr((PyObject *)self->left);
+    PyObject *r_right = PyObject_Repr((PyObject *)self->right);
+
+    s = PyString_FromFormat("%s(%s,%s)",
+            PyString_AS_STRING(r_key),
+            PyString_AS_STRING(r_left),
+            PyString_AS_STRING(r_right));
+
+    Py_DECREF(r_key);
+    Py_DECREF(r_left);
+    Py_DECREF(r_right);
+
+    return s;
+}
+
+static Py_ssize_t Node_Length(Node *self)
+{
+    // The tree keeps count of the keys
+    if (self->tree)
+        return self->tree->size;
+
+    return Node__len(self);
+}
+
+static int Node_Nonzero(Node *self)
+{
+    // Don't walk the whole subtree just to test a node
+    return 1;
+}
+
+static int Node_Contains(Node *self, PyObject *item)
+{
+    PyObject *key;
+    Node *s;
+    int c;
+
+    if (!(key = Node__key(self, item)))
+        return -1;
+
+    s = Node__locate(self, key, &c);
+    Py_DECREF(key);
+    if (PyErr_Occurred())
+        return -1;
+
+    return s->count && !c;
+}
+
+static int Node_gc_traverse(Node *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->left);
+    Py_VISIT(self->right);
+    Py_VISIT(self->parent);
+    Py_VISIT(self->key);
+    Py_VISIT(self->item);
+    Py_VISIT(self->tree);
+    return 0;
+}
+
+static int Node_gc_clear(Node *self)
+{
+    /*
+        Breaks the parent, child and root to tree cycles, the links are
+        left pointing to None so that the node still looks detached
+    */
+
+    Node *left = self->left, *right = self->right, *parent = self->parent;
+
+    Py_INCREF(Py_None);
+    Py_INCREF(Py_None);
+    Py_INCREF(Py_None);
+    self->left = self->right = self->parent = (Node *)Py_None;
+    Py_XDECREF(left);
+    Py_XDECREF(right);
+    Py_XDECREF(parent);
+    Py_CLEAR(self->item);
+    Py_CLEAR(self->tree);
+    return 0;
+}
+
+static void Node_dealloc(Node *self)
+{
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->left);
+    Py_XDECREF(self->right);
+    Py_XDECREF(self->parent);
+    Py_XDECREF(self->key);
+    Py_XDECREF(self->item);
+    Py_XDECREF(self->tree);
+    self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyMethodDef Node_methods[] = {
+    {"search", (PyCFunction)Node_search, METH_VARARGS,
+     "Returns the corresponding node if found, the last checked otherwise"
+    },
+    {"insert", (PyCFunction)Node_insert, METH_VARARGS,
+     "Inserts a new key into a tree"
+    },
+    {"delete", (PyCFunction)Node_delete, METH_VARARGS,
+     "Deletes a key from a tree"
+    },
+    {"from_list", (PyCFunction)Node_from_list,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Builds a tree from a sequence"
+    },
+    {"from_list_raw", (PyCFunction)Node_from_list_raw,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Builds a tree from a tuple tree"
+    },
+    {"to_list", (PyCFunction)Node_to_list, METH_NOARGS,
+     "Builds a tuple tree"
+    },
+    {"to_dict", (PyCFunction)Node_to_dict, METH_VARARGS,
+     "Returns a dict of all tree elements"
+    },
+    {"rightmost", (PyCFunction)Node_rightmost, METH_NOARGS,
+     "Returns the rightmost node"
+    },
+    {"height", (PyCFunction)Node_height, METH_NOARGS,
+     "Returns tree height"
+    },
+    {"calc_bf", (PyCFunction)Node_calc_bf, METH_NOARGS,
+     "Calculates tree balance factor"
+    },
+    {"rotate_cw", (PyCFunction)Node_rotate_cw, METH_NOARGS,
+     "Rotates a node clock-wise"
+    },
+    {"rotate_ccw", (PyCFunction)Node_rotate_ccw, METH_NOARGS,
+     "Rotates a node counter clock-wise"
+    },
+    {"traverse", (PyCFunction)Node_traverse, METH_KEYWORDS,
+     "Traverses a tree"
+    },
+    {"count", (PyCFunction)Node_count, METH_VARARGS,
+     "Returns the number of occurrences of a key"
+    },
+    {"rank", (PyCFunction)Node_rank, METH_VARARGS,
+     "Returns the number of keys less than a key, duplicates included"
+    },
+    {"cursor", (PyCFunction)Node_cursor, METH_NOARGS,
+     "Returns a cursor positioned at the leftmost node"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyNumberMethods Node_as_number = {
+    0,                          /* nb_add */
+    0,                          /* nb_subtract */
+    0,                          /* nb_multiply */
+    0,                          /* nb_divide */
+    0,                          /* nb_remainder */
+    0,                          /* nb_divmod */
+    0,                          /* nb_power */
+    0,                          /* nb_negative */
+    0,                          /* nb_positive */
+    0,                          /* nb_absolute */
+    (inquiry)Node_Nonzero,      /* nb_nonzero */
+};
+
+static PySequenceMethods Node_as_sequence = {
+    (lenfunc)Node_Length,       /* sq_length */
+    0,                          /* sq_concat */
+    0,                          /* sq_repeat */
+    0,                          /* sq_item */
+    0,                          /* sq_slice */
+    0,                          /* sq_ass_item */
+    0,                          /* sq_ass_slice */
+    (objobjproc)Node_Contains,  /* sq_contains */
+    0,                          /* sq_inplace_concat */
+    0,                          /* sq_inplace_repeat */
+};
+
+static PyTypeObject NodeType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.Node",                 /*tp_name*/
+    sizeof(Node),               /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Node_dealloc,   /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    Node_Repr,                  /*tp_repr*/
+    &Node_as_number,           /*tp_as_number*/
+    &Node_as_sequence,         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_SEQUENCE_IN | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    "Node object",              /* tp_doc */
+    (traverseproc)Node_gc_traverse, /* tp_traverse */
+    (inquiry)Node_gc_clear,    /* tp_clear */
+    0,	                       /* tp_richcompare */
+    0,	                       /* tp_weaklistoffset */
+    (getiterfunc)Node_iter,    /* tp_iter */
+    0,	                       /* tp_iternext */
+    Node_methods,              /* tp_methods */
+    Node_members,              /* tp_members */
+    Node_getset,               /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)Node_init,        /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    
+    0,                         /*tp_free Low-level free-memory routine */
+    0,                         /* tp_is_gc For PyObject_IS_GC */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0,                         /* tp_del */
+    
+};
+
+/********************* Cursor ********************************/
+
+typedef struct Cursor {
+    PyObject_HEAD
+    AvlTree *tree;
+    Node *node;     // Current node, NULL if past the end
+    PyObject *key;  // Key the cursor was positioned at
+    Path path;      // Way down to the node
+    Py_ssize_t version; // Tree version the way down was taken at
+} Cursor;
+
+static void Cursor__set(Cursor *self, Node *node)
+{
+    /*
+        Moves to the node on top of the path, NULL past the end
+    */
+
+    Node *old_node = self->node;
+    PyObject *old_key = self->key;
+
+    self->node = node;
+    self->key = node ? node->key : NULL;
+    Py_XINCREF(self->node);
+    Py_XINCREF(self->key);
+    self->version = self->tree->version;
+
+    Py_XDECREF(old_node);
+    Py_XDECREF(old_key);
+}
+
+static Node * Cursor__node(Cursor *self)
+{
+    /*
+        Returns the current node. The tree may have been changed through
+        other paths since, in which case the node may be gone, hold
+        another key or be left to snapshots, so find the cursor key's
+        place again. A node the tree still owns has the way down to it
+        in its parent links
+    */
+
+    AvlTree *tree = self->tree;
+    Node *n = self->node;
+    int c;
+
+    if (!n || self->version == tree->version)
+        return n;
+
+    if (n->key == self->key && n->count && n->gen == tree->gen &&
+            Node__attached(tree->root, n)) {
+        if (Path__climb(&self->path, n))
+            return NULL;
+        self->version = tree->version;
+        return n;
+    }
+
+    Path__locate(&self->path, tree->root, self->key, &c);
+    if (!PyErr_Occurred())
+        n = Path__skip_dead(&self->path, Path__ceil(&self->path, c), 0);
+    if (PyErr_Occurred())
+        return NULL;
+    Cursor__set(self, n);
+
+    return n;
+}
+
+static Node * Cursor__locate(Cursor *self, PyObject *key, int *c)
+{
+    /*
+        Searches from the current node. The way down moves off it, the
+        caller moves the cursor or it's found again when needed
+    */
+
+    Node *n = Cursor__node(self);
+
+    if (!n && PyErr_Occurred())
+        return NULL;
+
+    self->version = -1;
+    if (n)
+        return Path__finger_search(&self->path, key, c);
+    else
+        return Path__locate(&self->path, self->tree->root, key, c);
+}
+
+static int Cursor_init(Cursor *self, PyObject *args)
+{
+    PyObject *o;
+    AvlTree *tree;
+    Node *n;
+
+    if (!PyArg_ParseTuple(args, "O", &o))
+        return -1;
+
+    if (PyObject_TypeCheck(o, &AvlTreeType))
+        tree = (AvlTree *)o;
+    else if (PyObject_TypeCheck(o, &NodeType)) {
+        if (!(tree = Node__get_tree((Node *)o)))
+            return -1;
+    } else {
+        PyErr_SetString(PyExc_TypeError, "tree or node is required");
+        return -1;
+    }
+
+    Py_INCREF(tree);
+    Py_XDECREF(self->tree);
+    self->tree = tree;
+    n = Path__skip_dead(&self->path, Path__first(&self->path, tree->root), 0);
+    if (PyErr_Occurred())
+        return -1;
+    Cursor__set(self, n);
+
+    return 0;
+}
+
+static PyObject * Cursor_seek(Cursor *self, PyObject *args)
+{
+    PyObject *item, *key;
+    Node *n;
+    int found, c;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(key = AvlTree__key(self->tree, item)))
+        return NULL;
+
+    n = Cursor__locate(self, key, &c);
+    Py_DECREF(key);
+    if (PyErr_Occurred())
+        // The key couldn't be compared, the cursor stays where it was
+        return NULL;
+
+    found = n && n->count && !c;
+    if (n && !(n = Path__skip_dead(&self->path, Path__ceil(&self->path, c), 0)) &&
+            PyErr_Occurred())
+        return NULL;
+    Cursor__set(self, n);
+
+    return PyBool_FromLong(found);
+}
+
+static PyObject * Cursor_next(Cursor *self)
+{
+    Node *n = Cursor__node(self);
+
+    // Finding the key again after changes compares keys
+    if (PyErr_Occurred())
+        return NULL;
+    if (!n)
+        Py_RETURN_FALSE;
+
+    n = Path__skip_dead(&self->path, Path__next(&self->path), 0);
+    if (PyErr_Occurred()) {
+        self->version = -1;
+        return NULL;
+    }
+
+    Cursor__set(self, n);
+    return PyBool_FromLong(n != NULL);
+}
+
+static PyObject * Cursor_prev(Cursor *self)
+{
+    Node *n = Cursor__node(self);
+
+    if (PyErr_Occurred())
+        return NULL;
+    if (n)
+        n = Path__prev(&self->path);
+    else
+        // Step back from past the end
+        n = Path__last(&self->path, self->tree->root);
+    n = Path__skip_dead(&self->path, n, 1);
+
+    if (!n) {
+        // Stays where it was, the way down is found again when needed
+        self->version = -1;
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_FALSE;
+    }
+
+    Cursor__set(self, n);
+    Py_RETURN_TRUE;
+}
+
+static PyObject * Cursor_insert_here(Cursor *self, PyObject *args)
+{
+    AvlTree *tree = self->tree;
+    PyObject *item, *key;
+    Node *n, *handle;
+    int c;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (AvlTree__writable(tree))
+        return NULL;
+
+    if (!(key = AvlTree__key(tree, item)))
+        return NULL;
+
+    n = Cursor__locate(self, key, &c);
+    if (PyErr_Occurred()) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    // The nodes down to the change can't be shared with snapshots
+    if (n)
+        n = AvlTree__own_path(tree, &self->path);
+
+    handle = AvlTree__hold(tree);
+    n = AvlTree__insert_at(tree, n, c, key, item);
+    if (AvlTree__pin(tree, handle) && n)
+        // The root object the key might be in has moved
+        n = Node__search(tree->root, key);
+    Py_DECREF(key);
+    if (!n || Path__climb(&self->path, n))
+        return NULL;
+
+    AvlTree__set_finger(tree, n);
+    Cursor__set(self, n);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * Cursor_delete_here(Cursor *self)
+{
+    Node *n, *p, *handle;
+    PyObject *next_key = NULL;
+    int rc, c;
+
+    if (AvlTree__writable(self->tree))
+        return NULL;
+
+    if (!(n = Cursor__node(self))) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_KeyError, "cursor is past the end");
+        return NULL;
+    }
+
+    // The nodes down to the change can't be shared with snapshots
+    n = AvlTree__own_path(self->tree, &self->path);
+    Cursor__set(self, n);
+
+    if (n->count > 1) {
+        // Multiset, stay on the key while it's still there
+        if (AvlTree__remove(self->tree, n))
+            return NULL;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    self->version = -1;
+    if ((p = Path__skip_dead(&self->path, Path__next(&self->path), 0))) {
+        next_key = p->key;
+        Py_INCREF(next_key);
+    } else if (PyErr_Occurred())
+        return NULL;
+
+    handle = AvlTree__hold(self->tree);
+    rc = AvlTree__remove(self->tree, n);
+    AvlTree__pin(self->tree, handle);
+    if (rc) {
+        Py_XDECREF(next_key);
+        return NULL;
+    }
+
+    // Move on to the successor
+    n = NULL;
+    if (next_key) {
+        n = Path__locate(&self->path, self->tree->root, next_key, &c);
+        Py_DECREF(next_key);
+        if (PyErr_Occurred())
+            return NULL;
+    }
+    Cursor__set(self, n);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * Cursor_get_key(Cursor *self, void *closure)
+{
+    Node *n = Cursor__node(self);
+    PyObject *key = n ? n->key : Py_None;
+
+    if (PyErr_Occurred())
+        return NULL;
+    Py_INCREF(key);
+    return key;
+}
+
+static PyObject * Cursor_get_node(Cursor *self, void *closure)
+{
+    Node *n = Cursor__node(self);
+    PyObject *node = n ? (PyObject *)n : Py_None;
+
+    if (PyErr_Occurred())
+        return NULL;
+    Py_INCREF(node);
+    return node;
+}
+
+static void Cursor_dealloc(Cursor *self)
+{
+    Path__clear(&self->path);
+    Py_XDECREF(self->tree);
+    Py_XDECREF(self->node);
+    Py_XDECREF(self->key);
+    self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyMethodDef Cursor_methods[] = {
+    {"seek", (PyCFunction)Cursor_seek, METH_VARARGS,
+     "Moves to the smallest key not less than the given one, "
+     "returns True if the key is present"
+    },
+    {"next", (PyCFunction)Cursor_next, METH_NOARGS,
+     "Moves to the next key, returns False when past the end"
+    },
+    {"prev", (PyCFunction)Cursor_prev, METH_NOARGS,
+     "Moves to the previous key, returns False when at the beginning"
+    },
+    {"insert_here", (PyCFunction)Cursor_insert_here, METH_VARARGS,
+     "Inserts a key searching from the cursor position, moves to the key"
+    },
+    {"delete_here", (PyCFunction)Cursor_delete_here, METH_NOARGS,
+     "Deletes the current key, moves to the next one once the key is gone"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Cursor_getset[] = {
+    {"key", (getter)Cursor_get_key, NULL, "current key, None past the end"},
+    {"node", (getter)Cursor_get_node, NULL, "current node, None past the end"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject CursorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.Cursor",              /*tp_name*/
+    sizeof(Cursor),            /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Cursor_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Cursor object",           /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    Cursor_methods,            /* tp_methods */
+    0,                         /* tp_members */
+    Cursor_getset,             /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)Cursor_init,     /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+};
+
+/********************* Merge ********************************/
+
+typedef struct Merge {
+    PyObject_HEAD
+    PyObject *trees;        // Trees merged, kept alive while merging
+    AvlTree **owners;       // Tree of every argument, NULL if none
+    Py_ssize_t *versions;   // Versions of the trees when merging started
+    Node **heads;           // Current node of every tree, NULL once done
+    Path *paths;            // Way down to the current node of every tree
+    Py_ssize_t *reps;       // Occurrences of the current keys yielded
+    Py_ssize_t *heap;       // Trees not done yet, ordered by current key
+    Py_ssize_t len;         // Heap size
+    PyObject *lo;           // Key bounds, NULL if unbounded
+    PyObject *hi;
+    PyObject *last;         // Last key yielded, unique merges only
+    int unique;
+    int reverse;
+} Merge;
+
+static Node * Merge__settle(Merge *self, Path *path, Node *n)
+{
+    /*
+        Returns the first node from n, on top of the path, on in the
+        merge direction that isn't a tombstone, NULL if there's none
+        within the bounds or comparing with the bound fails
+    */
+
+    PyObject *bound = self->reverse ? self->lo : self->hi;
+    int c;
+
+    n = Path__skip_dead(path, n, self->reverse);
+
+    if (n && bound) {
+        c = Node__compare(n->key, bound);
+        if ((c == -1 && PyErr_Occurred()) || (self->reverse ? c < 0 : c > 0))
+            n = NULL;
+    }
+
+    return n;
+}
+
+static int Merge__less(Merge *self, Py_ssize_t i, Py_ssize_t j)
+{
+    // Equal keys come in the order of the trees, -1 if comparing fails
+    int c = Node__compare(self->heads[i]->key, self->heads[j]->key);
+
+    if (c == -1 && PyErr_Occurred())
+        return -1;
+    if (self->reverse)
+        c = -c;
+
+    return c < 0 || (c == 0 && i < j);
+}
+
+static int Merge__sift_down(Merge *self, Py_ssize_t pos)
+{
+    // Stops at a failed comparison, the heap stays a permutation
+    Py_ssize_t *heap = self->heap, child, top = heap[pos];
+    int less;
+
+    while ((child = 2 * pos + 1) < self->len) {
+        if (child + 1 < self->len &&
+                (less = Merge__less(self, heap[child+1], heap[child]))) {
+            if (less < 0)
+                break;
+            child++;
+        }
+        if ((less = Merge__less(self, heap[child], top)) <= 0)
+            break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = top;
+
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject * Merge_iternext(Merge *self)
+{
+    Py_ssize_t i;
+    PyObject *item = NULL;
+    Node *n, *next;
+    int emit;
+
+    while (self->len) {
+        i = self->heap[0];
+        n = self->heads[i];
+
+        // A tree is only walked while at the top, checking it then is
+        // enough to catch every change before its keys are yielded
+        if (self->owners[i] && self->owners[i]->version != self->versions[i]) {
+            PyErr_SetString(PyExc_RuntimeError, "tree changed during iteration");
+            return NULL;
+        }
+
+        // Duplicates are next to each other in the merged order
+        emit = !self->unique || !self->last;
+        if (!emit && (emit = Node__compare(self->last, n->key)) == -1 &&
+                PyErr_Occurred())
+            return NULL;
+        if (emit) {
+            item = NODE_ITEM(n);
+            Py_INCREF(item);
+        }
+
+        if (!self->unique && ++self->reps[i] < n->count)
+            // More occurrences of the same key to go
+            return item;
+
+        if (self->unique) {
+            Py_XDECREF(self->last);
+            self->last = n->key;
+            Py_INCREF(self->last);
+        }
+
+        next = Merge__settle(self, &self->paths[i], self->reverse ?
+                             Path__prev(&self->paths[i]) :
+                             Path__next(&self->paths[i]));
+        Py_XINCREF(next);
+        self->heads[i] = next;
+        self->reps[i] = 0;
+        Py_DECREF(n);
+
+        if (!next)
+            self->heap[0] = self->heap[--self->len];
+        if (PyErr_Occurred() || Merge__sift_down(self, 0)) {
+            if (emit)
+                Py_DECREF(item);
+            return NULL;
+        }
+        if (emit)
+            return item;
+    }
+
+    return NULL;
+}
+
+static void Merge_dealloc(Merge *self)
+{
+    Py_ssize_t i;
+
+    if (self->heads)
+        for (i=0; i<PyTuple_GET_SIZE(self->trees); i++) {
+            Py_XDECREF(self->heads[i]);
+            Py_XDECREF(self->owners[i]);
+            Path__clear(&self->paths[i]);
+        }
+    PyMem_Free(self->paths);
+    PyMem_Free(self->owners);
+    PyMem_Free(self->versions);
+    PyMem_Free(self->heads);
+    PyMem_Free(self->reps);
+    PyMem_Free(self->heap);
+    Py_XDECREF(self->trees);
+    Py_XDECREF(self->lo);
+    Py_XDECREF(self->hi);
+    Py_XDECREF(self->last);
+    self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyTypeObject MergeType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.Merge",               /*tp_name*/
+    sizeof(Merge),             /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Merge_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Merge iterator",          /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)Merge_iternext, /* tp_iternext */
+};
+
+static PyObject * avl_merge(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"unique", "reverse", "lo", "hi", NULL};
+    PyObject *empty, *o, *lo = Py_None, *hi = Py_None;
+    Py_ssize_t len = PyTuple_GET_SIZE(args), i;
+    Merge *self;
+    Node *root, *n;
+    AvlTree *tree;
+    Path *path;
+    int unique = 0, reverse = 0, c;
+
+    if (!(empty = PyTuple_New(0)))
+        return NULL;
+    i = PyArg_ParseTupleAndKeywords(empty, kwargs, "|iiOO", kwlist,
+                                    &unique, &reverse, &lo, &hi);
+    Py_DECREF(empty);
+    if (!i)
+        return NULL;
+
+    if (!(self = PyObject_New(Merge, &MergeType)))
+        return NULL;
+
+    Py_INCREF(args);
+    self->trees = args;
+    self->owners = PyMem_New(AvlTree *, len);
+    self->versions = PyMem_New(Py_ssize_t, len);
+    self->heads = PyMem_New(Node *, len);
+    self->paths = PyMem_New(Path, len);
+    self->reps = PyMem_New(Py_ssize_t, len);
+    self->heap = PyMem_New(Py_ssize_t, len);
+    self->len = 0;
+    self->lo = IS_NONE(lo) ? NULL : lo;
+    self->hi = IS_NONE(hi) ? NULL : hi;
+    Py_XINCREF(self->lo);
+    Py_XINCREF(self->hi);
+    self->last = NULL;
+    self->unique = unique;
+    self->reverse = reverse;
+
+    if (!self->owners || !self->versions || !self->heads || !self->paths ||
+            !self->reps || !self->heap) {
+        PyMem_Free(self->heads);
+        self->heads = NULL;
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    for (i=0; i<len; i++) {
+        self->heads[i] = NULL;
+        self->owners[i] = NULL;
+        self->paths[i].nodes = NULL;
+        self->paths[i].len = self->paths[i].alloc = 0;
+    }
+
+    for (i=0; i<len; i++) {
+        o = PyTuple_GET_ITEM(args, i);
+        if (PyObject_TypeCheck(o, &AvlTreeType)) {
+            tree = (AvlTree *)o;
+            root = tree->root;
+        } else if (PyObject_TypeCheck(o, &NodeType)) {
+            tree = Node__tree((Node *)o);
+            root = tree ? tree->root : (Node *)o;
+        } else {
+            PyErr_SetString(PyExc_TypeError, "trees or nodes are required");
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (tree) {
+            Py_INCREF(tree);
+            self->owners[i] = tree;
+            self->versions[i] = tree->version;
+        }
+        if (!root)
+            continue;
+
+        // Position on the first key within the bounds
+        path = &self->paths[i];
+        if (!reverse && self->lo) {
+            if ((n = Path__locate(path, root, self->lo, &c)))
+                n = Path__ceil(path, c);
+        } else if (reverse && self->hi) {
+            if ((n = Path__locate(path, root, self->hi, &c)))
+                n = Path__floor(path, c);
+        } else
+            n = reverse ? Path__last(path, root) : Path__first(path, root);
+
+        if (!PyErr_Occurred() && (n = Merge__settle(self, path, n))) {
+            Py_INCREF(n);
+            self->heads[i] = n;
+            self->reps[i] = 0;
+            self->heap[self->len++] = i;
+        }
+        if (PyErr_Occurred()) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+
+    for (i=self->len/2-1; i>=0; i--)
+        if (Merge__sift_down(self, i)) {
+            Py_DECREF(self);
+            return NULL;
+        }
+
+    return (PyObject *)self;
+}
+
+/********************* Shared trees ********************************/
+
+/*
+    A shared tree is a read-only copy of a tree laid out in one block of
+    memory, with no Python objects in it. The block is mapped by the
+    processes using the tree, looking keys up only reads it, so the pages
+    stay shared across forks and between processes mapping the same file.
+
+    The layout is native to the host:
+        header      magic, number of keys, number of keys with duplicates
+        offsets     number of keys + 1 record offsets into the data
+        data        records in key order: count, key length, marshalled
+                    key, marshalled item if the item is not the key
+*/
+
+#define SHARED_MAGIC "AVLSHR1\n"
+#define SHARED_HEADER 24
+#define SHARED_RECORD 12    // Count and key length
+
+typedef struct SharedTree {
+    PyObject_HEAD
+    char *map;              // Mapped block, NULL if not attached
+    Py_ssize_t map_size;
+    Py_ssize_t len;         // Number of keys
+    Py_ssize_t size;        // Number of keys, duplicates included
+    PY_LONG_LONG *offsets;
+    char *data;
+} SharedTree;
+
+typedef struct SharedIter {
+    PyObject_HEAD
+    SharedTree *tree;
+    Py_ssize_t pos;         // Next record
+    Py_ssize_t end;         // Record to stop at
+    Py_ssize_t reps;        // Occurrences of the current key to go
+} SharedIter;
+
+static PyTypeObject SharedIterType;
+
+static char * SharedTree__record(SharedTree *self, Py_ssize_t i,
+                                 Py_ssize_t *count, Py_ssize_t *key_len,
+                                 Py_ssize_t *len)
+{
+    /*
+        Returns the marshalled key of record i. Sets the key count, the
+        key length and the length of the key and item together
+    */
+
+    char *rec = self->data + self->offsets[i];
+    PY_LONG_LONG c;
+    int k;
+
+    memcpy(&c, rec, 8);
+    memcpy(&k, rec + 8, 4);
+    *count = c;
+    *key_len = k;
+    *len = self->offsets[i+1] - self->offsets[i] - SHARED_RECORD;
+
+    return rec + SHARED_RECORD;
+}
+
+static int SharedTree__compare(const char *rec, Py_ssize_t len, PyObject *key)
+{
+    /*
+        Compares a marshalled key with a key. Ints and strings are
+        compared in place, other keys are unmarshalled into private
+        objects first, the shared block is only read
+    */
+
+    PY_LONG_LONG a, b;
+    PyObject *o;
+    int c, l;
+
+    // Lengths are checked against the record, the block may be corrupt
+    if (PyInt_CheckExact(key) && (rec[0] == 'i' || rec[0] == 'I') &&
+            len > (rec[0] == 'i' ? 4 : 8)) {
+        a = (PY_LONG_LONG)Log__get(rec + 1, rec[0] == 'i' ? 4 : 8);
+        // Sign extend the 32 bit ones
+        if (rec[0] == 'i')
+            a = (int)a;
+        b = PyInt_AS_LONG(key);
+        return (a > b) - (a < b);
+    }
+
+    if (PyString_CheckExact(key) && (rec[0] == 's' || rec[0] == 't') &&
+            len >= 5 && (l = (int)Log__get(rec + 1, 4)) >= 0 && l <= len - 5) {
+        c = memcmp(rec + 5, PyString_AS_STRING(key),
+                   MIN(l, PyString_GET_SIZE(key)));
+        if (c)
+            return c < 0 ? -1 : 1;
+        return (l > PyString_GET_SIZE(key)) - (l < PyString_GET_SIZE(key));
+    }
+
+    if (!(o = PyMarshal_ReadObjectFromString((char *)rec, len)))
+        return -1;
+    c = Node__compare(o, key);
+    Py_DECREF(o);
+
+    return c;
+}
+
+static Py_ssize_t SharedTree__bound(SharedTree *self, PyObject *key, int upper)
+{
+    /*
+        Binary search, returns the first record with the key not less
+        than the key, greater than the key if upper is set. -1 on errors
+    */
+
+    Py_ssize_t lo = 0, hi = self->len, mid, count, key_len, len;
+    char *rec;
+    int c;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rec = SharedTree__record(self, mid, &count, &key_len, &len);
+        c = SharedTree__compare(rec, key_len, key);
+        if (c == -1 && PyErr_Occurred())
+            return -1;
+        if (c < 0 || (upper && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static Py_ssize_t SharedTree__find(SharedTree *self, PyObject *key)
+{
+    /*
+        Returns the record holding the key, -1 with KeyError set if
+        there's none, -2 on other errors
+    */
+
+    Py_ssize_t i, count, key_len, len;
+    char *rec;
+    int c;
+
+    if (!self->map) {
+        PyErr_SetString(PyExc_RuntimeError, "shared tree is not attached");
+        return -2;
+    }
+
+    if ((i = SharedTree__bound(self, key, 0)) < 0)
+        return -2;
+
+    if (i < self->len) {
+        rec = SharedTree__record(self, i, &count, &key_len, &len);
+        c = SharedTree__compare(rec, key_len, key);
+        if (c == -1 && PyErr_Occurred())
+            return -2;
+        if (!c)
+            return i;
+    }
+
+    PyErr_SetString(PyExc_KeyError, "key not found");
+    return -1;
+}
+
+static PyObject * SharedTree__item(SharedTree *self, Py_ssize_t i)
+{
+    /*
+        Returns a private copy of the item of record i
+    */
+
+    Py_ssize_t count, key_len, len;
+    char *rec = SharedTree__record(self, i, &count, &key_len, &len);
+
+    if (len > key_len)
+        return PyMarshal_ReadObjectFromString(rec + key_len, len - key_len);
+
+    return PyMarshal_ReadObjectFromString(rec, key_len);
+}
+
+static int SharedTree__check(char *map, Py_ssize_t size)
+{
+    /*
+        Checks that the offsets and records of a block with a good header
+        stay within the block, so reading records never goes past it
+    */
+
+    PY_LONG_LONG len, total, *offsets, sum = 0, c;
+    Py_ssize_t data;
+    char *rec;
+    int k;
+
+    memcpy(&len, map + 8, 8);
+    memcpy(&total, map + 16, 8);
+    if (len < 0 || len >= (size - SHARED_HEADER) / 8)
+        return -1;
+
+    offsets = (PY_LONG_LONG *)(map + SHARED_HEADER);
+    data = SHARED_HEADER + (len + 1) * 8;
+    if (offsets[0] != 0)
+        return -1;
+
+    for (; len; len--, offsets++) {
+        // Every record has a header and a key in it, all within the block
+        if (offsets[1] - offsets[0] < SHARED_RECORD + 1 ||
+                offsets[1] > size - data)
+            return -1;
+        rec = map + data + offsets[0];
+        memcpy(&c, rec, 8);
+        memcpy(&k, rec + 8, 4);
+        if (c < 1 || k < 1 || k > offsets[1] - offsets[0] - SHARED_RECORD)
+            return -1;
+        sum += c;
+    }
+
+    return sum == total ? 0 : -1;
+}
+
+static int SharedTree__attach(SharedTree *self, char *map, Py_ssize_t size)
+{
+    /*
+        Takes over a mapped block, checking that it's a shared tree
+    */
+
+    PY_LONG_LONG len, total;
+
+    if (size < SHARED_HEADER || memcmp(map, SHARED_MAGIC, 8)) {
+        munmap(map, size);
+        PyErr_SetString(PyExc_ValueError, "not a shared tree");
+        return -1;
+    }
+
+    if (SharedTree__check(map, size)) {
+        munmap(map, size);
+        PyErr_SetString(PyExc_ValueError, "shared tree is truncated or corrupt");
+        return -1;
+    }
+
+    memcpy(&len, map + 8, 8);
+    memcpy(&total, map + 16, 8);
+    self->map = map;
+    self->map_size = size;
+    self->len = len;
+    self->size = total;
+    self->offsets = (PY_LONG_LONG *)(map + SHARED_HEADER);
+    self->data = map + SHARED_HEADER + (len + 1) * 8;
+
+    return 0;
+}
+
+static int SharedTree_init(SharedTree *self, PyObject *args)
+{
+    const char *path;
+    struct stat st;
+    char *map;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return -1;
+
+    if (self->map) {
+        PyErr_SetString(PyExc_RuntimeError, "shared tree is attached already");
+        return -1;
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) :
+                       MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (st.st_size)
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+        else
+            PyErr_SetString(PyExc_ValueError, "not a shared tree");
+        return -1;
+    }
+
+    return SharedTree__attach(self, map, st.st_size);
+}
+
+static PyObject * SharedTree__publish(AvlTree *tree, const char *path)
+{
+    /*
+        Lays a tree out in a new shared tree. Without a path the block is
+        shared anonymous memory, inherited by the processes forked later.
+        Otherwise the block is written to the file and mapped from there
+    */
+
+    LogBuffer data = {NULL};
+    PyObject *key = NULL, *item = NULL, *header;
+    PY_LONG_LONG *offsets = NULL, len = 0, total = 0, count;
+    Py_ssize_t alloc = 0, size;
+    Path walk = {NULL};
+    SharedTree *self;
+    char *p, *map;
+    void *tmp;
+    Node *n;
+    int key_len, fd;
+
+    for (n = Path__first(&walk, tree->root); n; n = Path__next(&walk)) {
+        if (!n->count)
+            continue;
+
+        if (len + 1 >= alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            tmp = PyMem_Realloc(offsets, alloc * sizeof(PY_LONG_LONG));
+            if (!tmp) {
+                PyErr_NoMemory();
+                goto err;
+            }
+            offsets = (PY_LONG_LONG *)tmp;
+        }
+        offsets[len++] = data.len;
+
+        if (!(key = PyMarshal_WriteObjectToString(n->key, Py_MARSHAL_VERSION)))
+            goto err;
+        if (n->item && !(item = PyMarshal_WriteObjectToString(n->item,
+                                                               Py_MARSHAL_VERSION)))
+            goto err;
+
+        key_len = PyString_GET_SIZE(key);
+        size = SHARED_RECORD + key_len + (item ? PyString_GET_SIZE(item) : 0);
+        if (!(p = Log__reserve(&data, size)))
+            goto err;
+        count = n->count;
+        memcpy(p, &count, 8);
+        memcpy(p + 8, &key_len, 4);
+        memcpy(p + SHARED_RECORD, PyString_AS_STRING(key), key_len);
+        if (item)
+            memcpy(p + SHARED_RECORD + key_len, PyString_AS_STRING(item),
+                   PyString_GET_SIZE(item));
+        data.len += size;
+        total += count;
+        Py_CLEAR(key);
+        Py_CLEAR(item);
+    }
+    Path__clear(&walk);
+    if (PyErr_Occurred())
+        goto err;
+    if (!offsets && !(offsets = PyMem_New(PY_LONG_LONG, 1))) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    offsets[len] = data.len;
+
+    size = SHARED_HEADER + (len + 1) * 8 + data.len;
+    if (!(header = PyString_FromStringAndSize(NULL, SHARED_HEADER)))
+        goto err;
+    p = PyString_AS_STRING(header);
+    memcpy(p, SHARED_MAGIC, 8);
+    memcpy(p + 8, &len, 8);
+    memcpy(p + 16, &total, 8);
+
+    if (path) {
+        // Written next to the file and moved in place, as snapshots are
+        key = PyString_FromFormat("%s.tmp", path);
+        // Opened for reading as well, the mapping needs it
+        fd = key ? open(PyString_AS_STRING(key), O_RDWR | O_CREAT | O_TRUNC,
+                        0644) : -1;
+        if (fd < 0 || Log__write(fd, p, SHARED_HEADER) ||
+                Log__write(fd, (char *)offsets, (len + 1) * 8) ||
+                Log__write(fd, data.data, data.len) || fsync(fd) ||
+                rename(PyString_AS_STRING(key), path)) {
+            if (key)
+                PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+            if (fd >= 0) {
+                close(fd);
+                unlink(PyString_AS_STRING(key));
+            }
+            Py_DECREF(header);
+            goto err;
+        }
+        Py_DECREF(header);
+        Py_CLEAR(key);
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map != MAP_FAILED) {
+            memcpy(map, p, SHARED_HEADER);
+            memcpy(map + SHARED_HEADER, offsets, (len + 1) * 8);
+            memcpy(map + SHARED_HEADER + (len + 1) * 8, data.data, data.len);
+            mprotect(map, size, PROT_READ);
+        }
+        Py_DECREF(header);
+    }
+    PyMem_Free(offsets);
+    PyMem_Free(data.data);
+    offsets = NULL;
+    data.data = NULL;
+
+    if (map == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    self = (SharedTree *)PyType_GenericNew(&SharedTreeType, NULL, NULL);
+    if (!self) {
+        munmap(map, size);
+        return NULL;
+    }
+    if (SharedTree__attach(self, map, size)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *)self;
+
+    err:
+        Path__clear(&walk);
+        Py_XDECREF(key);
+        Py_XDECREF(item);
+        PyMem_Free(offsets);
+        PyMem_Free(data.data);
+        return NULL;
+}
+
+static PyObject * SharedTree__iter(SharedTree *self, Py_ssize_t pos,
+                                   Py_ssize_t end)
+{
+    SharedIter *it;
+
+    if (!(it = PyObject_New(SharedIter, &SharedIterType)))
+        return NULL;
+
+    Py_INCREF(self);
+    it->tree = self;
+    it->pos = pos;
+    it->end = end;
+    it->reps = 0;
+
+    return (PyObject *)it;
+}
+
+static PyObject * SharedTree_search(SharedTree *self, PyObject *args)
+{
+    PyObject *key;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "O", &key))
+        return NULL;
+
+    if ((i = SharedTree__find(self, key)) < 0)
+        return NULL;
+
+    return SharedTree__item(self, i);
+}
+
+static PyObject * SharedTree_count(SharedTree *self, PyObject *args)
+{
+    Py_ssize_t i, count, key_len, len;
+    PyObject *key;
+
+    if (!PyArg_ParseTuple(args, "O", &key))
+        return NULL;
+
+    if ((i = SharedTree__find(self, key)) == -1) {
+        PyErr_Clear();
+        return PyInt_FromLong(0);
+    } else if (i < 0)
+        return NULL;
+
+    SharedTree__record(self, i, &count, &key_len, &len);
+    return PyInt_FromSsize_t(count);
+}
+
+static PyObject * SharedTree_range(SharedTree *self, PyObject *args,
+                                   PyObject *kwargs)
+{
+    static char *kwlist[] = {"lo", "hi", NULL};
+    PyObject *lo = Py_None, *hi = Py_None;
+    Py_ssize_t pos = 0, end = self->len;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &lo, &hi))
+        return NULL;
+
+    if (!self->map) {
+        PyErr_SetString(PyExc_RuntimeError, "shared tree is not attached");
+        return NULL;
+    }
+
+    // Both bounds are inclusive
+    if (NOT_NONE(lo) && (pos = SharedTree__bound(self, lo, 0)) < 0)
+        return NULL;
+    if (NOT_NONE(hi) && (end = SharedTree__bound(self, hi, 1)) < 0)
+        return NULL;
+
+    return SharedTree__iter(self, pos, MAX(pos, end));
+}
+
+static PyObject * SharedTree_close(SharedTree *self)
+{
+    if (self->map) {
+        munmap(self->map, self->map_size);
+        self->map = NULL;
+        self->len = self->size = 0;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * SharedTree_iter(SharedTree *self)
+{
+    return SharedTree__iter(self, 0, self->len);
+}
+
+static Py_ssize_t SharedTree_Length(SharedTree *self)
+{
+    return self->size;
+}
+
+static int SharedTree_Contains(SharedTree *self, PyObject *key)
+{
+    Py_ssize_t i = SharedTree__find(self, key);
+
+    if (i == -1) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    return i < 0 ? -1 : 1;
+}
+
+static void SharedTree_dealloc(SharedTree *self)
+{
+    if (self->map)
+        munmap(self->map, self->map_size);
+    self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyObject * SharedIter_iternext(SharedIter *self)
+{
+    SharedTree *tree = self->tree;
+    Py_ssize_t count, key_len, len;
+
+    // A closed tree ends the iteration
+    if (self->pos >= MIN(self->end, tree->len))
+        return NULL;
+
+    if (!self->reps) {
+        SharedTree__record(tree, self->pos, &count, &key_len, &len);
+        self->reps = count;
+    }
+
+    // Multisets yield the item once per occurrence
+    if (--self->reps)
+        return SharedTree__item(tree, self->pos);
+
+    return SharedTree__item(tree, self->pos++);
+}
+
+static void SharedIter_dealloc(SharedIter *self)
+{
+    Py_DECREF(self->tree);
+    PyObject_Del(self);
+}
+
+static PyMethodDef SharedTree_methods[] = {
+    {"search", (PyCFunction)SharedTree_search, METH_VARARGS,
+     "Returns a copy of the item with the key"
+    },
+    {"count", (PyCFunction)SharedTree_count, METH_VARARGS,
+     "Returns the number of occurrences of a key"
+    },
+    {"range", (PyCFunction)SharedTree_range, METH_VARARGS | METH_KEYWORDS,
+     "Returns an iterator over the items with keys between lo and hi, "
+     "inclusive"
+    },
+    {"close", (PyCFunction)SharedTree_close, METH_NOARGS,
+     "Unmaps the tree"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods SharedTree_as_sequence = {
+    (lenfunc)SharedTree_Length, /* sq_length */
+    0,                          /* sq_concat */
+    0,                          /* sq_repeat */
+    0,                          /* sq_item */
+    0,                          /* sq_slice */
+    0,                          /* sq_ass_item */
+    0,                          /* sq_ass_slice */
+    (objobjproc)SharedTree_Contains, /* sq_contains */
+    0,                          /* sq_inplace_concat */
+    0,                          /* sq_inplace_repeat */
+};
+
+static PyTypeObject SharedTreeType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.SharedTree",          /*tp_name*/
+    sizeof(SharedTree),        /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)SharedTree_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &SharedTree_as_sequence,   /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_SEQUENCE_IN |
+        Py_TPFLAGS_HAVE_ITER,  /*tp_flags*/
+    "Read-only tree mapped from a file published by AvlTree.publish()",
+                               /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    (getiterfunc)SharedTree_iter, /* tp_iter */
+    0,                         /* tp_iternext */
+    SharedTree_methods,        /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)SharedTree_init, /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+};
+
+static PyTypeObject SharedIterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.SharedIter",          /*tp_name*/
+    sizeof(SharedIter),        /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)SharedIter_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Shared tree iterator",    /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)SharedIter_iternext, /* tp_iternext */
+};
+
+/********************* Paged trees ********************************/
+
+/*
+    A paged tree is a B+-tree kept in a file, for data sets that don't
+    fit in memory. Only a bounded pool of pages is held in memory, pages
+    are evicted by the CLOCK algorithm, dirty ones written back first.
+
+    Keys are stored in an order preserving encoding, pages are searched
+    with memcmp and no Python objects are made until a match is found.
+    Supported keys are ints, floats, strs, unicodes and tuples of them,
+    all the keys of a tree of the same type, ints and floats are ordered
+    apart.
+
+    Page 0 is the file header, the other pages are
+        header      type, number of slots, start of the records, bytes
+                    of deleted records, first child of internal pages
+        slots       record offsets in key order
+        records     leaves: key length, item length, key, marshalled
+                    item if it's not the key
+                    internal pages: key length, child, key. A child holds
+                    the keys not less than the key on its left
+    Pages are not merged as keys are deleted, emptied leaves stay put.
+
+    Pages are written in place, evicted dirty pages as soon as they
+    leave the pool, while the file header with the root and size is
+    only written by sync() and close(). The file is consistent only
+    right after those, a crash in between can leave it corrupt. Opening
+    checks the header against the file and pages are checked as they
+    are read, so a corrupt file raises ValueError rather than crashing.
+*/
+
+#define PAGE_SIZE 4096
+#define PAGE_HEADER 12
+#define PAGE_LEAF 1
+#define PAGE_INTERNAL 2
+// Any four records fit in a page, so a split always leaves room
+#define PAGE_RECORD_MAX ((PAGE_SIZE - PAGE_HEADER) / 4 - 2)
+#define PAGED_MAGIC "AVLPGD1\n"
+#define PAGED_MAX_HEIGHT 32
+#define PAGED_MIN_CACHE 16
+// Pages a range scan asks the OS to read ahead
+#define READAHEAD 64
+
+// Key encoding tags, in their order
+#define KEY_END 0
+#define KEY_INT 1
+#define KEY_FLOAT 2
+#define KEY_STR 3
+#define KEY_UNICODE 4
+#define KEY_TUPLE 5
+
+typedef struct Frame {
+    char *data;
+    long pgno;              // -1 if the frame is free
+    int pins;               // Users of the page, pinned pages stay
+    int dirty;
+    int ref;                // CLOCK reference bit
+    int next;               // Next frame in the hash chain, -1 at the end
+} Frame;
+
+typedef struct PagedTree {
+    PyObject_HEAD
+    int fd;                 // -1 if closed
+    PyObject *path;
+    PyObject *keyfunc;
+    Frame *frames;
+    char *pool;
+    int nframes;
+    int *buckets;           // Page number hash to the first frame
+    int nbuckets;           // A power of two
+    int hand;               // CLOCK hand
+    long root;
+    int height;
+    long npages;
+    Py_ssize_t size;
+    int kind;               // Tag of the key encodings, KEY_END if empty
+    Py_ssize_t version;     // Bumped on changes, iterators check it
+    Py_ssize_t reads;       // Pages read from and written to the file
+    Py_ssize_t writes;
+} PagedTree;
+
+typedef struct PagedIter {
+    PyObject_HEAD
+    PagedTree *tree;
+    PyObject *hi;           // Encoded upper bound, NULL if unbounded
+    Py_ssize_t version;
+    int depth;              // Pages on the stack, 0 once done
+    long pages[PAGED_MAX_HEIGHT];
+    int slots[PAGED_MAX_HEIGHT];    // Child visited, next record in leaves
+} PagedIter;
+
+static PyTypeObject PagedTreeType;
+static PyTypeObject PagedIterType;
+
+static int Page__get16(const char *p)
+{
+    unsigned short v;
+
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static void Page__set16(char *p, int v)
+{
+    unsigned short s = v;
+
+    memcpy(p, &s, 2);
+}
+
+static long Page__get32(const char *p)
+{
+    uint v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void Page__set32(char *p, long v)
+{
+    uint u = v;
+
+    memcpy(p, &u, 4);
+}
+
+#define PAGE_TYPE(p) ((p)[0])
+#define PAGE_SLOTS(p) Page__get16((p) + 2)
+#define PAGE_FREE(p) Page__get16((p) + 4)
+#define PAGE_GARBAGE(p) Page__get16((p) + 6)
+#define PAGE_SLOT(p, i) Page__get16((p) + PAGE_HEADER + 2 * (i))
+
+static void Page__init(char *p, int type, long child)
+{
+    memset(p, 0, PAGE_HEADER);
+    p[0] = type;
+    // No records yet, they start at the end of the page
+    Page__set16(p + 4, PAGE_SIZE);
+    Page__set32(p + 8, child);
+}
+
+static const char * Page__key(const char *p, int i, int *klen)
+{
+    const char *rec = p + PAGE_SLOT(p, i);
+
+    *klen = Page__get16(rec);
+    return rec + (PAGE_TYPE(p) == PAGE_LEAF ? 4 : 6);
+}
+
+static int Page__record_size(const char *p, int off)
+{
+    const char *rec = p + off;
+
+    if (PAGE_TYPE(p) == PAGE_LEAF)
+        return 4 + Page__get16(rec) + Page__get16(rec + 2);
+    else
+        return 6 + Page__get16(rec);
+}
+
+static long Page__child(const char *p, int i)
+{
+    // Child i of an internal page, on the right of key i - 1
+    if (!i)
+        return Page__get32(p + 8);
+
+    return Page__get32(p + PAGE_SLOT(p, i - 1) + 2);
+}
+
+static int Page__room(const char *p)
+{
+    return PAGE_FREE(p) - PAGE_HEADER - 2 * PAGE_SLOTS(p);
+}
+
+static int Paged__compare(const char *a, int alen, const char *b, int blen)
+{
+    // Encodings are prefix free, so this is the key order
+    int c = memcmp(a, b, MIN(alen, blen));
+
+    if (c)
+        return c < 0 ? -1 : 1;
+
+    return (alen > blen) - (alen < blen);
+}
+
+static int Page__search(const char *p, const char *key, int klen, int upper,
+                        int *found)
+{
+    /*
+        Binary search, returns the first slot with the key not less than
+        the key, greater than the key if upper is set
+    */
+
+    int lo = 0, hi = PAGE_SLOTS(p), mid, len, c;
+    const char *k;
+
+    *found = 0;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        k = Page__key(p, mid, &len);
+        c = Paged__compare(k, len, key, klen);
+        if (!c)
+            *found = 1;
+        if (c < 0 || (upper && !c))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void Page__compact(char *p)
+{
+    /*
+        Packs the records back together, reclaiming deleted ones
+    */
+
+    char tmp[PAGE_SIZE];
+    int n = PAGE_SLOTS(p), free = PAGE_SIZE, i, size;
+
+    memcpy(tmp, p, PAGE_SIZE);
+    for (i=0; i<n; i++) {
+        size = Page__record_size(tmp, PAGE_SLOT(tmp, i));
+        free -= size;
+        memcpy(p + free, tmp + PAGE_SLOT(tmp, i), size);
+        Page__set16(p + PAGE_HEADER + 2 * i, free);
+    }
+    Page__set16(p + 4, free & 0xffff);
+    Page__set16(p + 6, 0);
+}
+
+static void Page__insert(char *p, int i, const char *rec, int len)
+{
+    /*
+        Puts a record in slot i of a page with room for it
+    */
+
+    int n = PAGE_SLOTS(p), free;
+
+    if (Page__room(p) < len + 2)
+        Page__compact(p);
+
+    free = PAGE_FREE(p) - len;
+    memcpy(p + free, rec, len);
+    memmove(p + PAGE_HEADER + 2 * (i + 1), p + PAGE_HEADER + 2 * i,
+            2 * (n - i));
+    Page__set16(p + PAGE_HEADER + 2 * i, free);
+    Page__set16(p + 2, n + 1);
+    Page__set16(p + 4, free);
+}
+
+static void Page__remove(char *p, int i)
+{
+    int n = PAGE_SLOTS(p);
+
+    Page__set16(p + 6, PAGE_GARBAGE(p) + Page__record_size(p, PAGE_SLOT(p, i)));
+    memmove(p + PAGE_HEADER + 2 * i, p + PAGE_HEADER + 2 * (i + 1),
+            2 * (n - i - 1));
+    Page__set16(p + 2, n - 1);
+}
+
+static int Paged__encode(LogBuffer *buf, PyObject *key)
+{
+    /*
+        Appends the order preserving encoding of the key
+    */
+
+    unsigned PY_LONG_LONG u;
+    PyObject *utf8 = NULL;
+    Py_ssize_t len, i;
+    const char *s;
+    double d;
+    char *p;
+    int tag;
+
+    if (PyInt_Check(key) || PyLong_Check(key)) {
+        u = (unsigned PY_LONG_LONG)PyLong_AsLongLong(key);
+        if (u == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred())
+            return -1;
+        // Flipping the sign bit orders negatives first
+        u ^= (unsigned PY_LONG_LONG)1 << 63;
+        tag = KEY_INT;
+    } else if (PyFloat_Check(key)) {
+        d = PyFloat_AS_DOUBLE(key);
+        if (d != d) {
+            PyErr_SetString(PyExc_ValueError, "NaN keys can't be ordered");
+            return -1;
+        }
+        // -0.0 == 0.0
+        if (d == 0)
+            d = 0;
+        memcpy(&u, &d, 8);
+        u = u >> 63 ? ~u : u ^ ((unsigned PY_LONG_LONG)1 << 63);
+        tag = KEY_FLOAT;
+    } else if (PyString_Check(key) || PyUnicode_Check(key)) {
+        if (PyUnicode_Check(key)) {
+            // UTF-8 bytes are in code point order
+            if (!(utf8 = PyUnicode_AsUTF8String(key)))
+                return -1;
+            key = utf8;
+            tag = KEY_UNICODE;
+        } else
+            tag = KEY_STR;
+        s = PyString_AS_STRING(key);
+        len = PyString_GET_SIZE(key);
+        if (!(p = Log__reserve(buf, 2 * len + 3))) {
+            Py_XDECREF(utf8);
+            return -1;
+        }
+        *p++ = tag;
+        // Zero bytes are escaped, two zeros end the string
+        for (i=0; i<len; i++) {
+            *p++ = s[i];
+            if (!s[i])
+                *p++ = 1;
+        }
+        *p++ = 0;
+        *p++ = 0;
+        buf->len = p - buf->data;
+        Py_XDECREF(utf8);
+        return 0;
+    } else if (PyTuple_Check(key)) {
+        if (!(p = Log__reserve(buf, 1)))
+            return -1;
+        *p = KEY_TUPLE;
+        buf->len++;
+        for (i=0; i<PyTuple_GET_SIZE(key); i++)
+            if (Paged__encode(buf, PyTuple_GET_ITEM(key, i)))
+                return -1;
+        if (!(p = Log__reserve(buf, 1)))
+            return -1;
+        *p = KEY_END;
+        buf->len++;
+        return 0;
+    } else {
+        PyErr_Format(PyExc_TypeError, "paged tree keys can't be of type %s",
+                     key->ob_type->tp_name);
+        return -1;
+    }
+
+    if (!(p = Log__reserve(buf, 9)))
+        return -1;
+    p[0] = tag;
+    // Big endian, so memcmp orders them
+    for (i=8; i>0; i--, u >>= 8)
+        p[i] = u & 0xff;
+    buf->len += 9;
+
+    return 0;
+}
+
+static PyObject * Paged__decode(const char **pp, const char *end)
+{
+    // Decodes the key at *pp, not reading past end
+    unsigned PY_LONG_LONG u = 0;
+    const char *p = *pp, *s;
+    PyObject *o, *l, *item;
+    PY_LONG_LONG v;
+    Py_ssize_t len;
+    double d;
+    char *q;
+    int i, tag = p < end ? *p++ : KEY_END;
+
+    switch (tag) {
+    case KEY_INT:
+    case KEY_FLOAT:
+        if (end - p < 8)
+            break;
+        for (i=0; i<8; i++)
+            u = (u << 8) | (uchar)p[i];
+        *pp = p + 8;
+        if (tag == KEY_INT) {
+            v = (PY_LONG_LONG)(u ^ ((unsigned PY_LONG_LONG)1 << 63));
+            if (v >= LONG_MIN && v <= LONG_MAX)
+                return PyInt_FromLong((long)v);
+            return PyLong_FromLongLong(v);
+        }
+        u = u >> 63 ? u ^ ((unsigned PY_LONG_LONG)1 << 63) : ~u;
+        memcpy(&d, &u, 8);
+        return PyFloat_FromDouble(d);
+    case KEY_STR:
+    case KEY_UNICODE:
+        for (s = p, len = 0; end - s >= 2 && (s[0] || s[1]); s += s[0] ? 1 : 2)
+            len++;
+        if (end - s < 2)
+            break;
+        if (!(o = PyString_FromStringAndSize(NULL, len)))
+            return NULL;
+        for (q = PyString_AS_STRING(o); p[0] || p[1]; p += p[0] ? 1 : 2)
+            *q++ = p[0];
+        *pp = p + 2;
+        if (tag == KEY_STR)
+            return o;
+        l = PyUnicode_DecodeUTF8(PyString_AS_STRING(o), len, NULL);
+        Py_DECREF(o);
+        return l;
+    case KEY_TUPLE:
+        if (!(l = PyList_New(0)))
+            return NULL;
+        while (p < end && *p != KEY_END) {
+            if (!(item = Paged__decode(&p, end)) || PyList_Append(l, item)) {
+                Py_XDECREF(item);
+                Py_DECREF(l);
+                return NULL;
+            }
+            Py_DECREF(item);
+        }
+        if (p == end) {
+            Py_DECREF(l);
+            break;
+        }
+        *pp = p + 1;
+        o = PyList_AsTuple(l);
+        Py_DECREF(l);
+        return o;
+    }
+
+    PyErr_SetString(PyExc_ValueError, "bad key encoding");
+    return NULL;
+}
+
+static PyObject * PagedTree__encode(PagedTree *self, PyObject *key, int kind)
+{
+    /*
+        Returns the encoded key. With kind set, the key must be of the
+        type of the keys in the tree
+    */
+
+    LogBuffer buf = {NULL};
+    PyObject *enc;
+
+    if (Paged__encode(&buf, key)) {
+        PyMem_Free(buf.data);
+        return NULL;
+    }
+
+    if (kind && self->kind != KEY_END && buf.data[0] != self->kind) {
+        PyMem_Free(buf.data);
+        PyErr_SetString(PyExc_TypeError,
+                        "keys of a paged tree must be of one type");
+        return NULL;
+    }
+
+    enc = PyString_FromStringAndSize(buf.data, buf.len);
+    PyMem_Free(buf.data);
+
+    return enc;
+}
+
+static PyObject * PagedTree__key(PagedTree *self, PyObject *item, int kind)
+{
+    // Encoded key of the item
+    PyObject *key, *enc;
+
+    if (!self->keyfunc)
+        return PagedTree__encode(self, item, kind);
+
+    if (!(key = PyObject_CallFunctionObjArgs(self->keyfunc, item, NULL)))
+        return NULL;
+    enc = PagedTree__encode(self, key, kind);
+    Py_DECREF(key);
+
+    return enc;
+}
+
+static int PagedTree__check(PagedTree *self)
+{
+    if (self->fd < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "tree is closed");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int PagedTree__io(PagedTree *self, long pgno, char *data, int write)
+{
+    /*
+        Reads or writes a page, parts not in the file yet read as zeros
+    */
+
+    ssize_t n;
+
+    if (write) {
+        n = pwrite(self->fd, data, PAGE_SIZE, (off_t)pgno * PAGE_SIZE);
+        self->writes++;
+    } else {
+        n = pread(self->fd, data, PAGE_SIZE, (off_t)pgno * PAGE_SIZE);
+        if (n >= 0 && n < PAGE_SIZE)
+            memset(data + n, 0, PAGE_SIZE - n);
+        self->reads++;
+    }
+
+    if (n < 0 || (write && n < PAGE_SIZE)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                       PyString_AS_STRING(self->path));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int PagedTree__find(PagedTree *self, long pgno)
+{
+    int f = self->buckets[pgno & (self->nbuckets - 1)];
+
+    while (f >= 0 && self->frames[f].pgno != pgno)
+        f = self->frames[f].next;
+
+    return f;
+}
+
+static void PagedTree__unhash(PagedTree *self, int f)
+{
+    int *link = &self->buckets[self->frames[f].pgno & (self->nbuckets - 1)];
+
+    while (*link != f)
+        link = &self->frames[*link].next;
+    *link = self->frames[f].next;
+    self->frames[f].pgno = -1;
+}
+
+static Frame * PagedTree__frame(PagedTree *self, long pgno)
+{
+    /*
+        Returns a pinned frame to hold the page. Frames go round in CLOCK
+        order, a recently used one gets another round
+    */
+
+    Frame *frame;
+    int i, f, *bucket;
+
+    for (i=0; i<3*self->nframes; i++) {
+        f = self->hand;
+        self->hand = (self->hand + 1) % self->nframes;
+        frame = &self->frames[f];
+        if (frame->pins)
+            continue;
+        if (frame->pgno >= 0) {
+            if (frame->ref) {
+                frame->ref = 0;
+                continue;
+            }
+            if (frame->dirty && PagedTree__io(self, frame->pgno, frame->data, 1))
+                return NULL;
+            PagedTree__unhash(self, f);
+        }
+
+        frame->pgno = pgno;
+        frame->pins = 1;
+        frame->dirty = 0;
+        frame->ref = 1;
+        bucket = &self->buckets[pgno & (self->nbuckets - 1)];
+        frame->next = *bucket;
+        *bucket = f;
+        return frame;
+    }
+
+    PyErr_SetString(PyExc_RuntimeError, "all the cached pages are in use");
+    return NULL;
+}
+
+#define PagedTree__release(frame) ((frame)->pins--)
+
+static int PagedTree__valid(PagedTree *self, const char *p)
+{
+    /*
+        Checks a page read from the file, so that no record runs past
+        the page and no child past the file
+    */
+
+    int type = PAGE_TYPE(p), n = PAGE_SLOTS(p), free = PAGE_FREE(p);
+    int used = PAGE_GARBAGE(p), off, size, i;
+    long child;
+
+    if ((type != PAGE_LEAF && type != PAGE_INTERNAL) || free > PAGE_SIZE ||
+            free < PAGE_HEADER + 2 * n)
+        return 0;
+
+    for (i=0; i<n; i++) {
+        // The record header first, then the lengths it holds
+        off = PAGE_SLOT(p, i);
+        if (off < free || off > PAGE_SIZE - (type == PAGE_LEAF ? 4 : 6))
+            return 0;
+        size = Page__record_size(p, off);
+        if (off + size > PAGE_SIZE)
+            return 0;
+        used += size;
+    }
+    // Compacting must make the room the garbage count promises
+    if (used > PAGE_SIZE - free)
+        return 0;
+
+    if (type == PAGE_INTERNAL)
+        for (i=0; i<=n; i++) {
+            child = Page__child(p, i);
+            if (child < 1 || child >= self->npages)
+                return 0;
+        }
+
+    return 1;
+}
+
+static Frame * PagedTree__get(PagedTree *self, long pgno, int type)
+{
+    /*
+        Returns the pinned frame holding the page, to be released when
+        done with. The page must be of the type, pages read from the
+        file are checked before use
+    */
+
+    Frame *frame;
+    int f;
+
+    if ((f = PagedTree__find(self, pgno)) >= 0) {
+        frame = &self->frames[f];
+        frame->pins++;
+        frame->ref = 1;
+    } else {
+        if (!(frame = PagedTree__frame(self, pgno)))
+            return NULL;
+
+        if (PagedTree__io(self, pgno, frame->data, 0)) {
+            frame->pins = 0;
+            PagedTree__unhash(self, frame - self->frames);
+            return NULL;
+        }
+        if (!PagedTree__valid(self, frame->data)) {
+            frame->pins = 0;
+            PagedTree__unhash(self, frame - self->frames);
+            PyErr_Format(PyExc_ValueError, "page %ld is corrupt", pgno);
+            return NULL;
+        }
+    }
+
+    if (PAGE_TYPE(frame->data) != type) {
+        PagedTree__release(frame);
+        PyErr_Format(PyExc_ValueError, "page %ld is corrupt", pgno);
+        return NULL;
+    }
+
+    return frame;
+}
+
+static Frame * PagedTree__alloc(PagedTree *self, int type, long child)
+{
+    Frame *frame;
+
+    if (!(frame = PagedTree__frame(self, self->npages)))
+        return NULL;
+
+    self->npages++;
+    Page__init(frame->data, type, child);
+    frame->dirty = 1;
+
+    return frame;
+}
+
+static void PagedTree__readahead(PagedTree *self, const char *p, int from)
+{
+    /*
+        Asks the OS to read the children of an internal page from child
+        from on ahead, runs of pages next to each other in one go
+    */
+
+#ifdef POSIX_FADV_WILLNEED
+    long first = -1, last = -1, pgno;
+    int n = PAGE_SLOTS(p), i;
+
+    for (i=from; i<=n && i<from+READAHEAD; i++) {
+        pgno = Page__child(p, i);
+        if (PagedTree__find(self, pgno) >= 0)
+            continue;
+        if (pgno != last + 1) {
+            if (first >= 0)
+                posix_fadvise(self->fd, (off_t)first * PAGE_SIZE,
+                              (off_t)(last - first + 1) * PAGE_SIZE,
+                              POSIX_FADV_WILLNEED);
+            first = pgno;
+        }
+        last = pgno;
+    }
+    if (first >= 0)
+        posix_fadvise(self->fd, (off_t)first * PAGE_SIZE,
+                      (off_t)(last - first + 1) * PAGE_SIZE, POSIX_FADV_WILLNEED);
+#endif
+}
+
+static int PagedTree__flush(PagedTree *self, int sync)
+{
+    /*
+        Writes the dirty pages and the header out
+    */
+
+    char head[PAGE_SIZE];
+    PY_LONG_LONG size = self->size;
+    int i;
+
+    for (i=0; i<self->nframes; i++)
+        if (self->frames[i].pgno >= 0 && self->frames[i].dirty) {
+            if (PagedTree__io(self, self->frames[i].pgno,
+                              self->frames[i].data, 1))
+                return -1;
+            self->frames[i].dirty = 0;
+        }
+
+    memset(head, 0, PAGE_SIZE);
+    memcpy(head, PAGED_MAGIC, 8);
+    Page__set32(head + 8, PAGE_SIZE);
+    Page__set32(head + 12, self->root);
+    Page__set32(head + 16, self->height);
+    Page__set32(head + 20, self->npages);
+    memcpy(head + 24, &size, 8);
+    head[32] = self->kind;
+    if (PagedTree__io(self, 0, head, 1))
+        return -1;
+
+    if (sync && fsync(self->fd)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                       PyString_AS_STRING(self->path));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void PagedTree__close(PagedTree *self)
+{
+    if (self->fd >= 0)
+        close(self->fd);
+    self->fd = -1;
+    PyMem_Free(self->frames);
+    PyMem_Free(self->pool);
+    PyMem_Free(self->buckets);
+    self->frames = NULL;
+    self->pool = NULL;
+    self->buckets = NULL;
+}
+
+static long PagedTree__descend(PagedTree *self, const char *key, int klen,
+                               long *path, int *slots)
+{
+    /*
+        Returns the leaf the key belongs in, filling in the internal
+        pages on the way and the children taken. -1 on errors
+    */
+
+    long pgno = self->root;
+    Frame *frame;
+    int level, found;
+
+    for (level=0; level<self->height-1; level++) {
+        if (!(frame = PagedTree__get(self, pgno, PAGE_INTERNAL)))
+            return -1;
+        path[level] = pgno;
+        slots[level] = Page__search(frame->data, key, klen, 1, &found);
+        pgno = Page__child(frame->data, slots[level]);
+        PagedTree__release(frame);
+    }
+
+    return pgno;
+}
+
+static int PagedTree__split(PagedTree *self, Frame *frame, int pos,
+                            const char *rec, int len, char *sep, int *sep_len,
+                            long *right)
+{
+    /*
+        Puts the record in slot pos of the full page, splitting it in
+        two by bytes. Sets the key to separate them and the new right page
+    */
+
+    char tmp[PAGE_SIZE], *p = frame->data;
+    const char *recs[PAGE_SIZE / 4 + 1];
+    int lens[PAGE_SIZE / 4 + 1], n = PAGE_SLOTS(p), total = 0, half, m, i;
+    int leaf = PAGE_TYPE(p) == PAGE_LEAF;
+    long child = Page__get32(p + 8);
+    Frame *rframe;
+
+    memcpy(tmp, p, PAGE_SIZE);
+    for (i=0; i<=n; i++) {
+        if (i == pos) {
+            recs[i] = rec;
+            lens[i] = len;
+        } else {
+            recs[i] = tmp + PAGE_SLOT(tmp, i - (i > pos));
+            lens[i] = Page__record_size(tmp, recs[i] - tmp);
+        }
+        total += lens[i] + 2;
+    }
+
+    for (m=0, half=0; m<n && half + lens[m] + 2 <= total / 2; m++)
+        half += lens[m] + 2;
+    // Both halves get a record, internal pages give one up
+    m = MAX(m, 1);
+    m = MIN(m, leaf ? n : n - 1);
+
+    // Leaves keep the first key of the right page, internal pages move
+    // the middle record up
+    *sep_len = Page__get16(recs[m]);
+    memcpy(sep, recs[m] + (leaf ? 4 : 6), *sep_len);
+
+    if (!(rframe = PagedTree__alloc(self, PAGE_TYPE(p),
+                                    leaf ? 0 : Page__get32(recs[m] + 2))))
+        return -1;
+    *right = rframe->pgno;
+
+    Page__init(p, PAGE_TYPE(tmp), child);
+    for (i=0; i<m; i++)
+        Page__insert(p, i, recs[i], lens[i]);
+    for (i=m+!leaf; i<=n; i++)
+        Page__insert(rframe->data, i - m - !leaf, recs[i], lens[i]);
+    frame->dirty = 1;
+    PagedTree__release(rframe);
+
+    return 0;
+}
+
+static int PagedTree__insert(PagedTree *self, PyObject *item)
+{
+    long path[PAGED_MAX_HEIGHT], pgno, right;
+    int slots[PAGED_MAX_HEIGHT], level, pos, found, klen, len, sep_len;
+    char rec[PAGE_SIZE], sep[PAGE_SIZE];
+    PyObject *key, *data = NULL;
+    Frame *frame;
+
+    if (PagedTree__check(self))
+        return -1;
+
+    if (!(key = PagedTree__key(self, item, 1)))
+        return -1;
+    if (self->keyfunc &&
+            !(data = PyMarshal_WriteObjectToString(item, Py_MARSHAL_VERSION))) {
+        Py_DECREF(key);
+        return -1;
+    }
+
+    klen = PyString_GET_SIZE(key);
+    len = 4 + klen + (data ? PyString_GET_SIZE(data) : 0);
+    if (len + 2 > PAGE_RECORD_MAX) {
+        Py_DECREF(key);
+        Py_XDECREF(data);
+        PyErr_SetString(PyExc_ValueError, "item is too big for a page");
+        return -1;
+    }
+
+    Page__set16(rec, klen);
+    Page__set16(rec + 2, len - 4 - klen);
+    memcpy(rec + 4, PyString_AS_STRING(key), klen);
+    if (data)
+        memcpy(rec + 4 + klen, PyString_AS_STRING(data), len - 4 - klen);
+    Py_XDECREF(data);
+
+    pgno = PagedTree__descend(self, PyString_AS_STRING(key), klen, path, slots);
+    if (pgno < 0 || !(frame = PagedTree__get(self, pgno, PAGE_LEAF))) {
+        Py_DECREF(key);
+        return -1;
+    }
+
+    pos = Page__search(frame->data, PyString_AS_STRING(key), klen, 0, &found);
+    if (!self->kind)
+        self->kind = PyString_AS_STRING(key)[0];
+    Py_DECREF(key);
+    if (found) {
+        PagedTree__release(frame);
+        PyErr_SetString(PyExc_KeyError, "key already present");
+        return -1;
+    }
+
+    // Splits go up the path as far as pages are full
+    for (level=self->height-1; ; level--) {
+        if (Page__room(frame->data) + PAGE_GARBAGE(frame->data) >= len + 2) {
+            Page__insert(frame->data, pos, rec, len);
+            frame->dirty = 1;
+            PagedTree__release(frame);
+            break;
+        }
+
+        if (PagedTree__split(self, frame, pos, rec, len, sep, &sep_len,
+                             &right)) {
+            PagedTree__release(frame);
+            return -1;
+        }
+        PagedTree__release(frame);
+
+        // The parent gets the separator with the new page on its right
+        len = 6 + sep_len;
+        Page__set16(rec, sep_len);
+        Page__set32(rec + 2, right);
+        memcpy(rec + 6, sep, sep_len);
+
+        if (!level) {
+            if (self->height == PAGED_MAX_HEIGHT) {
+                PyErr_SetString(PyExc_RuntimeError, "paged tree is too high");
+                return -1;
+            }
+            if (!(frame = PagedTree__alloc(self, PAGE_INTERNAL, self->root)))
+                return -1;
+            Page__insert(frame->data, 0, rec, len);
+            self->root = frame->pgno;
+            self->height++;
+            PagedTree__release(frame);
+            break;
+        }
+
+        if (!(frame = PagedTree__get(self, path[level-1], PAGE_INTERNAL)))
+            return -1;
+        pos = slots[level-1];
+    }
+
+    self->size++;
+    self->version++;
+
+    return 0;
+}
+
+static int PagedTree__leaf_find(PagedTree *self, PyObject *item,
+                                Frame **frame, int *pos)
+{
+    /*
+        Finds the leaf record of the item key. Returns 1 with the leaf
+        pinned if it's there, 0 if it's not, -1 on errors
+    */
+
+    long path[PAGED_MAX_HEIGHT], pgno;
+    int slots[PAGED_MAX_HEIGHT], found;
+    PyObject *key;
+
+    if (PagedTree__check(self))
+        return -1;
+
+    if (!(key = PagedTree__key(self, item, 0)))
+        return -1;
+
+    pgno = PagedTree__descend(self, PyString_AS_STRING(key),
+                              PyString_GET_SIZE(key), path, slots);
+    if (pgno < 0 || !(*frame = PagedTree__get(self, pgno, PAGE_LEAF))) {
+        Py_DECREF(key);
+        return -1;
+    }
+
+    *pos = Page__search((*frame)->data, PyString_AS_STRING(key),
+                        PyString_GET_SIZE(key), 0, &found);
+    Py_DECREF(key);
+    if (!found)
+        PagedTree__release(*frame);
+
+    return found;
+}
+
+static PyObject * PagedTree__item(const char *p, int i)
+{
+    // The item of leaf record i, decoded from the key if it's the key
+    const char *rec = p + PAGE_SLOT(p, i), *key = rec + 4;
+    int klen = Page__get16(rec), ilen = Page__get16(rec + 2);
+
+    if (ilen)
+        return PyMarshal_ReadObjectFromString((char *)key + klen, ilen);
+
+    return Paged__decode(&key, key + klen);
+}
+
+static PyObject * PagedTree_new(PyTypeObject *type, PyObject *args,
+                                PyObject *kwargs)
+{
+    PagedTree *self = (PagedTree *)type->tp_alloc(type, 0);
+
+    if (self)
+        self->fd = -1;
+
+    return (PyObject *)self;
+}
+
+static int PagedTree_init(PagedTree *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "cache", "key", NULL};
+    PyObject *path, *keyfunc = Py_None;
+    PY_LONG_LONG size;
+    char head[PAGE_SIZE];
+    Frame *frame;
+    int cache = 1024, i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "S|iO", kwlist,
+                                     &path, &cache, &keyfunc))
+        return -1;
+
+    if (self->path) {
+        PyErr_SetString(PyExc_RuntimeError, "paged tree is open already");
+        return -1;
+    }
+    if (cache < PAGED_MIN_CACHE) {
+        PyErr_Format(PyExc_ValueError, "cache must be at least %d pages",
+                     PAGED_MIN_CACHE);
+        return -1;
+    }
+
+    Py_INCREF(path);
+    self->path = path;
+    if (keyfunc != Py_None) {
+        Py_INCREF(keyfunc);
+        self->keyfunc = keyfunc;
+    }
+
+    for (self->nbuckets = 1; self->nbuckets < 2 * cache; self->nbuckets *= 2)
+        ;
+    self->nframes = cache;
+    self->frames = PyMem_New(Frame, cache);
+    self->pool = PyMem_Malloc((size_t)cache * PAGE_SIZE);
+    self->buckets = PyMem_New(int, self->nbuckets);
+    if (!self->frames || !self->pool || !self->buckets) {
+        PagedTree__close(self);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i=0; i<cache; i++) {
+        self->frames[i].data = self->pool + (size_t)i * PAGE_SIZE;
+        self->frames[i].pgno = -1;
+        self->frames[i].pins = 0;
+    }
+    for (i=0; i<self->nbuckets; i++)
+        self->buckets[i] = -1;
+
+    if ((self->fd = open(PyString_AS_STRING(path), O_RDWR | O_CREAT, 0644)) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyString_AS_STRING(path));
+        PagedTree__close(self);
+        return -1;
+    }
+
+    if (PagedTree__io(self, 0, head, 0)) {
+        PagedTree__close(self);
+        return -1;
+    }
+
+    if (!memcmp(head, PAGED_MAGIC, 8)) {
+        if (Page__get32(head + 8) != PAGE_SIZE) {
+            PyErr_SetString(PyExc_ValueError, "paged tree has another page size");
+            PagedTree__close(self);
+            return -1;
+        }
+        self->root = Page__get32(head + 12);
+        self->height = Page__get32(head + 16);
+        self->npages = Page__get32(head + 20);
+        memcpy(&size, head + 24, 8);
+        self->size = size;
+        self->kind = head[32];
+
+        // Walks keep a slot per level, the pages are checked as read
+        if (self->height < 1 || self->height > PAGED_MAX_HEIGHT ||
+                self->root < 1 || self->root >= self->npages ||
+                lseek(self->fd, 0, SEEK_END) != (off_t)self->npages * PAGE_SIZE) {
+            PyErr_Format(PyExc_ValueError, "%s has a corrupt header",
+                         PyString_AS_STRING(path));
+            PagedTree__close(self);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (lseek(self->fd, 0, SEEK_END) > 0) {
+        // Not ours, don't go writing over it
+        PyErr_Format(PyExc_ValueError, "%s is not a paged tree",
+                     PyString_AS_STRING(path));
+        PagedTree__close(self);
+        return -1;
+    }
+
+    // A new tree is an empty leaf
+    self->npages = 1;
+    self->height = 1;
+    if (!(frame = PagedTree__alloc(self, PAGE_LEAF, 0))) {
+        PagedTree__close(self);
+        return -1;
+    }
+    self->root = frame->pgno;
+    PagedTree__release(frame);
+
+    if (PagedTree__flush(self, 0)) {
+        PagedTree__close(self);
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject * PagedTree_insert(PagedTree *self, PyObject *args)
+{
+    PyObject *item;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (PagedTree__insert(self, item))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * PagedTree_delete(PagedTree *self, PyObject *args)
+{
+    PyObject *item;
+    Frame *frame;
+    int pos, rc;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if ((rc = PagedTree__leaf_find(self, item, &frame, &pos)) <= 0) {
+        if (!rc)
+            PyErr_SetString(PyExc_KeyError, "key not found");
+        return NULL;
+    }
+
+    Page__remove(frame->data, pos);
+    frame->dirty = 1;
+    PagedTree__release(frame);
+    self->size--;
+    self->version++;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * PagedTree_search(PagedTree *self, PyObject *args)
+{
+    PyObject *item, *rc;
+    Frame *frame;
+    int pos, found;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if ((found = PagedTree__leaf_find(self, item, &frame, &pos)) <= 0) {
+        if (!found)
+            PyErr_SetString(PyExc_KeyError, "key not found");
+        return NULL;
+    }
+
+    rc = PagedTree__item(frame->data, pos);
+    PagedTree__release(frame);
+
+    return rc;
+}
+
+static PyObject * PagedTree__iter(PagedTree *self, PyObject *lo, PyObject *hi)
+{
+    /*
+        Returns an iterator over the items with keys from lo to hi,
+        inclusive, positioned on the first one
+    */
+
+    PyObject *key = NULL;
+    PagedIter *it;
+    Frame *frame;
+    long pgno;
+    int level, found;
+
+    if (PagedTree__check(self))
+        return NULL;
+
+    if (!(it = PyObject_New(PagedIter, &PagedIterType)))
+        return NULL;
+    Py_INCREF(self);
+    it->tree = self;
+    it->hi = NULL;
+    it->version = self->version;
+    it->depth = 0;
+
+    if ((hi && !(it->hi = PagedTree__encode(self, hi, 0))) ||
+            (lo && !(key = PagedTree__encode(self, lo, 0)))) {
+        Py_DECREF(it);
+        return NULL;
+    }
+
+    for (level=0, pgno=self->root; level<self->height; level++) {
+        frame = PagedTree__get(self, pgno, level < self->height - 1 ?
+                                           PAGE_INTERNAL : PAGE_LEAF);
+        if (!frame) {
+            Py_XDECREF(key);
+            Py_DECREF(it);
+            return NULL;
+        }
+        it->pages[level] = pgno;
+        it->slots[level] = key ? Page__search(frame->data,
+                                              PyString_AS_STRING(key),
+                                              PyString_GET_SIZE(key),
+                                              level < self->height - 1,
+                                              &found) : 0;
+        if (level < self->height - 1) {
+            PagedTree__readahead(self, frame->data, it->slots[level]);
+            pgno = Page__child(frame->data, it->slots[level]);
+        }
+        PagedTree__release(frame);
+    }
+    it->depth = self->height;
+    Py_XDECREF(key);
+
+    return (PyObject *)it;
+}
+
+static PyObject * PagedTree_range(PagedTree *self, PyObject *args,
+                                  PyObject *kwargs)
+{
+    static char *kwlist[] = {"lo", "hi", NULL};
+    PyObject *lo = Py_None, *hi = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &lo, &hi))
+        return NULL;
+
+    return PagedTree__iter(self, IS_NONE(lo) ? NULL : lo,
+                           IS_NONE(hi) ? NULL : hi);
+}
+
+static PyObject * PagedTree_iter(PagedTree *self)
+{
+    return PagedTree__iter(self, NULL, NULL);
+}
+
+static PyObject * PagedTree_sync(PagedTree *self)
+{
+    if (PagedTree__check(self) || PagedTree__flush(self, 1))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * PagedTree_close(PagedTree *self)
+{
+    int rc = self->fd >= 0 ? PagedTree__flush(self, 1) : 0;
+
+    PagedTree__close(self);
+    if (rc)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * PagedTree_height(PagedTree *self)
+{
+    return PyInt_FromLong(self->height);
+}
+
+static Py_ssize_t PagedTree_Length(PagedTree *self)
+{
+    return self->size;
+}
+
+static int PagedTree_Contains(PagedTree *self, PyObject *item)
+{
+    Frame *frame;
+    int pos, found;
+
+    if ((found = PagedTree__leaf_find(self, item, &frame, &pos)) > 0)
+        PagedTree__release(frame);
+
+    return found;
+}
+
+static void PagedTree_dealloc(PagedTree *self)
+{
+    if (self->fd >= 0 && PagedTree__flush(self, 0))
+        PyErr_WriteUnraisable(self->path);
+    PagedTree__close(self);
+    Py_XDECREF(self->path);
+    Py_XDECREF(self->keyfunc);
+    self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyObject * PagedIter_iternext(PagedIter *self)
+{
+    PagedTree *tree = self->tree;
+    int leaf = tree->height - 1, level, klen, c;
+    const char *key;
+    PyObject *item;
+    Frame *frame;
+    long pgno;
+
+    if (!self->depth)
+        return NULL;
+
+    if (PagedTree__check(tree))
+        return NULL;
+    if (self->version != tree->version) {
+        PyErr_SetString(PyExc_RuntimeError, "tree changed during iteration");
+        return NULL;
+    }
+
+    for (;;) {
+        if (!(frame = PagedTree__get(tree, self->pages[leaf], PAGE_LEAF)))
+            return NULL;
+
+        if (self->slots[leaf] < PAGE_SLOTS(frame->data)) {
+            key = Page__key(frame->data, self->slots[leaf], &klen);
+            c = self->hi ? Paged__compare(key, klen,
+                                          PyString_AS_STRING(self->hi),
+                                          PyString_GET_SIZE(self->hi)) : -1;
+            if (c > 0) {
+                PagedTree__release(frame);
+                self->depth = 0;
+                return NULL;
+            }
+            item = PagedTree__item(frame->data, self->slots[leaf]++);
+            PagedTree__release(frame);
+            return item;
+        }
+        PagedTree__release(frame);
+
+        // Next leaf, up as far as a page has children left
+        for (level=leaf-1; level>=0; level--) {
+            if (!(frame = PagedTree__get(tree, self->pages[level],
+                                         PAGE_INTERNAL)))
+                return NULL;
+            if (++self->slots[level] <= PAGE_SLOTS(frame->data))
+                break;
+            PagedTree__release(frame);
+        }
+        if (level < 0) {
+            self->depth = 0;
+            return NULL;
+        }
+
+        // And down the leftmost way
+        for (;;) {
+            if (self->slots[level] % READAHEAD == 0)
+                PagedTree__readahead(tree, frame->data, self->slots[level]);
+            pgno = Page__child(frame->data, self->slots[level]);
+            PagedTree__release(frame);
+            level++;
+            self->pages[level] = pgno;
+            self->slots[level] = 0;
+            if (level == leaf)
+                break;
+            if (!(frame = PagedTree__get(tree, pgno, PAGE_INTERNAL)))
+                return NULL;
+            PagedTree__readahead(tree, frame->data, 0);
+        }
+    }
+}
+
+static void PagedIter_dealloc(PagedIter *self)
+{
+    Py_DECREF(self->tree);
+    Py_XDECREF(self->hi);
+    PyObject_Del(self);
+}
+
+static PyMethodDef PagedTree_methods[] = {
+    {"insert", (PyCFunction)PagedTree_insert, METH_VARARGS,
+     "Inserts a new key into the tree"
+    },
+    {"delete", (PyCFunction)PagedTree_delete, METH_VARARGS,
+     "Deletes a key from the tree"
+    },
+    {"search", (PyCFunction)PagedTree_search, METH_VARARGS,
+     "Returns the item with the key"
+    },
+    {"range", (PyCFunction)PagedTree_range, METH_VARARGS | METH_KEYWORDS,
+     "Returns an iterator over the items with keys between lo and hi, "
+     "inclusive"
+    },
+    {"height", (PyCFunction)PagedTree_height, METH_NOARGS,
+     "Returns tree height"
+    },
+    {"sync", (PyCFunction)PagedTree_sync, METH_NOARGS,
+     "Writes the changed pages out and syncs the file"
+    },
+    {"close", (PyCFunction)PagedTree_close, METH_NOARGS,
+     "Syncs and closes the file"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef PagedTree_members[] = {
+    {"page_reads", T_PYSSIZET, offsetof(PagedTree, reads), READONLY,
+     "number of pages read from the file"},
+    {"page_writes", T_PYSSIZET, offsetof(PagedTree, writes), READONLY,
+     "number of pages written to the file"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods PagedTree_as_sequence = {
+    (lenfunc)PagedTree_Length,  /* sq_length */
+    0,                          /* sq_concat */
+    0,                          /* sq_repeat */
+    0,                          /* sq_item */
+    0,                          /* sq_slice */
+    0,                          /* sq_ass_item */
+    0,                          /* sq_ass_slice */
+    (objobjproc)PagedTree_Contains, /* sq_contains */
+    0,                          /* sq_inplace_concat */
+    0,                          /* sq_inplace_repeat */
+};
+
+static PyTypeObject PagedTreeType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.PagedTree",           /*tp_name*/
+    sizeof(PagedTree),         /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PagedTree_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &PagedTree_as_sequence,    /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_SEQUENCE_IN, /*tp_flags*/
+    "B+-tree kept in a file with a bounded page cache. Pages are written "
+    "in place, the file is only consistent after sync() or close()",
+                               /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    (getiterfunc)PagedTree_iter, /* tp_iter */
+    0,                         /* tp_iternext */
+    PagedTree_methods,         /* tp_methods */
+    PagedTree_members,         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)PagedTree_init,  /* tp_init */
+    0,                         /* tp_alloc */
+    PagedTree_new,             /* tp_new */
+};
+
+static PyTypeObject PagedIterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.PagedIter",           /*tp_name*/
+    sizeof(PagedIter),         /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PagedIter_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Paged tree iterator",     /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)PagedIter_iternext, /* tp_iternext */
+};
+
+typedef struct Avl {
+    Node node;
+} Avl;
+
+static PyMethodDef Avl_methods[] = {
+    {NULL}  /* Sentinel */
+};
+
+static void Avl__rebalance(Node *self)
+{
+    /*
+        The rotated nodes change, the ones shared with snapshots are
+        taken over first
+    */
+
+    Node *new_pivot;
+    
+    if (self->bf == 2)
+        if (self->left->bf >= 0) {
+            // Left-left case
+            //printf("left-left\n");
+            Node__rotate_cw(Node__own(self, 1));
+        } else {
+            // Left-right case
+            //printf("left-right\n");
+            new_pivot = Node__rotate_ccw(Node__own(Node__own(self, 1), 0));
+            Node__rotate_cw(new_pivot);
+        }
+    else if (self->bf == -2) 
+        if (self->right->bf <= 0) {
+            // Right-right case
+            //printf("right-right\n");
+            Node__rotate_ccw(Node__own(self, 0));
+        } else {
+            // Right-left case
+            //printf("right-left\n");
+            new_pivot = Node__rotate_cw(Node__own(Node__own(self, 0), 1));
+            Node__rotate_ccw(new_pivot);
+        }
+    else
+        PyErr_SetString(PyExc_RuntimeError, "Unable to balance node");
+}
+
+static PyObject * Avl_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Node *self;
+    
+    self = (Node *)type->tp_alloc(type, 0);
+    if (self)
+        self->rebalance = Avl__rebalance;
+        
+    return (PyObject *)self;
+}
+
+
+static PyTypeObject AvlType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "avl.Avl",                 /*tp_name*/
+    sizeof(Avl),               /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    0,                         /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_BASETYPE,    /*tp_flags*/
+    "Avl object",              /* tp_doc */
+    0,	    	               /* tp_traverse */
+    0,	                       /* tp_clear */
+    0,	                       /* tp_richcompare */
+    0,	                       /* tp_weaklistoffset */
+    0,	                       /* tp_iter */
+    0,	                       /* tp_iternext */
+    Avl_methods,               /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    Avl_new,                   /* tp_new */
+};
+
+
+/********************* Tree ********************************/
+
+static int AvlTree_init(AvlTree *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"items", "multi", "key", "lazy", "index",
+                             "threads", NULL};
+    PyObject *items = NULL, *keyfunc = NULL, *node_type, *tmp;
+    int multi = 0, index = 0, threads = 0;
+    double lazy = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OiOdii", kwlist,
+                                     &items, &multi, &keyfunc, &lazy, &index,
+                                     &threads))
+        return -1;
+
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+
+    if (lazy < 0 || lazy > 1) {
+        PyErr_SetString(PyExc_ValueError, "lazy must be between 0 and 1");
+        return -1;
+    }
+
+    // Subclasses pick the node type they are built of
+    node_type = PyObject_GetAttrString((PyObject *)self, "_node_class");
+    if (!node_type)
+        return -1;
+    if (!PyType_Check(node_type) ||
+            !PyType_IsSubtype((PyTypeObject *)node_type, &NodeType)) {
+        Py_DECREF(node_type);
+        PyErr_SetString(PyExc_TypeError, "_node_class must be a Node subclass");
+        return -1;
+    }
+
+    tmp = (PyObject *)self->node_type;
+    self->node_type = (PyTypeObject *)node_type;
+    Py_XDECREF(tmp);
+
+    tmp = self->keyfunc;
+    Py_XINCREF(keyfunc);
+    self->keyfunc = keyfunc;
+    Py_XDECREF(tmp);
+
+    self->flags = (multi ? TREE_MULTI : 0) | (lazy ? TREE_LAZY : 0);
+    self->garbage = lazy;
+    if (!self->root)
+        self->gen = ++generations;
+
+    tmp = self->index;
+    self->index = index ? PyDict_New() : NULL;
+    Py_XDECREF(tmp);
+    if (index && !self->index)
+        return -1;
 
-    delta = abs(pivot->bf) - abs(old_bf);
-    if (NOT_NONE(parent)) {
-        // When rotating, every height change in one node is accounted
-        // for double change in bf, e.g. when rotating tree with bf = 2 CW,
-        // the new bf will be 0, height will decrease by 1
-        if (delta > 0)
-            // Subtree height increased
-            Node__update_bf_on_increase(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
-        else if (delta < 0)
-            // Subtree height decreased
-            Node__update_bf_on_decrease(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
+    if (!items || items == Py_None)
+        return 0;
+
+    if (self->root) {
+        PyErr_SetString(PyExc_RuntimeError, "tree is not empty");
+        return -1;
     }
 
-    return pivot;
+    return AvlTree__fill(self, items, 0, threads);
 }
 
-#if 0
-        PARENT                    PARENT
-        /    \                   /     \
-             LEFT         =>          PIVOT
-            /    \                    /   \
-           A    PIVOT              LEFT    RIGHT
-               /     \            /    \
-              B     RIGHT        A      B
-#endif
+static Node * AvlTree__find(AvlTree *self, PyObject *item)
+{
+    /*
+        Returns the node holding the item key, NULL with KeyError set if
+        there's none
+    */
 
-static Node * Node__rotate_ccw(Node *self)
+    PyObject *key;
+    Node *n;
+    int c;
+
+    if (!(key = AvlTree__key(self, item)))
+        return NULL;
+
+    if (self->index)
+        n = AvlTree__lookup(self, key);
+    else if ((n = self->root ? Node__locate(self->root, key, &c) : NULL) &&
+             (!n->count || c))
+        n = NULL;
+    Py_DECREF(key);
+
+    // Comparison errors go through as they are
+    if (!n && !PyErr_Occurred())
+        PyErr_SetString(PyExc_KeyError, "key not found");
+
+    return n;
+}
+
+static PyObject * AvlTree_insert(AvlTree *self, PyObject *args)
 {
-    Node *left = self->parent;
-    Node *a, *pivot, *parent;
-    PyObject *l_key;
-    int old_bf, delta;
+    PyObject *item;
 
-    if (IS_NONE(left)) {
-        PyErr_SetString(PyExc_RuntimeError, "can't rotate root node");
+    if (!PyArg_ParseTuple(args, "O", &item))
         return NULL;
-    } else if (left->left == self) {
-        PyErr_SetString(PyExc_RuntimeError, "can't rotate left subtree CCW");
+
+    if (AvlTree__insert(self, item))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * AvlTree_delete(AvlTree *self, PyObject *args)
+{
+    PyObject *item;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (AvlTree__delete(self, item))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * AvlTree_search(AvlTree *self, PyObject *args)
+{
+    PyObject *item;
+    Node *n;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(n = AvlTree__find(self, item)))
+        return NULL;
+
+    Py_INCREF(n);
+    return (PyObject *)n;
+}
+
+static PyObject * AvlTree_count(AvlTree *self, PyObject *args)
+{
+    PyObject *item;
+    Node *n;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if ((n = AvlTree__find(self, item)))
+        return PyInt_FromSsize_t(n->count);
+
+    if (!PyErr_ExceptionMatches(PyExc_KeyError))
+        return NULL;
+    PyErr_Clear();
+
+    return PyInt_FromLong(0);
+}
+
+static PyObject * AvlTree_rank(AvlTree *self, PyObject *args)
+{
+    PyObject *item, *key;
+    Py_ssize_t rank = 0;
+
+    if (!PyArg_ParseTuple(args, "O", &item))
+        return NULL;
+
+    if (!(key = AvlTree__key(self, item)))
+        return NULL;
+
+    if (self->root)
+        rank = Node__rank(self->root, key);
+    Py_DECREF(key);
+    if (rank < 0)
+        return NULL;
+
+    return PyInt_FromSsize_t(rank);
+}
+
+static PyObject * AvlTree_iter(AvlTree *self)
+{
+    // Items in key order, repeated by multiplicity, see merge()
+    PyObject *args, *it;
+
+    if (!(args = PyTuple_Pack(1, self)))
+        return NULL;
+    it = avl_merge(NULL, args, NULL);
+    Py_DECREF(args);
+
+    return it;
+}
+
+static PyObject * AvlTree_from_list(PyObject *cls, PyObject *args,
+                                    PyObject *kwargs)
+{
+    return PyObject_Call(cls, args, kwargs);
+}
+
+static PyObject * AvlTree_from_sorted(PyObject *cls, PyObject *args,
+                                      PyObject *kwargs)
+{
+    static char *kwlist[] = {"items", "multi", "key", "lazy", "index", NULL};
+    PyObject *items, *keyfunc = Py_None;
+    AvlTree *tree;
+    int multi = 0, index = 0;
+    double lazy = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOdi", kwlist,
+                                     &items, &multi, &keyfunc, &lazy, &index))
+        return NULL;
+
+    tree = (AvlTree *)PyObject_CallFunction(cls, "OiOdi", Py_None, multi,
+                                            keyfunc, lazy, index);
+    if (tree && AvlTree__fill(tree, items, 1, 1)) {
+        Py_DECREF(tree);
         return NULL;
     }
 
-    // Save old subtree bf
-    old_bf = left->bf;
-    // Save the subtree
-    a = left->left;
-    l_key = left->key;
-    // Move PIVOT into LEFT
-    Node__move(self, left);
+    return (PyObject *)tree;
+}
 
-    // Manually reconnect RIGHT to the new PIVOT
-    if (NOT_NONE(self->right)) {
-        // Disconnect old PIVOT from RIGHT
-        Py_DECREF(self->right->parent);
-        // Reconnect RIGHT to the new PIVOT, no incref needed
-        self->right->parent = left;
+static PyObject * AvlTree_from_list_raw(PyObject *cls, PyObject *args,
+                                        PyObject *kwargs)
+{
+    static char *kwlist[] = {"l", "multi", "key", "lazy", "index", "validate",
+                             NULL};
+    PyObject *l, *keyfunc = Py_None;
+    RawImport im = {NULL};
+    AvlTree *tree;
+    Node *root;
+    int multi = 0, index = 0;
+    double lazy = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOdii", kwlist,
+                                     &l, &multi, &keyfunc, &lazy, &index,
+                                     &im.validate))
+        return NULL;
+
+    tree = (AvlTree *)PyObject_CallFunction(cls, "OiOdi", Py_None, multi,
+                                            keyfunc, lazy, index);
+    if (!tree || IS_NONE(l))
+        return (PyObject *)tree;
+
+    im.type = tree->node_type;
+    im.keyfunc = tree->keyfunc;
+    im.gen = tree->gen;
+    root = RawImport__run(&im, l, (Node *)Py_None);
+    if (!root) {
+        Py_DECREF(tree);
+        return NULL;
     }
 
-    // old PIVOT is the new LEFT
-    self->key = l_key;
-    left->left = self;
-    Py_INCREF(self->parent);
-    // Move B to the right subtree
-    self->right = self->left;
+    AvlTree__set_root(tree, root);
+    tree->size = im.size;
+    // Nodes with zero count are tombstones
+    tree->dead = im.dead;
+    tree->live = im.live;
+    Py_DECREF(root);
 
-    // Reconnect A to the new LEFT
-    if (NOT_NONE(a)) {
-        a->parent = self;
-        Py_INCREF(a->parent);
+    if (AvlTree__reindex(tree)) {
+        Py_DECREF(tree);
+        return NULL;
     }
-    self->left = a;
 
-    // Update bf's
-    // Redefine variables to catch up with the rotation changes
-    pivot = left;
-    left = self;
-    parent = pivot->parent;
-    // LEFT's right subtree is 1 node shorter now (minus PIVOT)
-    left->bf = old_bf + 1;
-    if (pivot->bf < 0)
-        // If PIVOT bf < 0 PIVOT subtree height was represented by RIGHT
-        // RIGHT is no longer LEFT's successor, so compensate for it
-        left->bf -= pivot->bf;
+    return (PyObject *)tree;
+}
 
-    // PIVOT's left subtree is 1 node longer now (plus LEFT)
-    pivot->bf += 1;
-    if (left->bf > 0)
-        // If LEFT bf > 0 LEFT subtree height is represented by A
-        // A is now PIVOT's successor, update bf accordingly
-        pivot->bf += left->bf;
+static int AvlTree__load(AvlTree *self, PyObject *path, PY_LONG_LONG *gen)
+{
+    /*
+        Fills the empty tree from a snapshot file in linear time, the
+        keys come sorted. Sets gen to the snapshot generation, 0 if
+        there's no snapshot
+    */
 
-    delta = abs(pivot->bf) - abs(old_bf);
-    if (NOT_NONE(parent)) {
-        // When rotating, every height change in one node is accounted
-        // for double change in bf, e.g. when rotating tree with bf = 2 CW,
-        // the new bf will be 0, height will decrease by 1
-        if (delta > 1)
-            // Subtree height increased
-            Node__update_bf_on_increase(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
-        else if (delta < -1)
-            // Subtree height decreased
-            Node__update_bf_on_decrease(parent, delta/2 * Node__get_child_place(parent, pivot), 0);
+    PY_LONG_LONG left;
+    Py_ssize_t len = 0, alloc = 0, count, i;
+    PyObject *obj, *item, *key;
+    Node **nodes = NULL, **tmp, *n;
+    char op;
+    FILE *f;
+    int rc;
+
+    *gen = 0;
+    if (!(f = Log__open_file(path, SNAPSHOT_MAGIC, gen, &left)))
+        return PyErr_Occurred() ? -1 : 0;
+
+    while ((rc = Log__read(f, &left, &op, &obj)) > 0) {
+        item = obj;
+        count = 1;
+        if (op == REC_MULTI && (self->flags & TREE_MULTI) &&
+                PyArg_ParseTuple(obj, "On", &item, &count))
+            ;
+        else if (op != REC_INSERT) {
+            Py_DECREF(obj);
+            PyErr_SetString(PyExc_ValueError, "bad snapshot record");
+            rc = -1;
+            break;
+        }
+
+        if (len == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            if (!(tmp = PyMem_Realloc(nodes, alloc * sizeof(Node *)))) {
+                Py_DECREF(obj);
+                PyErr_NoMemory();
+                rc = -1;
+                break;
+            }
+            nodes = tmp;
+        }
+
+        if (!(key = AvlTree__key(self, item))) {
+            Py_DECREF(obj);
+            rc = -1;
+            break;
+        }
+        n = Node__new(self->node_type, key, (Node *)Py_None, (Node *)Py_None,
+                      (Node *)Py_None);
+        if (key != item) {
+            Py_INCREF(item);
+            n->item = item;
+        }
+        n->count = count;
+        Py_DECREF(key);
+        Py_DECREF(obj);
+        nodes[len++] = n;
+
+        if (len > 1 && Node__compare(nodes[len-2]->key, n->key) >= 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "snapshot is not sorted");
+            rc = -1;
+            break;
+        }
     }
+    fclose(f);
 
-    return pivot;
+    // Snapshots are moved in place once written, they can't be cut short
+    if (!rc && (*gen < 0 || left)) {
+        PyErr_SetString(PyExc_ValueError, "snapshot is truncated");
+        rc = -1;
+    }
+
+    if (rc) {
+        for (i=0; i<len; i++)
+            Py_DECREF(nodes[i]);
+        PyMem_Free(nodes);
+        return -1;
+    }
+
+    rc = AvlTree__plant(self, nodes, len);
+    PyMem_Free(nodes);
+
+    return rc;
 }
 
-static int Node__delete(Node *self)
+static int AvlTree__replay(AvlTree *self, PyObject *path, PY_LONG_LONG gen,
+                           PY_LONG_LONG *keep)
 {
-    Node *utmost, *n_self, *p = self->parent;
-    int bf;
-    PyObject *ut_key, *s_key;
-
-    if ((NOT_NONE(self->left) && NOT_NONE(self->right)) || IS_NONE(p)) {
-        // Both children exist or root node
-        if (NOT_NONE(self->left))
-            // Left child present or both children present
-            utmost = Node__rightmost(self->left);
-        else if (NOT_NONE(self->right))
-            // Only right child present, root node
-            utmost = Node__leftmost(self->right);
+    /*
+        Applies the log on top of the snapshot of generation gen. Sets
+        keep to the length of the records good to go on from, -1 if the
+        log has to start over. A log older than the snapshot is left
+        over from the checkpoint that took it, its changes are in
+    */
+
+    PY_LONG_LONG lgen, left, total;
+    PyObject *item;
+    char op;
+    FILE *f;
+    int rc;
+
+    *keep = -1;
+    if (!(f = Log__open_file(path, LOG_MAGIC, &lgen, &left)))
+        return PyErr_Occurred() ? -1 : 0;
+
+    if (lgen > gen) {
+        fclose(f);
+        PyErr_SetString(PyExc_ValueError, "log goes on from a missing snapshot");
+        return -1;
+    } else if (lgen < gen) {
+        fclose(f);
+        return 0;
+    }
+
+    total = left;
+    while ((rc = Log__read(f, &left, &op, &item)) > 0) {
+        if (op == REC_INSERT)
+            rc = AvlTree__insert(self, item);
+        else if (op == REC_DELETE)
+            rc = AvlTree__delete(self, item);
         else {
-            // No children, root node
-            PyErr_SetString(PyExc_RuntimeError, "can't remove the last node");
-            return -1;
+            PyErr_SetString(PyExc_ValueError, "bad log record");
+            rc = -1;
+        }
+        Py_DECREF(item);
+        if (rc) {
+            rc = -1;
+            break;
+        }
+    }
+    fclose(f);
+
+    if (rc)
+        return -1;
+
+    // Whatever follows the last good record was cut short by a crash
+    *keep = total - left;
+    return 0;
+}
+
+static int AvlTree__sync_policy(const char *sync)
+{
+    if (!strcmp(sync, "none"))
+        return SYNC_NONE;
+    else if (!strcmp(sync, "batch"))
+        return SYNC_BATCH;
+    else if (!strcmp(sync, "always"))
+        return SYNC_ALWAYS;
+
+    PyErr_SetString(PyExc_ValueError,
+                    "sync must be one of 'none', 'batch' and 'always'");
+    return -1;
+}
+
+static PyObject * AvlTree_open(PyObject *cls, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"snapshot", "log", "multi", "key", "lazy", "index",
+                             "sync", "batch", NULL};
+    PyObject *snapshot, *log, *keyfunc = Py_None;
+    PY_LONG_LONG gen, keep;
+    char *sync = "always";
+    Py_ssize_t batch = 64;
+    AvlTree *tree;
+    int multi = 0, index = 0, policy;
+    double lazy = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "SS|iOdisn", kwlist,
+                                     &snapshot, &log, &multi, &keyfunc, &lazy,
+                                     &index, &sync, &batch))
+        return NULL;
+
+    if ((policy = AvlTree__sync_policy(sync)) < 0)
+        return NULL;
+    if (batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch must be positive");
+        return NULL;
+    }
+
+    tree = (AvlTree *)PyObject_CallFunction(cls, "OiOdi", Py_None, multi,
+                                            keyfunc, lazy, index);
+    if (!tree)
+        return NULL;
+
+    // The log is attached last, replaying it doesn't log anything
+    if (AvlTree__load(tree, snapshot, &gen) ||
+            AvlTree__replay(tree, log, gen, &keep) ||
+            !(tree->log = Log__new(log, snapshot, gen, keep, policy, batch))) {
+        Py_DECREF(tree);
+        return NULL;
+    }
+
+    return (PyObject *)tree;
+}
+
+#define SET_UNION 0
+#define SET_INTERSECTION 1
+#define SET_DIFFERENCE 2
+
+typedef struct Pick {
+    Py_ssize_t pos;             // Into a, then b past the end of a
+    Py_ssize_t count;
+} Pick;
+
+typedef struct CombineJob {
+    unsigned PY_LONG_LONG *ka, *kb;
+    Py_ssize_t *ca, *cb;        // Key counts
+    Py_ssize_t la, lb;
+    Py_ssize_t k0, k1;          // Range of the merge to combine
+    int op;
+    Pick *picks;                // Room for the keys of the range
+    Py_ssize_t len;             // Number of picks made
+} CombineJob;
+
+static void Combine__split(CombineJob *job, Py_ssize_t k,
+                           Py_ssize_t *i, Py_ssize_t *j)
+{
+    /*
+        Splits the merge after its first k keys, a going first on equal
+        keys. A key of b equal to the last of a before the split goes
+        along with it
+    */
+
+    Py_ssize_t lo = MAX(0, k - job->lb), hi = MIN(k, job->la), m;
+
+    while (lo < hi) {
+        m = lo + (hi - lo) / 2;
+        if (job->ka[m] <= job->kb[k-m-1])
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    *i = lo;
+    *j = k - lo;
+    if (*i > 0 && *j < job->lb && job->ka[*i-1] == job->kb[*j])
+        (*j)++;
+}
+
+static void Combine__job(void *arg)
+{
+    /*
+        Same merge as AvlTree__combine on the native keys of the range
+    */
+
+    CombineJob *job = (CombineJob *)arg;
+    Py_ssize_t i, j, i1, j1, count;
+    int c, op = job->op;
+
+    Combine__split(job, job->k0, &i, &j);
+    Combine__split(job, job->k1, &i1, &j1);
+    job->picks += i + j;
+    job->len = 0;
+
+    while (i < i1 || (j < j1 && op == SET_UNION)) {
+        if (j >= j1)
+            c = -1;
+        else if (i >= i1)
+            c = 1;
+        else
+            c = (job->ka[i] > job->kb[j]) - (job->ka[i] < job->kb[j]);
+
+        if (c < 0)
+            count = op == SET_INTERSECTION ? 0 : job->ca[i];
+        else if (c > 0)
+            count = op == SET_UNION ? job->cb[j] : 0;
+        else if (op == SET_UNION)
+            count = MAX(job->ca[i], job->cb[j]);
+        else if (op == SET_INTERSECTION)
+            count = MIN(job->ca[i], job->cb[j]);
+        else
+            count = job->ca[i] - job->cb[j];
+
+        if (count > 0) {
+            job->picks[job->len].pos = c > 0 ? job->la + j : i;
+            job->picks[job->len++].count = count;
+        }
+
+        if (c <= 0)
+            i++;
+        if (c >= 0)
+            j++;
+    }
+}
+
+static Py_ssize_t Node__walk_live(Node *self, Node **nodes, Py_ssize_t len)
+{
+    /*
+        Appends the nodes holding keys to the first len of the array in
+        key order. Returns the new length
+    */
+
+    if (IS_NONE(self))
+        return len;
+
+    len = Node__walk_live(self->left, nodes, len);
+    if (self->count)
+        nodes[len++] = self;
+
+    return Node__walk_live(self->right, nodes, len);
+}
+
+static Py_ssize_t AvlTree__native_combine(AvlTree *self, AvlTree *other,
+                                          int op, int threads, Node **nodes)
+{
+    /*
+        AvlTree__combine on several threads for native keys, the keys
+        and counts get copied out so that the threads don't look at the
+        trees. Fills the array with the new nodes, returns their number,
+        -2 leaving it empty if the keys aren't native ones
+    */
+
+    CombineJob jobs[PARALLEL_MAX * PARALLEL_JOBS];
+    Py_ssize_t la, lb, len = 0, i, k;
+    unsigned PY_LONG_LONG *keys;
+    Py_ssize_t *counts;
+    Node **walk, *n;
+    Pick *picks;
+    int seen, njobs = threads * PARALLEL_JOBS;
+
+    // Room for the tombstones too
+    i = self->size + self->dead + other->size + other->dead;
+    walk = PyMem_New(Node *, i);
+    keys = PyMem_New(unsigned PY_LONG_LONG, i);
+    counts = PyMem_New(Py_ssize_t, i);
+    picks = PyMem_New(Pick, i);
+    if (!walk || !keys || !counts || !picks) {
+        PyErr_NoMemory();
+        len = -1;
+        goto done;
+    }
+
+    la = self->root ? Node__walk_live(self->root, walk, 0) : 0;
+    lb = (other->root ? Node__walk_live(other->root, walk, la) : la) - la;
+    seen = Native__scan(walk, la + lb, 0);
+    if (!Native__usable(seen)) {
+        len = -2;
+        goto done;
+    }
+
+    // Other threads may change the trees while the GIL is released
+    for (i=0; i < la + lb; i++) {
+        Py_INCREF(walk[i]);
+        keys[i] = Native__image(walk[i]->key, seen);
+        counts[i] = walk[i]->count;
+    }
+
+    for (i=0; i<njobs; i++) {
+        jobs[i].ka = keys;
+        jobs[i].kb = keys + la;
+        jobs[i].ca = counts;
+        jobs[i].cb = counts + la;
+        jobs[i].la = la;
+        jobs[i].lb = lb;
+        jobs[i].k0 = (la + lb) / njobs * i + (la + lb) % njobs * i / njobs;
+        jobs[i].k1 = (la + lb) / njobs * (i + 1) +
+                     (la + lb) % njobs * (i + 1) / njobs;
+        jobs[i].op = op;
+        jobs[i].picks = picks;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    Parallel__run(Combine__job, jobs, sizeof(CombineJob), njobs, threads);
+    Py_END_ALLOW_THREADS
+
+    for (i=0; i<njobs; i++)
+        for (k=0; k < jobs[i].len; k++) {
+            n = walk[jobs[i].picks[k].pos];
+            nodes[len++] = Node__clone(self->node_type, n,
+                                       jobs[i].picks[k].count);
+        }
+
+    for (i=0; i < la + lb; i++)
+        Py_DECREF(walk[i]);
+
+    done:
+        PyMem_Free(walk);
+        PyMem_Free(keys);
+        PyMem_Free(counts);
+        PyMem_Free(picks);
+        return len;
+}
+
+static PyObject * AvlTree__combine(AvlTree *self, PyObject *args,
+                                   PyObject *kwargs, int op)
+{
+    /*
+        Merges in-order walks of both trees into a new tree of the same
+        kind as self, built in linear time. Multiset counts combine like
+        collections.Counter ones: max, min and subtraction. Native keys
+        get merged on the given number of threads
+    */
+
+    static char *kwlist[] = {"other", "threads", NULL};
+    Path pa = {NULL}, pb = {NULL};
+    AvlTree *other, *tree;
+    Node **nodes, *a = NULL, *b = NULL, *n;
+    Py_ssize_t len = 0, count;
+    int c, threads = 0, native = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|i", kwlist,
+                                     &AvlTreeType, &other, &threads))
+        return NULL;
+
+    if (!(nodes = PyMem_New(Node *, self->size + self->dead +
+                                    other->size + other->dead))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    threads = Parallel__threads(threads);
+    if (threads > 1 && self->size + other->size >= PARALLEL_MIN) {
+        len = AvlTree__native_combine(self, other, op, threads, nodes);
+        if (len == -1) {
+            len = 0;
+            goto err;
         }
+        native = len >= 0;
+        len = MAX(len, 0);
+    }
+
+    // Done already with native keys
+    if (!native) {
+        a = Path__skip_dead(&pa, Path__first(&pa, self->root), 0);
+        b = Path__skip_dead(&pb, Path__first(&pb, other->root), 0);
+        if (PyErr_Occurred())
+            goto err;
+    }
 
-        ut_key = utmost->key;
-        //printf("ut_key = %li\n", PyInt_AS_LONG(ut_key));
-        s_key = self->key;
-        Py_INCREF(ut_key);
-        Node__delete(utmost);
-        
-        n_self = Node__search(self, s_key);
-        Py_DECREF(n_self->key);
-        n_self->key = ut_key;
-    } else {
-        // Non-root node with only one child
-        bf = Node__get_child_place(p, self);
+    while (a || (b && op == SET_UNION)) {
+        if (!b)
+            c = -1;
+        else if (!a)
+            c = 1;
+        else if ((c = Node__compare(a->key, b->key)) == -1 && PyErr_Occurred())
+            goto err;
+
+        n = c > 0 ? b : a;
+        if (c < 0)
+            count = op == SET_INTERSECTION ? 0 : a->count;
+        else if (c > 0)
+            count = op == SET_UNION ? b->count : 0;
+        else if (op == SET_UNION)
+            count = MAX(a->count, b->count);
+        else if (op == SET_INTERSECTION)
+            count = a->count < b->count ? a->count : b->count;
+        else
+            count = a->count - b->count;
+
+        if (count > 0)
+            nodes[len++] = Node__clone(self->node_type, n, count);
 
-        if (NOT_NONE(self->left))
-            // Only left child exists
-            Node__connect_to_parent(self->left, p);
-        else if (NOT_NONE(self->right))
-            // Only right child exists
-            Node__connect_to_parent(self->right, p);
-        else // No children exist, node is not root
-            Node__disconnect(p, self);
+        if (c <= 0)
+            a = Path__skip_dead(&pa, Path__next(&pa), 0);
+        if (c >= 0)
+            b = Path__skip_dead(&pb, Path__next(&pb), 0);
+        if (PyErr_Occurred())
+            goto err;
 
-        Node__update_bf_on_decrease(p, -bf, 0);
+        if (!b && op == SET_INTERSECTION)
+            break;
+    }
+    Path__clear(&pa);
+    Path__clear(&pb);
+
+    // The new tree owns all its nodes
+    tree = AvlTree__new(self->ob_type, self->node_type,
+                        self->flags & ~(TREE_PINNED | TREE_SHARED),
+                        self->keyfunc);
+    if (!tree)
+        goto err;
+    tree->garbage = self->garbage;
+    if (self->index && !(tree->index = PyDict_New())) {
+        Py_DECREF(tree);
+        goto err;
+    }
+    if (AvlTree__plant(tree, nodes, len)) {
+        Py_DECREF(tree);
+        tree = NULL;
     }
+    PyMem_Free(nodes);
 
-    return 0;
+    return (PyObject *)tree;
+
+    err:
+        Path__clear(&pa);
+        Path__clear(&pb);
+        for (; len > 0; len--)
+            Py_DECREF(nodes[len-1]);
+        PyMem_Free(nodes);
+        return NULL;
 }
-/********************* Export functions ********************************/
 
-static int Node_init(Node *self, PyObject *args)
+static PyObject * AvlTree_union(AvlTree *self, PyObject *args,
+                                PyObject *kwargs)
 {
-    PyObject *key, *tmp;
-    Node *left = NULL;
-    Node *right = NULL;
-    Node *parent = NULL;
-
-    if (!PyArg_ParseTuple(args, "O|OOO", &key, &left, &right, &parent))
-        return -1;
+    return AvlTree__combine(self, args, kwargs, SET_UNION);
+}
 
-    if (!left)
-        left = (Node *)Py_None;
-    if (!right)
-        right = (Node *)Py_None;
-    if (!parent)
-        parent = (Node *)Py_None;
+static PyObject * AvlTree_intersection(AvlTree *self, PyObject *args,
+                                       PyObject *kwargs)
+{
+    return AvlTree__combine(self, args, kwargs, SET_INTERSECTION);
+}
 
-    tmp = self->key;
-    Py_INCREF(key);
-    self->key = key;
-    Py_XDECREF(tmp);
+static PyObject * AvlTree_difference(AvlTree *self, PyObject *args,
+                                     PyObject *kwargs)
+{
+    return AvlTree__combine(self, args, kwargs, SET_DIFFERENCE);
+}
 
-    tmp = (PyObject *)self->left;
-    Py_INCREF(left);
-    self->left = left;
-    Py_XDECREF(tmp);
+static PyObject * AvlTree_to_list(AvlTree *self)
+{
+    if (!self->root) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
 
-    tmp = (PyObject *)self->right;
-    Py_INCREF(right);
-    self->right = right;
-    Py_XDECREF(tmp);
+    // Tombstones are kept with zero counts
+    return Node__to_list(self->root, self->flags & (TREE_MULTI | TREE_LAZY));
+}
 
-    tmp = (PyObject *)self->parent;
-    Py_INCREF(parent);
-    self->parent = parent;
-    Py_XDECREF(tmp);
+static PyObject * AvlTree_to_dict(AvlTree *self, PyObject *args)
+{
+    if (self->root)
+        return Node_to_dict(self->root, args);
 
-    return 0;
+    return PyDict_New();
 }
 
-static Node * Node_search(Node *self, PyObject *args)
+static PyObject * AvlTree_height(AvlTree *self)
 {
-    Node *n;
-    PyObject *key;
+    return Py_BuildValue("I", self->root ? Node__height(self->root) : 0);
+}
 
-    if (!PyArg_ParseTuple(args, "O", &key))
-        return NULL;
+static PyObject * AvlTree_traverse(AvlTree *self, PyObject *args,
+                                   PyObject *kwargs)
+{
+    if (self->root)
+        return Node_traverse(self->root, args, kwargs);
 
-    n = Node__search(self, key);
-    if (!PyObject_Compare(n->key, key)) {
-        Py_INCREF(n);
-        return n;
-    } else {
-        PyErr_SetString(PyExc_KeyError, "key not found");
-        return NULL;
-    }
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-static PyObject * Node_insert(Node *self, PyObject *args)
+static AvlTree * AvlTree__fork(AvlTree *self, int flags)
 {
-    PyObject *key;
+    /*
+        Returns a new tree of the same kind with nothing in it yet
+    */
 
-    if (!PyArg_ParseTuple(args, "O", &key))
-        return NULL;
+    AvlTree *tree;
 
-    if (Node__insert(self, key))
+    tree = AvlTree__new(self->ob_type, self->node_type,
+                        (self->flags & ~TREE_PINNED) | flags, self->keyfunc);
+    if (!tree)
         return NULL;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    tree->size = self->size;
+    tree->dead = self->dead;
+    tree->live = self->live;
+    tree->garbage = self->garbage;
+
+    return tree;
 }
 
-static PyObject * Node_delete(Node *self, PyObject *args)
+static PyObject * AvlTree_snapshot(AvlTree *self)
 {
-    Node *node;
+    /*
+        The snapshot takes over the nodes as they are, the tree goes on
+        with a copy of the root and copies the other nodes it's sharing
+        only when they change, see AvlTree__own
+    */
 
-    node = (Node *)Node_search(self, args);
-    if (!node)
+    AvlTree *tree;
+    Node *root = self->root;
+
+    if (self->flags & TREE_PINNED) {
+        PyErr_SetString(PyExc_RuntimeError, "can't snapshot a Node API tree");
         return NULL;
+    }
 
-    Py_DECREF(node);
-    if (Node__delete(node))
+    if (!(tree = AvlTree__fork(self, TREE_FROZEN | TREE_SHARED)))
         return NULL;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_XINCREF(root);
+    AvlTree__share(self);
+    if (root) {
+        AvlTree__set_root(tree, root);
+        Py_DECREF(root);
+    }
+
+    return (PyObject *)tree;
 }
 
-static PyObject * Node_from_list(PyTypeObject *type, PyObject *args)
+static PyObject * AvlTree_copy(AvlTree *self)
 {
-    PyObject *o, *l;
-    Py_ssize_t len, i;
-    PyObject **arr;
-    Node *tree;
+    /*
+        Both trees start with a copy of the root of their own, the other
+        nodes are shared until they change. The hash index is a dict of
+        its own for each tree though
+    */
 
-    if (!PyArg_ParseTuple(args, "O", &o))
+    AvlTree *tree;
+    Node *root;
+
+    if (self->flags & TREE_PINNED) {
+        PyErr_SetString(PyExc_RuntimeError, "can't copy a Node API tree");
         return NULL;
+    }
 
-    l = PySequence_Fast(o, "sequence is required");
-    if (!l)
+    if (!(tree = AvlTree__fork(self, TREE_SHARED)))
         return NULL;
+    tree->flags &= ~TREE_FROZEN;
 
-    len = PySequence_Fast_GET_SIZE(l);
-    arr = PySequence_Fast_ITEMS(l);
+    if (self->index && !(tree->index = PyDict_Copy(self->index))) {
+        Py_DECREF(tree);
+        return NULL;
+    }
 
-    if (len < 1) {
-        Py_INCREF(Py_None);
-        return Py_None;
-    } else
-        tree = Node__new(type, arr[0], (Node *)Py_None,
-                (Node *)Py_None, (Node *)Py_None);
+    if (self->root) {
+        root = Node__fork(self->root, tree->gen);
+        AvlTree__set_root(tree, root);
+        Py_DECREF(root);
+        if (tree->index && PyDict_SetItem(tree->index, root->key,
+                                          (PyObject *)root)) {
+            Py_DECREF(tree);
+            return NULL;
+        }
+    }
 
-    for (i=1; i<len; i++)
-        Node__insert(tree, arr[i]);
+    // A snapshot has no changes to keep from its copies
+    if (!(self->flags & TREE_FROZEN))
+        AvlTree__share(self);
 
     return (PyObject *)tree;
 }
 
-static PyObject * Node_from_list_raw(PyTypeObject *type, PyObject *args)
+static PyObject * AvlTree_compact(AvlTree *self)
 {
-    PyObject *l, *parent=NULL;
-    Node *node;
-
-    if (!PyArg_ParseTuple(args, "O|O", &l, &parent))
+    if (AvlTree__compact(self))
         return NULL;
 
-    if (!parent)
-        parent = Py_None;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
-    node = Node__from_list_raw(type, l, (Node *)parent);
+static int AvlTree__save(AvlTree *self, PyObject *path, PY_LONG_LONG gen)
+{
+    /*
+        Writes the keys of the tree in order to a new snapshot file. The
+        file is written next to it and moved in place once synced, so a
+        crash leaves either the old snapshot or the new one
+    */
 
-    if (node)
-        return (PyObject *)node;
-    else {
-        Py_INCREF(Py_None);
-        return Py_None;
+    LogBuffer buf = {NULL};
+    Path walk = {NULL};
+    PyObject *tmp, *obj, *rec;
+    const char *name;
+    Node *n;
+    int fd, rc = 0;
+
+    if (!(tmp = PyString_FromFormat("%s.tmp", PyString_AS_STRING(path))))
+        return -1;
+    name = PyString_AS_STRING(tmp);
+
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+        Py_DECREF(tmp);
+        return -1;
     }
-}
 
-static PyObject * Node_to_list(Node *self)
-{
-    PyObject *left=Py_None, *right=Py_None;
+    if (Log__reserve(&buf, LOG_HEADER)) {
+        memcpy(buf.data, SNAPSHOT_MAGIC, 8);
+        Log__put(buf.data + 8, gen, 8);
+        buf.len = LOG_HEADER;
+    } else
+        rc = -1;
 
-    if (NOT_NONE(self->left))
-        left = Node_to_list(self->left);
-    else
-        Py_INCREF(left);
+    // Tombstones are left out
+    for (n = rc ? NULL : Path__first(&walk, self->root); n && !rc;
+            n = Path__next(&walk)) {
+        if (!n->count)
+            continue;
 
-    if (NOT_NONE(self->right))
-        right = Node_to_list(self->right);
+        if (n->count > 1)
+            obj = Py_BuildValue("(On)", NODE_ITEM(n), n->count);
+        else {
+            obj = NODE_ITEM(n);
+            Py_INCREF(obj);
+        }
+        rec = obj ? PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION) : NULL;
+        Py_XDECREF(obj);
+        if (!rec || Log__encode(&buf, n->count > 1 ? REC_MULTI : REC_INSERT,
+                                rec))
+            rc = -1;
+        Py_XDECREF(rec);
+
+        if (!rc && buf.len >= LOG_BUFFER) {
+            if (Log__write(fd, buf.data, buf.len)) {
+                PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+                rc = -1;
+            }
+            buf.len = 0;
+        }
+    }
+    Path__clear(&walk);
+    if (PyErr_Occurred())
+        rc = -1;
+
+    if (!rc && (Log__write(fd, buf.data, buf.len) || fsync(fd) ||
+                rename(name, PyString_AS_STRING(path)))) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+        rc = -1;
+    }
+    close(fd);
+    PyMem_Free(buf.data);
+
+    if (rc)
+        unlink(name);
     else
-        Py_INCREF(right);
+        Log__sync_dir(name);
+    Py_DECREF(tmp);
 
-    return Py_BuildValue("ONN", self->key, left, right);
+    return rc;
 }
 
-static PyObject * Node_to_dict(Node *self, PyObject *args)
+static PyObject * AvlTree_checkpoint(AvlTree *self, PyObject *args,
+                                     PyObject *kwargs)
 {
-    PyObject *vargs, *d = NULL;
-    
-    if (!PyArg_ParseTuple(args, "|O", &d))
+    /*
+        Writes a snapshot of the tree and starts the log over on top of
+        it, the logged changes are folded into the snapshot. Given the
+        file names, starts logging a tree that has no log
+    */
+
+    static char *kwlist[] = {"snapshot", "log", "sync", "batch", NULL};
+    PyObject *snapshot = NULL, *path = NULL;
+    PY_LONG_LONG gen = 0;
+    char *sync = NULL;
+    Py_ssize_t batch = 0;
+    Log *log = self->log;
+    int policy;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|SSsn", kwlist,
+                                     &snapshot, &path, &sync, &batch))
         return NULL;
-    
-    if (!d) {
-        if (!(d = PyDict_New()))
-            return NULL;
-    } else
-        Py_INCREF(d);
 
-    if (PyDict_SetItem(d, self->key, (PyObject *)self))
-        goto e2;
-    
-    vargs = Py_BuildValue("(O)", d);
-    if (NOT_NONE(self->left))
-        if (!Node_to_dict(self->left, vargs))
-            goto e1;
-    if (NOT_NONE(self->right))
-        if (!Node_to_dict(self->right, vargs))
-            goto e1;
+    if (self->flags & TREE_FROZEN) {
+        PyErr_SetString(PyExc_RuntimeError, "snapshot is read-only");
+        return NULL;
+    }
 
-    Py_DECREF(vargs);
-    return d;
-    
-    e1:
-        Py_DECREF(vargs);
-    e2:
-        Py_DECREF(d);
+    if (!log && (!snapshot || !path)) {
+        PyErr_SetString(PyExc_RuntimeError, "tree has no log");
         return NULL;
-}
+    }
 
-static PyObject * Node_rightmost(Node *self)
-{
-    PyObject * node;
+    snapshot = snapshot ? snapshot : log->snapshot;
+    path = path ? path : log->path;
+    policy = log ? log->sync : SYNC_ALWAYS;
+    if (sync && (policy = AvlTree__sync_policy(sync)) < 0)
+        return NULL;
+    batch = batch ? batch : log ? log->batch : 64;
+    if (batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch must be positive");
+        return NULL;
+    }
 
-    node = (PyObject *)Node__rightmost(self);
-    Py_INCREF(node);
+    // Generations only grow, no log left over can match the new snapshot
+    if (log)
+        gen = log->gen;
+    if (Log__generation(snapshot, SNAPSHOT_MAGIC, &gen) ||
+            Log__generation(path, LOG_MAGIC, &gen) ||
+            AvlTree__save(self, snapshot, gen + 1))
+        return NULL;
 
-    return node;
-}
+    // The records not written yet are in the snapshot
+    Py_INCREF(snapshot);
+    Py_INCREF(path);
+    if (log) {
+        self->log = NULL;
+        Log__free(log);
+    }
+    self->log = Log__new(path, snapshot, gen + 1, -1, policy, batch);
+    Py_DECREF(snapshot);
+    Py_DECREF(path);
+    if (!self->log)
+        return NULL;
 
-static PyObject * Node_height(Node *self)
-{
-    return Py_BuildValue("I", Node__height(self));
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-static PyObject * Node_calc_bf(Node *self)
+static PyObject * AvlTree_sync(AvlTree *self)
 {
-    return Py_BuildValue("i", Node__calc_bf(self));
+    if (self->log && Log__flush(self->log, 1))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-static PyObject * Node_rotate_cw(Node *self)
+static PyObject * AvlTree_close_log(AvlTree *self)
 {
-    if (Node__rotate_cw(self)) {
+    Log *log = self->log;
+    int rc;
+
+    if (!log) {
         Py_INCREF(Py_None);
         return Py_None;
-    } else
+    }
+
+    self->log = NULL;
+    rc = Log__flush(log, 1);
+    Log__free(log);
+    if (rc)
         return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-static PyObject * Node_rotate_ccw(Node *self)
+static PyObject * AvlTree_get_logged(AvlTree *self, void *closure)
 {
-    if (Node__rotate_ccw(self)) {
-        Py_INCREF(Py_None);
-        return Py_None;
-    } else
-        return NULL;
+    return PyInt_FromSsize_t(self->log ? self->log->seq : 0);
 }
 
-static PyObject * Node_traverse(Node *self, PyObject *args, PyObject *kwargs)
+static PyObject * AvlTree_publish(AvlTree *self, PyObject *args)
 {
-    PyObject *f, *nargs, *it, *rc;
-
-    f = PyTuple_GetItem(args, 0);
-    if (!f) {
-        PyErr_SetString(PyExc_TypeError, "function takes at least 1 argument");
-        return NULL;
-    }
+    const char *path = NULL;
 
-    if (!PyCallable_Check(f)) {
-        PyErr_SetString(PyExc_TypeError, "first parameter must be a callable object");
+    if (!PyArg_ParseTuple(args, "|z", &path))
         return NULL;
-    }
 
-    it = PyObject_GetIter(args);
-    nargs = PySequence_Tuple(it);
-    Py_DECREF(it);
-
-    Py_INCREF(self);
-    if (PyTuple_SetItem(nargs, 0, (PyObject *)self))
-        goto err;
+    return SharedTree__publish(self, path);
+}
 
-    if (!(rc = PyObject_Call(f, nargs, kwargs)))
-        goto err;
+static PyObject * AvlTree_root_hash(AvlTree *self)
+{
+    unsigned PY_LONG_LONG h = 0;
 
-    Py_DECREF(rc);
-    Py_DECREF(nargs);
+    if (self->root && Node__hash(self->root, &h))
+        return NULL;
 
-    if (NOT_NONE(self->left)) {
-        rc = Node_traverse(self->left, args, kwargs);
-        if (rc)
-            Py_DECREF(rc);
-        else
-            return NULL;
-    }
-    if (NOT_NONE(self->right)) {
-        rc = Node_traverse(self->right, args, kwargs);
-        if (rc)
-            Py_DECREF(rc);
-        else
-            return NULL;
-    }
+    return PyLong_FromUnsignedLongLong(h);
+}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static PyObject * AvlTree_range_hash(AvlTree *self, PyObject *args,
+                                     PyObject *kwargs)
+{
+    static char *kwlist[] = {"lo", "hi", NULL};
+    PyObject *lo = Py_None, *hi = Py_None;
+    unsigned PY_LONG_LONG h = 0;
 
-    err:
-        Py_DECREF(nargs);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &lo, &hi))
+        return NULL;
+
+    if (self->root && Node__range_hash(self->root, IS_NONE(lo) ? NULL : lo,
+                                       IS_NONE(hi) ? NULL : hi, 0, &h))
         return NULL;
+
+    return PyLong_FromUnsignedLongLong(h);
 }
 
-static PyMemberDef Node_members[] = {
-    {"left", T_OBJECT_EX, offsetof(Node, left), 0, "left child"},
-    {"right", T_OBJECT_EX, offsetof(Node, right), 0, "right child"},
-    {"key", T_OBJECT_EX, offsetof(Node, key), 0, "node key"},
-    {"parent", T_OBJECT_EX, offsetof(Node, parent), 0, "node parent"},
-    {"bf", T_INT, offsetof(Node, bf), 0, "balance factor"},
-    {NULL}  /* Sentinel */
-};
+static PyObject * AvlTree_diff(AvlTree *self, PyObject *args)
+{
+    /*
+        Keys with entries not the same in both trees, in order. Visits
+        O(d log n) nodes for d differences, each taking an O(log n)
+        range hash of the other tree
+    */
 
-static PyObject * Node_Repr(PyObject *o)
+    AvlTree *other;
+    PyObject *keys;
+
+    if (!PyArg_ParseTuple(args, "O!", &AvlTreeType, &other))
+        return NULL;
+
+    if (!(keys = PyList_New(0)))
+        return NULL;
+
+    if (Node__diff(self->root ? self->root : (Node *)Py_None,
+                   other->root ? other->root : (Node *)Py_None,
+                   NULL, NULL, keys)) {
+        Py_DECREF(keys);
+        return NULL;
+    }
+
+    return keys;
+}
+
+static PyObject * AvlTree_cursor(AvlTree *self)
 {
-    PyObject *s;
-    Node *self = (Node *)o;
-    PyObject *r_key = PyObject_Repr(self->key);
-    PyObject *r_left = PyObject_Repr((PyObject *)self->left);
-    PyObject *r_right = PyObject_Repr((PyObject *)self->right);
+    return PyObject_CallFunctionObjArgs((PyObject *)&CursorType, self, NULL);
+}
 
-    s = PyString_FromFormat("%s(%s,%s)",
-            PyString_AS_STRING(r_key),
-            PyString_AS_STRING(r_left),
-            PyString_AS_STRING(r_right));
+static PyObject * AvlTree_get_root(AvlTree *self, void *closure)
+{
+    PyObject *root = self->root ? (PyObject *)self->root : Py_None;
 
-    Py_DECREF(r_key);
-    Py_DECREF(r_left);
-    Py_DECREF(r_right);
+    Py_INCREF(root);
+    return root;
+}
 
-    return s;
+static Py_ssize_t AvlTree_Length(AvlTree *self)
+{
+    return self->size;
 }
 
-static int Node_Contains(Node *self, PyObject *key)
+static int AvlTree_Contains(AvlTree *self, PyObject *item)
 {
+    PyObject *key;
     Node *s;
-    
-    s = Node__search(self, key);    
-    return !PyObject_Compare(key, s->key);
+    int rc, c;
+
+    if (!self->root)
+        return 0;
+
+    if (!(key = AvlTree__key(self, item)))
+        return -1;
+
+    if (self->index)
+        rc = AvlTree__lookup(self, key) != NULL;
+    else {
+        s = Node__locate(self->root, key, &c);
+        rc = s->count && !c;
+    }
+    Py_DECREF(key);
+
+    return PyErr_Occurred() ? -1 : rc;
 }
 
-static void Node_dealloc(Node *self)
+static int AvlTree_gc_traverse(AvlTree *self, visitproc visit, void *arg)
 {
-    Py_XDECREF(self->left);
-    Py_XDECREF(self->right);
-    Py_XDECREF(self->parent);
-    Py_XDECREF(self->key);
+    Py_VISIT(self->root);
+    Py_VISIT(self->node_type);
+    Py_VISIT(self->finger);
+    Py_VISIT(self->keyfunc);
+    Py_VISIT(self->sweep);
+    Py_VISIT(self->index);
+    return 0;
+}
+
+static int AvlTree_gc_clear(AvlTree *self)
+{
+    /*
+        The root refers back to the tree, clearing the tree side of the
+        cycle is enough, the log gets flushed once the tree is freed
+    */
+
+    Py_CLEAR(self->root);
+    Py_CLEAR(self->finger);
+    Py_CLEAR(self->keyfunc);
+    Py_CLEAR(self->sweep);
+    Py_CLEAR(self->index);
+    self->size = self->dead = self->live = 0;
+    return 0;
+}
+
+static void AvlTree_dealloc(AvlTree *self)
+{
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->root);
+    Py_XDECREF(self->node_type);
+    Py_XDECREF(self->finger);
+    Py_XDECREF(self->keyfunc);
+    Py_XDECREF(self->sweep);
+    Py_XDECREF(self->index);
+    if (self->log) {
+        // Nothing logged is lost, short of syncing a SYNC_NONE log
+        if (Log__flush(self->log, self->log->sync != SYNC_NONE))
+            PyErr_WriteUnraisable(self->log->path);
+        Log__free(self->log);
+    }
     self->ob_type->tp_free((PyObject *)self);
 }
 
-static PyMethodDef Node_methods[] = {
-    {"search", (PyCFunction)Node_search, METH_VARARGS,
-     "Returns the corresponding node if found, the last checked otherwise"
+static PyMethodDef AvlTree_methods[] = {
+    {"search", (PyCFunction)AvlTree_search, METH_VARARGS,
+     "Returns the node holding the key"
     },
-    {"insert", (PyCFunction)Node_insert, METH_VARARGS,
-     "Inserts a new key into a tree"
+    {"insert", (PyCFunction)AvlTree_insert, METH_VARARGS,
+     "Inserts a new key into the tree"
     },
-    {"delete", (PyCFunction)Node_delete, METH_VARARGS,
-     "Deletes a key from a tree"
+    {"delete", (PyCFunction)AvlTree_delete, METH_VARARGS,
+     "Deletes a key from the tree"
+    },
+    {"count", (PyCFunction)AvlTree_count, METH_VARARGS,
+     "Returns the number of occurrences of a key"
     },
-    {"from_list", (PyCFunction)Node_from_list, METH_VARARGS | METH_CLASS,
+    {"rank", (PyCFunction)AvlTree_rank, METH_VARARGS,
+     "Returns the number of keys less than a key, duplicates included"
+    },
+    {"from_list", (PyCFunction)AvlTree_from_list,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
      "Builds a tree from a sequence"
     },
-    {"from_list_raw", (PyCFunction)Node_from_list_raw, METH_VARARGS | METH_CLASS,
+    {"from_list_raw", (PyCFunction)AvlTree_from_list_raw,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
      "Builds a tree from a tuple tree"
     },
-    {"to_list", (PyCFunction)Node_to_list, METH_NOARGS,
-     "Builds a tuple tree"
+    {"from_sorted", (PyCFunction)AvlTree_from_sorted,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Builds a tree from items sorted by key in linear time"
     },
-    {"to_dict", (PyCFunction)Node_to_dict, METH_VARARGS,
-     "Returns a dict of all tree elements"
+    {"union", (PyCFunction)AvlTree_union,
+     METH_VARARGS | METH_KEYWORDS,
+     "Returns a new tree with the keys of both trees"
     },
-    {"rightmost", (PyCFunction)Node_rightmost, METH_NOARGS,
-     "Returns the rightmost node"
+    {"intersection", (PyCFunction)AvlTree_intersection,
+     METH_VARARGS | METH_KEYWORDS,
+     "Returns a new tree with the keys common to both trees"
     },
-    {"height", (PyCFunction)Node_height, METH_NOARGS,
-     "Returns tree height"
+    {"difference", (PyCFunction)AvlTree_difference,
+     METH_VARARGS | METH_KEYWORDS,
+     "Returns a new tree with the keys not in the other tree"
     },
-    {"calc_bf", (PyCFunction)Node_calc_bf, METH_NOARGS,
-     "Calculates tree balance factor"
+    {"to_list", (PyCFunction)AvlTree_to_list, METH_NOARGS,
+     "Builds a tuple tree, None if the tree is empty"
     },
-    {"rotate_cw", (PyCFunction)Node_rotate_cw, METH_NOARGS,
-     "Rotates a node clock-wise"
+    {"to_dict", (PyCFunction)AvlTree_to_dict, METH_VARARGS,
+     "Returns a dict of all tree elements"
     },
-    {"rotate_ccw", (PyCFunction)Node_rotate_ccw, METH_NOARGS,
-     "Rotates a node counter clock-wise"
+    {"height", (PyCFunction)AvlTree_height, METH_NOARGS,
+     "Returns tree height"
     },
-    {"traverse", (PyCFunction)Node_traverse, METH_KEYWORDS,
+    {"traverse", (PyCFunction)AvlTree_traverse, METH_KEYWORDS,
      "Traverses a tree"
     },
+    {"cursor", (PyCFunction)AvlTree_cursor, METH_NOARGS,
+     "Returns a cursor positioned at the leftmost node"
+    },
+    {"compact", (PyCFunction)AvlTree_compact, METH_NOARGS,
+     "Rebuilds the tree in linear time dropping the tombstones"
+    },
+    {"snapshot", (PyCFunction)AvlTree_snapshot, METH_NOARGS,
+     "Returns a read-only copy of the tree as it is now in constant time. "
+     "The nodes are shared, changes copy the nodes they go through. "
+     "Shared nodes may have no parent or one in another tree"
+    },
+    {"copy", (PyCFunction)AvlTree_copy, METH_NOARGS,
+     "Returns a copy of the tree sharing its nodes until they change, "
+     "in constant time unless the tree has an index to copy"
+    },
+    {"root_hash", (PyCFunction)AvlTree_root_hash, METH_NOARGS,
+     "Returns the hash of the tree entries, the same for trees with the "
+     "same items whatever their shapes"
+    },
+    {"range_hash", (PyCFunction)AvlTree_range_hash,
+     METH_VARARGS | METH_KEYWORDS,
+     "Returns the hash of the entries with keys between lo and hi, inclusive"
+    },
+    {"diff", (PyCFunction)AvlTree_diff, METH_VARARGS,
+     "Returns the keys with entries not the same in the other tree"
+    },
+    {"publish", (PyCFunction)AvlTree_publish, METH_VARARGS,
+     "Returns a read-only SharedTree copy of the tree in shared memory, "
+     "written to the file if a path is given"
+    },
+    {"open", (PyCFunction)AvlTree_open,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Loads a tree from its snapshot and log files, replaying the log, "
+     "and goes on logging the changes. sync is 'always' (the default), "
+     "'batch' or 'none', batch is the number of changes synced at once. "
+     "Other than with 'always', changes may be held in memory until sync() "
+     "or close_log() is called"
+    },
+    {"checkpoint", (PyCFunction)AvlTree_checkpoint,
+     METH_VARARGS | METH_KEYWORDS,
+     "Writes a snapshot of the tree and starts the log over"
+    },
+    {"sync", (PyCFunction)AvlTree_sync, METH_NOARGS,
+     "Writes out and syncs the logged changes"
+    },
+    {"close_log", (PyCFunction)AvlTree_close_log, METH_NOARGS,
+     "Syncs and closes the log, changes are not logged anymore"
+    },
     {NULL}  /* Sentinel */
 };
 
-static PySequenceMethods Node_as_sequence = {
-    0,                          /* sq_length */
+static PyGetSetDef AvlTree_getset[] = {
+    {"root", (getter)AvlTree_get_root, NULL, "root node, None if empty"},
+    {"logged", (getter)AvlTree_get_logged, NULL,
+     "number of changes logged since the last snapshot"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef AvlTree_members[] = {
+    {"tombstones", T_PYSSIZET, offsetof(AvlTree, dead), READONLY,
+     "number of nodes left by lazy deletes"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods AvlTree_as_sequence = {
+    (lenfunc)AvlTree_Length,    /* sq_length */
     0,                          /* sq_concat */
     0,                          /* sq_repeat */
     0,                          /* sq_item */
     0,                          /* sq_slice */
     0,                          /* sq_ass_item */
     0,                          /* sq_ass_slice */
-    (objobjproc)Node_Contains,  /* sq_contains */
+    (objobjproc)AvlTree_Contains, /* sq_contains */
     0,                          /* sq_inplace_concat */
     0,                          /* sq_inplace_repeat */
 };
 
-static PyTypeObject NodeType = {
+static PyTypeObject AvlTreeType = {
     PyObject_HEAD_INIT(NULL)
     0,                         /*ob_size*/
-    "avl.Node",                 /*tp_name*/
-    sizeof(Node),               /*tp_basicsize*/
+    "avl.AvlTree",             /*tp_name*/
+    sizeof(AvlTree),           /*tp_basicsize*/
     0,                         /*tp_itemsize*/
-    (destructor)Node_dealloc,   /*tp_dealloc*/
+    (destructor)AvlTree_dealloc, /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
     0,                         /*tp_setattr*/
     0,                         /*tp_compare*/
-    Node_Repr,                  /*tp_repr*/
+    0,                         /*tp_repr*/
     0,                         /*tp_as_number*/
-    &Node_as_sequence,         /*tp_as_sequence*/
+    &AvlTree_as_sequence,      /*tp_as_sequence*/
     0,                         /*tp_as_mapping*/
     0,                         /*tp_hash */
     0,                         /*tp_call*/
@@ -911,132 +8279,33 @@ static PyTypeObject NodeType = {
     0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
-        Py_TPFLAGS_HAVE_SEQUENCE_IN, /*tp_flags*/
-    "Node object",              /* tp_doc */
-    0,	    	               /* tp_traverse */
-    0,	                       /* tp_clear */
-    0,	                       /* tp_richcompare */
-    0,	                       /* tp_weaklistoffset */
-    0,	                       /* tp_iter */
-    0,	                       /* tp_iternext */
-    Node_methods,              /* tp_methods */
-    Node_members,              /* tp_members */
-    0,                         /* tp_getset */
+        Py_TPFLAGS_HAVE_SEQUENCE_IN | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    "AVL tree container, owns the root node and keeps the tree size",
+                               /* tp_doc */
+    (traverseproc)AvlTree_gc_traverse, /* tp_traverse */
+    (inquiry)AvlTree_gc_clear, /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    (getiterfunc)AvlTree_iter, /* tp_iter */
+    0,                         /* tp_iternext */
+    AvlTree_methods,           /* tp_methods */
+    AvlTree_members,           /* tp_members */
+    AvlTree_getset,            /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
     0,                         /* tp_descr_get */
     0,                         /* tp_descr_set */
     0,                         /* tp_dictoffset */
-    (initproc)Node_init,        /* tp_init */
+    (initproc)AvlTree_init,    /* tp_init */
     0,                         /* tp_alloc */
     0,                         /* tp_new */
-    
-    0,                         /*tp_free Low-level free-memory routine */
-    0,                         /* tp_is_gc For PyObject_IS_GC */
-    0,                         /* tp_bases */
-    0,                         /* tp_mro */
-    0,                         /* tp_cache */
-    0,                         /* tp_subclasses */
-    0,                         /* tp_weaklist */
-    0,                         /* tp_del */
-    
-};
-
-typedef struct Avl {
-    Node node;
-} Avl;
-
-static PyMethodDef Avl_methods[] = {
-    {NULL}  /* Sentinel */
-};
-
-static void Avl__rebalance(Node *self)
-{
-    Node *new_pivot;
-    
-    if (self->bf == 2)
-        if (self->left->bf >= 0) {
-            // Left-left case
-            //printf("left-left\n");
-            Node__rotate_cw(self->left);
-        } else {
-            // Left-right case
-            //printf("left-right\n");
-            new_pivot = Node__rotate_ccw(self->left->right);
-            Node__rotate_cw(new_pivot);
-        }
-    else if (self->bf == -2) 
-        if (self->right->bf <= 0) {
-            // Right-right case
-            //printf("right-right\n");
-            Node__rotate_ccw(self->right);
-        } else {
-            // Right-left case
-            //printf("right-left\n");
-            new_pivot = Node__rotate_cw(self->right->left);
-            Node__rotate_ccw(new_pivot);
-        }
-    else
-        PyErr_SetString(PyExc_RuntimeError, "Unable to balance node");
-}
-
-static PyObject * Avl_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    Node *self;
-    
-    self = (Node *)type->tp_alloc(type, 0);
-    if (self)
-        self->rebalance = Avl__rebalance;
-        
-    return (PyObject *)self;
-}
-
-
-static PyTypeObject AvlType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                         /*ob_size*/
-    "avl.Avl",                 /*tp_name*/
-    sizeof(Avl),               /*tp_basicsize*/
-    0,                         /*tp_itemsize*/
-    0,                         /*tp_dealloc*/
-    0,                         /*tp_print*/
-    0,                         /*tp_getattr*/
-    0,                         /*tp_setattr*/
-    0,                         /*tp_compare*/
-    0,                         /*tp_repr*/
-    0,                         /*tp_as_number*/
-    0,                         /*tp_as_sequence*/
-    0,                         /*tp_as_mapping*/
-    0,                         /*tp_hash */
-    0,                         /*tp_call*/
-    0,                         /*tp_str*/
-    0,                         /*tp_getattro*/
-    0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT |
-        Py_TPFLAGS_BASETYPE,    /*tp_flags*/
-    "Avl object",              /* tp_doc */
-    0,	    	               /* tp_traverse */
-    0,	                       /* tp_clear */
-    0,	                       /* tp_richcompare */
-    0,	                       /* tp_weaklistoffset */
-    0,	                       /* tp_iter */
-    0,	                       /* tp_iternext */
-    Avl_methods,               /* tp_methods */
-    0,                         /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    0,                         /* tp_init */
-    0,                         /* tp_alloc */
-    Avl_new,                   /* tp_new */
 };
 
-
 static PyMethodDef avl_methods[] = {
+    {"merge", (PyCFunction)avl_merge, METH_VARARGS | METH_KEYWORDS,
+     "Returns an iterator over the items of all the trees in key order. "
+     "unique drops repeated keys, lo and hi bound the keys, inclusive"
+    },
     {NULL}  /* Sentinel */
 };
 
@@ -1049,10 +8318,38 @@ initavl(void)
     if (PyType_Ready(&NodeType) < 0)
         return;
 
+    CursorType.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&CursorType) < 0)
+        return;
+
+    if (PyType_Ready(&MergeType) < 0)
+        return;
+
+    SharedTreeType.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&SharedTreeType) < 0)
+        return;
+
+    if (PyType_Ready(&SharedIterType) < 0)
+        return;
+
+    if (PyType_Ready(&PagedTreeType) < 0)
+        return;
+
+    if (PyType_Ready(&PagedIterType) < 0)
+        return;
+
     AvlType.tp_base = &NodeType;
     if (PyType_Ready(&AvlType) < 0)
         return;
 
+    AvlTreeType.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&AvlTreeType) < 0)
+        return;
+    // Trees are built of Avl nodes unless a subclass says otherwise
+    if (PyDict_SetItemString(AvlTreeType.tp_dict, "_node_class",
+                             (PyObject *)&AvlType) < 0)
+        return;
+
     m = Py_InitModule3("avl", avl_methods,
                        "Avl module.");
 
@@ -1061,4 +8358,23 @@ initavl(void)
 
     Py_INCREF(&AvlType);
     PyModule_AddObject(m, "Avl", (PyObject *)&AvlType);
+
+    Py_INCREF(&CursorType);
+    PyModule_AddObject(m, "Cursor", (PyObject *)&CursorType);
+
+    Py_INCREF(&AvlTreeType);
+    PyModule_AddObject(m, "AvlTree", (PyObject *)&AvlTreeType);
+
+    Py_INCREF(&SharedTreeType);
+    PyModule_AddObject(m, "SharedTree", (PyObject *)&SharedTreeType);
+
+    Py_INCREF(&PagedTreeType);
+    PyModule_AddObject(m, "PagedTree", (PyObject *)&PagedTreeType);
+
+    // Raised by validating imports, a ValueError
+    BalanceError = PyErr_NewException("avl.BalanceError", PyExc_ValueError, NULL);
+    if (!BalanceError)
+        return;
+    Py_INCREF(BalanceError);
+    PyModule_AddObject(m, "BalanceError", BalanceError);
 }
@@ -25,6 +25,8 @@ def sign(num):
         return num / abs(num)
         
 class Node(object):
+    balanced = False
+
     def __init__(self, key, left=None, right=None, parent=None):
         self.left = left
         self.right = right
@@ -89,31 +91,39 @@ class Node(object):
                 print "!!! left.key >= self.key !!! ",
         print
     
-    def _search(self, key):
+    def _locate(self, key):
         """
-            Returns the corresponding node if found, the last checked otherwise
+            Returns the corresponding node if found, the last checked
+            otherwise, along with the side the key goes to: 0 if found,
+            1 if on the left, -1 if on the right. One comparison per level
         """
         n = self
         while n is not None:
             last = n
-            if n.key > key:
+            c = cmp(n.key, key)
+            if c > 0:
                 n = n.left
-            elif n.key < key:
+            elif c < 0:
                 n = n.right
             else:
-                return n
-        return last
+                return n, 0
+        return last, 1 if c > 0 else -1
+
+    def _search(self, key):
+        """
+            Returns the corresponding node if found, the last checked otherwise
+        """
+        return self._locate(key)[0]
     
     def search(self, key):
-        n = self._search(key)
-        if n.key == key:
-            return n
-        else:
+        n, bf = self._locate(key)
+        if bf:
             raise KeyNotFound(n)
+        return n
     
     def get_child_place(self, child):
         """ Returns 1 if child is on the left subtree, -1 if on the right """
-        if child.key < self.key:
+        if self.left is child:
             return 1
         else:
             return -1
@@ -165,12 +175,12 @@ class Node(object):
             
 
     def insert(self, key):
-        p = self._search(key)
-        if p.key == key:
+        p, bf = self._locate(key)
+        if not bf:
             raise KeyPresent(p)
         else:
             node = self.__class__(key)
-            p.update_bf_on_insert(node.connect_to_parent(p))
+            p.update_bf_on_insert(node.connect_to_parent(p, bf))
 
     def disconnect(self, node):
         if self.left is node:
@@ -179,21 +189,26 @@ class Node(object):
             self.right = None
     
     def delete(self, key):
-        node = self.search(key)
+        self.search(key)._unlink()
+
+    def _unlink(self):
+        """ Takes the node out of the tree, comparing no keys """
+        node = self
         p = node.parent
 
         if node.left and node.right:
-            nkey = node.left.rightmost().key
-            node.left.delete(nkey)
-            node.key = nkey
+            pred = node.left.rightmost()
+            pred._unlink()
+            node.key = pred.key
         else:
+            bf = 0
             if p:
                 bf = p.get_child_place(node)
 
             if node.left:
-                node.left.connect_to_parent(p)
+                node.left.connect_to_parent(p, bf)
             elif node.right:
-                node.right.connect_to_parent(p)
+                node.right.connect_to_parent(p, bf)
             else:
                 # No children
                 p.disconnect(node)
@@ -244,21 +259,69 @@ class Node(object):
             return None
     
     @classmethod
-    def from_list_raw(cls, l, parent=None):           
+    def from_list_raw(cls, l, parent=None, validate=False):
+        """
+            Builds a tree from a [key, left, right] list tree, or from an
+            iterable of (key, has_left, has_right) entries listing the nodes
+            in pre-order. Heights are computed bottom-up in one pass, with
+            validate set key order and AVL balance are checked on the way
+        """
+        if isinstance(l, (list, tuple)):
+            stream = None
+        else:
+            stream = iter(l)
+            try:
+                l = next(stream)
+            except StopIteration:
+                raise ValueError("tree stream is empty")
+
+        node, height = cls._from_list_raw(l, parent, stream, validate, [])
+
+        if stream is not None:
+            for entry in stream:
+                raise ValueError("tree stream has extra entries")
+
+        return node
+
+    @classmethod
+    def _from_list_raw(cls, l, parent, stream, validate, last):
+        """ Returns the subtree root and height, last holds the last key """
         key = l[0]
-        left = None
-        right = None
+        h_left = 0
+        h_right = 0
         node = cls(key, parent=parent)
-        if l[1]:
-            left = cls.from_list_raw(l[1], parent=node)
-        if l[2]:
-            right = cls.from_list_raw(l[2], parent=node)
 
-        node.left = left
-        node.right = right
+        left = cls._raw_child(l[1], stream)
+        if left:
+            node.left, h_left = cls._from_list_raw(left, node, stream,
+                                                   validate, last)
+        if validate:
+            if last and last[0] >= key:
+                raise ValueError("keys out of order")
+            last[:] = [key]
 
-        node.bf = node.calc_bf()
-        return node
+        right = cls._raw_child(l[2], stream)
+        if right:
+            node.right, h_right = cls._from_list_raw(right, node, stream,
+                                                     validate, last)
+
+        node.bf = h_left - h_right
+        if validate and cls.balanced and abs(node.bf) > 1:
+            raise BalanceError("node %r is unbalanced" % (key,))
+
+        return node, 1 + max(h_left, h_right)
+
+    @staticmethod
+    def _raw_child(desc, stream):
+        """ Returns the child entry described in its parent entry """
+        if stream is None:
+            return desc
+        if not desc:
+            return None
+        try:
+            return next(stream)
+        except StopIteration:
+            raise ValueError("tree stream ended early")
 
     def __eq__(self, t2):
         return self.to_list() == t2.to_list()
@@ -275,16 +338,16 @@ class Node(object):
         else:
             return self
 
-    def connect(self, node):
-        bf = self.get_child_place(node)
+    def connect(self, node, bf):
+        """ Hangs the node on the left if bf is 1, on the right if -1 """
         if bf == 1:
             self.left = node
         else:
             self.right = node
         return bf
     
-    def connect_to_parent(self, parent):
-        bf = parent.connect(self)
+    def connect_to_parent(self, parent, bf):
+        bf = parent.connect(self, bf)
         self.parent = parent
         
         return bf
@@ -314,16 +377,16 @@ class Node(object):
         # Save old subtree bf
         old_bf = right.bf
         
-        # Connect PIVOT to PARENT
-        pivot.connect_to_parent(parent)
+        # Connect PIVOT to PARENT, in RIGHT's place
+        pivot.connect_to_parent(parent, parent.get_child_place(right))
         if pivot.right:
             # Connect B to RIGHT
-            pivot.right.connect_to_parent(right)
+            pivot.right.connect_to_parent(right, 1)
         else:
             right.left = None
             
         # Connect RIGHT to PIVOT
-        right.connect_to_parent(pivot)
+        right.connect_to_parent(pivot, -1)
         
         # Update bf's
         # RIGHT's left subtree is 1 node shorter now (minus PIVOT)
@@ -345,10 +408,10 @@ class Node(object):
             # When rotating, every height change in one node is accounted
             # for double change in bf, e.g. when rotating tree with bf = 2 CW,
             # the new bf will be 0, height will decrease by 1 
-            if delta > 0:
+            if delta > 1:
                 # Subtree height increased
                 parent.update_bf_on_insert(delta/2 * parent.get_child_place(pivot))
-            elif delta < 0:
+            elif delta < -1:
                 # Subtree height decreased
                 parent.update_bf_on_delete(delta/2 * parent.get_child_place(pivot))
                 
@@ -376,15 +439,15 @@ class Node(object):
             raise RotateError("Unable to rotate root")
             
         old_bf = left.bf
-        # Connect PIVOT to PARENT
-        pivot.connect_to_parent(parent)
+        # Connect PIVOT to PARENT, in LEFT's place
+        pivot.connect_to_parent(parent, parent.get_child_place(left))
         if pivot.left:
             # Connect B to LEFT
-            pivot.left.connect_to_parent(left)
+            pivot.left.connect_to_parent(left, -1)
         else:
             left.right = None
         # Connect LEFT to PIVOT
-        left.connect_to_parent(pivot)
+        left.connect_to_parent(pivot, 1)
         
         # Update bf's
         # LEFT's right subtree is 1 node shorter now (minus PIVOT)
@@ -414,6 +477,8 @@ class Node(object):
                 parent.update_bf_on_delete(delta/2 * parent.get_child_place(pivot))
         
 class AVL(Node):
+    balanced = True
+
     def rebalance(self):
         if self.bf == 2:
             if self.left.bf >= 0:
@@ -443,7 +508,16 @@ class Tree(object):
         Tree wrapper object
     """
     _node_class = Node
-    
+    # Counterpart kept by the avl extension, used instead when it's built
+    _accelerated = None
+
+    def __new__(cls, *args, **kwargs):
+        # Subclasses are left alone, they might have nodes of their own
+        accelerated = cls.__dict__.get("_accelerated")
+        if accelerated is not None and _backend == "c":
+            cls = accelerated
+        return object.__new__(cls)
+
     def __init__(self, root=None):
         self.root = root
         if root:
@@ -461,9 +535,12 @@ class Tree(object):
         else:
             return 0
             
-    def connect(self, node):
+    def connect(self, node, bf=0):
         self.root = node
         return 0
+
+    def get_child_place(self, child):
+        return 0
     
     def disconnect(self, node):
         self.root = None
@@ -520,10 +597,181 @@ class Tree(object):
         return t
         
     @classmethod
-    def from_list_raw(cls, l):
-        t = cls._node_class.from_list_raw(l, cls())
+    def from_list_raw(cls, l, validate=False):
+        accelerated = cls.__dict__.get("_accelerated")
+        if accelerated is not None and _backend == "c":
+            return accelerated.from_list_raw(l, validate)
+        t = cls._node_class.from_list_raw(l, cls(), validate)
         t.parent.root = t
         return t.parent
 
 class BalancedTree(Tree):
     _node_class = AVL
+
+try:
+    import avl
+except ImportError:
+    avl = None
+
+backends = ("python", "c") if avl else ("python",)
+_backend = backends[-1]
+
+def set_backend(name):
+    """
+        Picks the implementation of the trees made from now on, "c" if
+        the avl extension is built, or "python"
+    """
+    global _backend
+    if name not in backends:
+        raise ValueError("backend %r is not available" % (name,))
+    _backend = name
+
+def _to_tuples(l):
+    """ Turns a list tree into a tuple tree for the avl extension """
+    if not l:
+        return None
+    return (l[0], _to_tuples(l[1]), _to_tuples(l[2]))
+
+def _to_lists(l):
+    """ Turns a tuple tree of the avl extension into a list tree """
+    if l is None:
+        return None
+    return [l[0], _to_lists(l[1]), _to_lists(l[2])]
+
+if avl:
+    class _CNodeMixin(object):
+        """
+            Node of the avl extension raising the same errors as Node
+        """
+        __slots__ = ()
+
+        def _search(self, key):
+            """
+                Returns the corresponding node if found, the last checked otherwise
+            """
+            n = self
+            while n is not None:
+                last = n
+                if n.key > key:
+                    n = n.left
+                elif n.key < key:
+                    n = n.right
+                else:
+                    return n
+            return last
+
+        def search(self, key):
+            try:
+                return super(_CNodeMixin, self).search(key)
+            except KeyError:
+                raise KeyNotFound(self._search(key))
+
+        def insert(self, key):
+            try:
+                super(_CNodeMixin, self).insert(key)
+            except KeyError:
+                raise KeyPresent(self.search(key))
+
+        def delete(self, key):
+            try:
+                super(_CNodeMixin, self).delete(key)
+            except KeyError:
+                raise KeyNotFound(self._search(key))
+
+        def rotate_cw(self):
+            try:
+                super(_CNodeMixin, self).rotate_cw()
+            except RuntimeError as e:
+                raise RotateError(*e.args)
+
+        def rotate_ccw(self):
+            try:
+                super(_CNodeMixin, self).rotate_ccw()
+            except RuntimeError as e:
+                raise RotateError(*e.args)
+
+        def to_list(self):
+            return _to_lists(super(_CNodeMixin, self).to_list())
+
+        def __eq__(self, t2):
+            return self.to_list() == t2.to_list()
+
+        def __repr__(self):
+            return "%d(%s,%s)" % (self.key, repr(self.left), repr(self.right))
+
+    class _CNode(_CNodeMixin, avl.Node):
+        __slots__ = ()
+
+    class _CAVL(_CNodeMixin, avl.Avl):
+        __slots__ = ()
+
+    class _CTree(Tree):
+        """
+            Tree kept by the avl extension, behaves the same as Tree.
+            The root node's parent is None rather than the tree
+        """
+        _c_tree = type("_CNodeTree", (avl.AvlTree,), {"_node_class": _CNode})
+
+        def __init__(self, root=None):
+            if root:
+                # The nodes are copied, the tree can't take foreign ones
+                self._tree = self._c_tree.from_list_raw(_to_tuples(root.to_list()))
+            else:
+                self._tree = self._c_tree()
+
+        @property
+        def root(self):
+            return self._tree.root
+
+        def __contains__(self, key):
+            return key in self._tree
+
+        def __len__(self):
+            return len(self._tree)
+
+        def height(self):
+            return self._tree.height()
+
+        def insert(self, key):
+            try:
+                self._tree.insert(key)
+            except KeyError:
+                raise KeyPresent(self._tree.search(key))
+
+        def delete(self, key):
+            try:
+                self._tree.delete(key)
+            except KeyError:
+                raise KeyNotFound(self.root and self.root._search(key))
+
+        def search(self, key):
+            try:
+                return self._tree.search(key)
+            except KeyError:
+                raise KeyNotFound(self.root and self.root._search(key))
+
+        def traverse(self, f):
+            self._tree.traverse(f)
+
+        def to_list(self):
+            return _to_lists(self._tree.to_list()) or []
+
+        def to_dict(self):
+            return self._tree.to_dict()
+
+        @classmethod
+        def from_list_raw(cls, l, validate=False):
+            if isinstance(l, (list, tuple)):
+                l = _to_tuples(l)
+            t = cls()
+            try:
+                t._tree = cls._c_tree.from_list_raw(l, validate=validate)
+            except avl.BalanceError as e:
+                raise BalanceError(*e.args)
+            return t
+
+    class _CBalancedTree(_CTree, BalancedTree):
+        _c_tree = type("_CAVLTree", (avl.AvlTree,), {"_node_class": _CAVL})
+
+    Tree._accelerated = _CTree
+    BalancedTree._accelerated = _CBalancedTree
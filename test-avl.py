@@ -1,10 +1,27 @@
 #!/usr/bin/env python2.7
 
 import unittest
+import gc
 import random
 import sys
+import os
+import shutil
+import subprocess
+import struct
+import tempfile
 
-from avl import Node, Avl
+from avl import Node, Avl, Cursor, AvlTree, SharedTree, PagedTree, merge
+
+class CKey(object):
+    """ Key counting the comparisons made """
+    compared = 0
+
+    def __init__(self, v):
+        self.v = v
+
+    def __cmp__(self, other):
+        CKey.compared += 1
+        return cmp(self.v, other.v)
 
 class TestCase(unittest.TestCase):
     LIST = (6, (4, (1, (0, None, None), (3, None, None)), None), (7, None, (9, None, (12, None, None))))
@@ -209,5 +226,1019 @@ class TestCase(unittest.TestCase):
         t.insert(60)
         t.traverse(self.check)
 
+    def test_13_finger_insert(self):
+        keys = [CKey(i) for i in xrange(4096)]
+        tree = Avl(keys[0])
+        for k in keys[1:]:
+            tree.insert(k)
+        tree.traverse(self.check)
+
+        # Root descents would take 12+ comparisons per seek
+        c = tree.cursor()
+        CKey.compared = 0
+        for k in keys[::3]:
+            self.assertTrue(c.seek(k))
+        self.assertLess(CKey.compared, len(keys[::3]) * 4)
+
+        tree = Avl.from_list(range(100))
+        for i in xrange(100, 200):
+            tree.insert(i)
+        for i in xrange(50, 150):
+            tree.delete(i)
+        tree.traverse(self.check)
+        self.assertItemsEqual(tree.to_dict().keys(), range(50) + range(150, 200))
+
+    def test_14_cursor(self):
+        tree = Avl.from_list([50, 30, 70, 20, 40, 60, 80])
+        c = tree.cursor()
+        self.assertEqual(c.key, 20)
+        keys = [c.key]
+        while c.next():
+            keys.append(c.key)
+        self.assertEqual(keys, [20, 30, 40, 50, 60, 70, 80])
+        self.assertIsNone(c.key)
+        self.assertFalse(c.next())
+        self.assertTrue(c.prev())
+        self.assertEqual(c.key, 80)
+
+        self.assertTrue(c.seek(40))
+        self.assertEqual(c.key, 40)
+        self.assertFalse(c.seek(65))
+        self.assertEqual(c.key, 70)
+        self.assertTrue(c.prev())
+        self.assertEqual(c.key, 60)
+
+        c.insert_here(65)
+        self.assertEqual(c.key, 65)
+        self.assertRaises(KeyError, c.insert_here, 65)
+        c.delete_here()
+        self.assertEqual(c.key, 70)
+        self.assertNotIn(65, tree)
+        tree.traverse(self.check)
+
+        # Changes made behind the cursor's back
+        tree.delete(70)
+        self.assertEqual(c.key, 80)
+        for i in xrange(81, 120):
+            c.insert_here(i)
+        tree.traverse(self.check)
+        c.seek(0)
+        for i in xrange(30):
+            c.delete_here()
+            tree.traverse(self.check)
+        self.assertEqual(c.key, 105)
+        self.assertEqual(Cursor(tree).key, 105)
+
+        c.seek(119)
+        c.delete_here()
+        self.assertIsNone(c.key)
+        self.assertRaises(KeyError, c.delete_here)
+
+        # Keys that fail to compare raise at once, the cursor stays put
+        class Bad(object):
+            def __cmp__(self, other):
+                raise ValueError("no order")
+        c.seek(110)
+        self.assertRaises(ValueError, c.seek, Bad())
+        self.assertEqual(c.key, 110)
+        self.assertRaises(ValueError, c.insert_here, Bad())
+        self.assertEqual(c.key, 110)
+        self.assertEqual(len(tree), len(tree.to_dict()))
+
+    def test_15_multiset(self):
+        l = [5, 3, 8, 3, 5, 5, 1, 8, 9, 3, 3]
+        tree = Avl.from_list(l, multi=True)
+        tree.traverse(self.check)
+        self.assertEqual(len(tree), len(l))
+        self.assertEqual(tree.count(3), 4)
+        self.assertEqual(tree.count(9), 1)
+        self.assertEqual(tree.count(4), 0)
+        self.assertEqual(tree.search(5).multiplicity, 3)
+        self.assertRaises(KeyError, Avl.from_list, l)
+
+        tree.delete(3)
+        self.assertEqual(tree.count(3), 3)
+        for i in xrange(3):
+            tree.delete(3)
+        self.assertNotIn(3, tree)
+        self.assertRaises(KeyError, tree.delete, 3)
+        tree.traverse(self.check)
+        self.assertEqual(len(tree), len(l) - 4)
+
+        t2 = Avl.from_list_raw(tree.to_list(), multi=True)
+        self.assertEqual(t2.to_list(), tree.to_list())
+        t2.insert(8)
+        self.assertEqual(t2.count(8), 3)
+
+        c = tree.cursor()
+        self.assertEqual((c.key, c.node.multiplicity), (1, 1))
+        c.next()
+        c.delete_here()
+        self.assertEqual((c.key, c.node.multiplicity), (5, 2))
+        c.insert_here(5)
+        self.assertEqual(tree.count(5), 3)
+
+        # Rebalancing moves keys between nodes, counts must follow
+        tree = Avl(0, multi=True)
+        for i in xrange(1, 100):
+            for j in xrange(i % 4 + 1):
+                tree.insert(i)
+        for i in xrange(1, 100, 2):
+            tree.delete(i)
+        tree.traverse(self.check)
+        for i in xrange(1, 100):
+            self.assertEqual(tree.count(i), i % 4 + 1 - i % 2)
+
+        # Ranks and iteration go by occurrences
+        keys = [i for i in xrange(100) for j in xrange(tree.count(i))]
+        self.assertEqual(list(tree), keys)
+        for k in (-1, 0, 1, 2, 50, 99, 100):
+            self.assertEqual(tree.rank(k), len([x for x in keys if x < k]))
+        tree = AvlTree([3, 1, 3, 2, 3], multi=True, lazy=0.9)
+        self.assertEqual(list(tree), [1, 2, 3, 3, 3])
+        self.assertEqual([tree.rank(k) for k in xrange(5)], [0, 0, 1, 2, 5])
+        tree.delete(3)
+        tree.insert(0)
+        self.assertEqual([tree.rank(k) for k in xrange(5)], [0, 1, 2, 3, 5])
+        # Tombstones hold no keys
+        tree.delete(2)
+        self.assertEqual(list(tree), [0, 1, 3, 3])
+        self.assertEqual([tree.rank(k) for k in xrange(5)], [0, 1, 2, 2, 4])
+
+    def test_16_key(self):
+        calls = []
+        def key(r):
+            calls.append(r)
+            return r[1]
+
+        records = [("f", 6), ("d", 4), ("g", 7), ("i", 9), ("l", 12),
+                   ("b", 1), ("a", 0), ("c", 3)]
+        tree = Avl.from_list(records, key=key)
+        self.assertEqual(len(calls), len(records))
+        tree.traverse(self.check)
+        self.assertEqual(sorted(tree.to_dict().keys()), sorted(r[1] for r in records))
+
+        tree.insert(("e", 5))
+        self.assertEqual(len(calls), len(records) + 1)
+        self.assertEqual(tree.search(("?", 5)).item, ("e", 5))
+        self.assertEqual(tree.search(("?", 5)).key, 5)
+        self.assertIn(("?", 12), tree)
+        self.assertNotIn(("l", 13), tree)
+        self.assertRaises(KeyError, tree.insert, ("x", 5))
+
+        for r in records[:4]:
+            tree.delete(r)
+        tree.traverse(self.check)
+        self.assertEqual(sorted(tree.to_dict().keys()), [0, 1, 3, 5, 12])
+
+        t2 = Avl.from_list_raw(tree.to_list(), key=key)
+        self.assertEqual(t2.to_list(), tree.to_list())
+        self.assertEqual(t2.search(("?", 12)).item, ("l", 12))
+
+        c = t2.cursor()
+        self.assertEqual(c.node.item, ("a", 0))
+        self.assertFalse(c.seek(("?", 2)))
+        self.assertEqual(c.node.item, ("c", 3))
+
+        # Keys of the same native type are compared without PyObject_Compare
+        tree = Avl.from_list(["b", "a", "c", "ab"])
+        self.assertEqual(tree.rightmost().key, "c")
+        tree = Avl.from_list([2.5, -1.0, 3.25])
+        self.assertEqual(tree.search(-1.0).key, -1.0)
+
+    def test_17_tree(self):
+        tree = AvlTree()
+        self.assertEqual(len(tree), 0)
+        self.assertIsNone(tree.root)
+        self.assertIsNone(tree.to_list())
+        self.assertNotIn(1, tree)
+        self.assertRaises(KeyError, tree.delete, 1)
+        self.assertFalse(tree.cursor().seek(1))
+
+        tree = AvlTree.from_list_raw(self.LIST)
+        self.assertEqual(tree.to_list(), self.LIST)
+        self.assertEqual(len(tree), 8)
+        self.assertIsInstance(tree.root, Avl)
+
+        # Rotations change the root node object, no keys are swapped
+        tree = AvlTree()
+        nodes = {}
+        for i in xrange(100):
+            tree.insert(i)
+            nodes[i] = tree.search(i)
+        tree.root.traverse(self.check)
+        self.assertEqual(len(tree), 100)
+        self.assertEqual(tree.height(), 7)
+        for i in xrange(100):
+            self.assertIs(tree.search(i), nodes[i])
+            self.assertEqual(nodes[i].key, i)
+
+        root = tree.root
+        tree.delete(root.key)
+        self.assertIsNot(tree.root, root)
+        self.assertIsNone(root.parent)
+        tree.root.traverse(self.check)
+
+        for i in xrange(100):
+            if i != root.key:
+                tree.delete(i)
+        self.assertEqual(len(tree), 0)
+        self.assertIsNone(tree.root)
+        tree.insert(5)
+        self.assertEqual(tree.to_list(), (5, None, None))
+
+        c = tree.cursor()
+        c.insert_here(3)
+        c.delete_here()
+        c.delete_here()
+        self.assertEqual(len(tree), 0)
+        self.assertIsNone(c.key)
+
+        tree = AvlTree([3, 1, 3, 2], multi=True)
+        self.assertEqual((len(tree), tree.count(3), tree.count(4)), (4, 2, 0))
+
+        # Node API trees still keep the root node object on top
+        tree = Node(6)
+        for i in xrange(100):
+            tree.insert(i + 10)
+        self.assertEqual(len(tree), 101)
+        tree.delete(6)
+        self.assertIsNone(tree.parent)
+        self.assertEqual(len(tree), 100)
+        tree.traverse(self.check)
+
+        # Dropped trees get collected along with what they refer to
+        freed = []
+        class Key(object):
+            def __call__(self, key):
+                return key
+            def __del__(self):
+                freed.append(1)
+        tree = AvlTree(xrange(100), key=Key())
+        node = tree.search(50)
+        del tree
+        gc.collect()
+        self.assertEqual(freed, [])
+        self.assertEqual(node.key, 50)
+        del node
+        gc.collect()
+        self.assertEqual(freed, [1])
+
+        # Lookups let comparison and hashing errors through
+        class Bad(object):
+            def __cmp__(self, other):
+                raise ValueError("no order")
+            __hash__ = None
+        tree = AvlTree(xrange(10))
+        self.assertRaises(ValueError, tree.__contains__, Bad())
+        self.assertRaises(ValueError, tree.search, Bad())
+        self.assertRaises(ValueError, tree.count, Bad())
+        self.assertRaises(ValueError, tree.delete, Bad())
+        self.assertRaises(ValueError, tree.root.__contains__, Bad())
+        self.assertRaises(ValueError, tree.root.search, Bad())
+        self.assertRaises(ValueError, tree.root.count, Bad())
+        tree = AvlTree(xrange(10), index=True)
+        self.assertRaises(TypeError, tree.__contains__, Bad())
+        self.assertRaises(TypeError, tree.search, Bad())
+
+    def test_18_lazy(self):
+        tree = AvlTree(xrange(8), lazy=1.0)
+        root = tree.root
+        tree.delete(root.key)
+        self.assertIs(tree.root, root)
+        self.assertEqual(root.multiplicity, 0)
+        self.assertEqual((len(tree), tree.tombstones), (7, 1))
+        self.assertNotIn(root.key, tree)
+        self.assertRaises(KeyError, tree.search, root.key)
+        self.assertRaises(KeyError, tree.delete, root.key)
+        self.assertNotIn(root.key, tree.to_dict())
+        self.assertEqual(tree.to_list()[3], 0)
+
+        c = tree.cursor()
+        self.assertTrue(c.seek(root.key - 1))
+        c.next()
+        self.assertEqual(c.key, root.key + 1)
+        c.prev()
+        self.assertEqual(c.key, root.key - 1)
+
+        # Inserting the key again revives the tombstone
+        tree.insert(root.key)
+        self.assertIs(tree.search(root.key), root)
+        self.assertEqual((len(tree), tree.tombstones), (8, 0))
+
+        # Tombstones get purged a few at a time once past the fraction
+        tree = AvlTree(xrange(1000), lazy=0.25)
+        for i in xrange(900):
+            tree.delete(i)
+            self.assertLessEqual(tree.tombstones, 260)
+        tree.root.traverse(self.check)
+        self.assertEqual(len(tree), 100)
+        c = tree.cursor()
+        self.assertEqual(c.key, 900)
+
+        tree.compact()
+        self.assertEqual(tree.tombstones, 0)
+        self.assertEqual(tree.height(), 7)
+        self.assertEqual(sorted(tree.to_dict().keys()), range(900, 1000))
+        tree.root.traverse(self.check)
+        for i in xrange(900, 1000):
+            tree.delete(i)
+        tree.compact()
+        self.assertIsNone(tree.root)
+
+        # The fraction is of nodes, repeated keys don't hold it off
+        tree = AvlTree(range(1000) + [1000] * 10000, multi=True, lazy=0.25)
+        for i in xrange(900):
+            tree.delete(i)
+            self.assertLessEqual(tree.tombstones, 265)
+        self.assertEqual(len(tree), 10100)
+        tree.root.traverse(self.check)
+
+    def test_19_from_list_raw(self):
+        def stream(l):
+            if l:
+                yield (l[0], l[1] is not None, l[2] is not None) + l[3:]
+                for e in stream(l[1]):
+                    yield e
+                for e in stream(l[2]):
+                    yield e
+
+        tree = Node.from_list_raw(stream(self.LIST), validate=True)
+        self.assertEqual(tree.to_list(), self.LIST)
+        self.assertEqual(len(tree), 8)
+        tree.traverse(self.check)
+
+        t = AvlTree([3, 1, 3, 2, 5], multi=True, lazy=0.5)
+        t.delete(5)
+        t2 = AvlTree.from_list_raw(stream(t.to_list()), multi=True, lazy=0.5,
+                                   validate=True)
+        self.assertEqual(t2.to_list(), t.to_list())
+        self.assertEqual((len(t2), t2.tombstones), (4, 1))
+
+        # A skewed tree is imported in linear time, no height recursion
+        l = None
+        for i in xrange(500, 0, -1):
+            l = (i, None, l)
+        tree = Node.from_list_raw(l, validate=True)
+        self.assertEqual(tree.bf, -499)
+        self.assertEqual(len(tree), 500)
+
+        self.assertRaises(ValueError, Avl.from_list_raw, l, validate=True)
+        self.assertRaises(ValueError, Avl.from_list_raw,
+                          (2, (3, None, None), None), validate=True)
+        self.assertRaises(ValueError, Avl.from_list_raw, iter([(1, True, False)]))
+        self.assertRaises(ValueError, Avl.from_list_raw,
+                          iter([(1, False, False)] * 2))
+        self.assertRaises(TypeError, Avl.from_list_raw, [1, None, None])
+
+    def test_20_bulk(self):
+        l = range(100)
+        random.shuffle(l)
+        tree = AvlTree(l)
+        tree.root.traverse(self.check)
+        self.assertEqual(tree.height(), 7)
+        self.assertEqual(len(tree), 100)
+        self.assertRaises(KeyError, AvlTree, [1, 2, 1])
+
+        # Sorted input takes one comparison per item
+        keys = [CKey(i) for i in xrange(100)]
+        CKey.compared = 0
+        tree = AvlTree.from_sorted(keys)
+        self.assertEqual(CKey.compared, 99)
+        CKey.compared = 0
+        tree = AvlTree(keys)
+        self.assertLess(CKey.compared, 200)
+        self.assertRaises(ValueError, AvlTree.from_sorted, [1, 3, 2])
+
+        # Equal keys keep the first item
+        tree = AvlTree([(1, "a"), (0, "b"), (1, "c")], multi=True,
+                       key=lambda r: r[0])
+        self.assertEqual(tree.search((1, None)).item, (1, "a"))
+        self.assertEqual(tree.count((1, None)), 2)
+
+        a = AvlTree([1, 2, 2, 3, 5], multi=True)
+        b = AvlTree([2, 3, 3, 4], multi=True)
+        self.assertEqual(a.union(b).to_list(),
+                         (3, (2, (1, None, None, 1), None, 2),
+                             (5, (4, None, None, 1), None, 1), 2))
+        self.assertEqual(sorted(a.intersection(b).to_dict()), [2, 3])
+        self.assertEqual(a.intersection(b).count(2), 1)
+        self.assertEqual(sorted(a.difference(b).to_dict()), [1, 2, 5])
+        self.assertEqual(len(a.difference(b)), 3)
+
+        a = AvlTree(xrange(0, 1000, 2))
+        b = AvlTree(xrange(0, 1000, 3))
+        u = a.union(b)
+        u.root.traverse(self.check)
+        self.assertEqual(sorted(u.to_dict()), sorted(set(xrange(0, 1000, 2)) |
+                                                     set(xrange(0, 1000, 3))))
+        self.assertEqual(u.height(), 10)
+        self.assertEqual(len(a.intersection(b)), 167)
+        self.assertEqual(len(AvlTree().union(AvlTree())), 0)
+
+        # Native keys get sorted and merged on threads, same results
+        l = [random.randint(-9999, 9999) + random.choice([0, 0.5])
+             for i in xrange(50000)] + [0, -0.0, 2 ** 40]
+        key = lambda r: r[0]
+        items = [(k, i) for i, k in enumerate(l)]
+        tree = AvlTree(items, multi=True, key=key, threads=4)
+        self.assertEqual(tree.to_list(),
+                         AvlTree(items, multi=True, key=key,
+                                 threads=1).to_list())
+        tree.root.traverse(self.check)
+        other = AvlTree(l[::-1] + [1.25, 2 ** 52], multi=True, threads=3)
+        for op in ("union", "intersection", "difference"):
+            self.assertEqual(getattr(tree, op)(other, threads=4).to_list(),
+                             getattr(tree, op)(other, threads=1).to_list())
+            self.assertEqual(getattr(other, op)(tree, threads=5).to_list(),
+                             getattr(other, op)(tree, threads=1).to_list())
+
+    def test_21_merge(self):
+        shards = [AvlTree(xrange(i, 300, 7)) for i in xrange(7)]
+        self.assertEqual(list(merge(*shards)), range(300))
+        self.assertEqual(list(merge(*shards, reverse=True)), range(299, -1, -1))
+        self.assertEqual(list(merge(*shards, lo=10, hi=20)), range(10, 21))
+        self.assertEqual(list(merge(*shards, lo=20, hi=10)), [])
+        self.assertEqual(list(merge()), [])
+
+        # Lazy, nothing is materialised ahead, so changes are caught
+        it = merge(*shards)
+        self.assertEqual([next(it) for i in xrange(3)], [0, 1, 2])
+        shards[3].delete(10)
+        self.assertRaises(RuntimeError, next, it)
+        a, b = AvlTree(xrange(0, 10, 2)), AvlTree(xrange(1, 10, 2))
+        it = merge(a, b.root)
+        self.assertEqual([next(it) for i in xrange(3)], [0, 1, 2])
+        for i in xrange(0, 10, 2):
+            a.delete(i)
+        self.assertRaises(RuntimeError, list, it)
+
+        class Bad(object):
+            def __cmp__(self, other):
+                raise ValueError("no order")
+        self.assertRaises(ValueError, merge, AvlTree([1]), AvlTree([Bad()]))
+        self.assertRaises(ValueError, merge, AvlTree([1, 2]), lo=Bad())
+        self.assertRaises(ValueError, merge, AvlTree([1, 2]), hi=Bad())
+
+        a = AvlTree([(1, "a"), (3, "a")], key=lambda r: r[0])
+        b = AvlTree([(1, "b"), (2, "b"), (2, "c")], multi=True,
+                    key=lambda r: r[0])
+        self.assertEqual(list(merge(a, b)),
+                         [(1, "a"), (1, "b"), (2, "b"), (2, "b"), (3, "a")])
+        self.assertEqual(list(merge(b, a, unique=True)),
+                         [(1, "b"), (2, "b"), (3, "a")])
+        self.assertEqual(list(merge(a, b, unique=True, reverse=True, hi=2)),
+                         [(2, "b"), (1, "a")])
+
+        self.assertEqual(list(merge(self.tree, Avl.from_list([2, 5]))),
+                         [0, 1, 2, 3, 4, 5, 6, 7, 9, 12])
+        self.assertRaises(TypeError, merge, [1, 2])
+
+    def test_22_snapshot(self):
+        def nodes(tree):
+            l = []
+            if tree.root:
+                tree.root.traverse(l.append)
+            return l
+
+        def check(node):
+            # Shared nodes hang under a parent in every tree they are in,
+            # their parent links can't be checked
+            self.assertEqual(node.bf, node.calc_bf())
+            if node.left:
+                self.assertGreater(node.key, node.left.key)
+            if node.right:
+                self.assertLess(node.key, node.right.key)
+
+        tree = AvlTree(xrange(1000))
+        root = tree.root
+        c = tree.cursor()
+        c.seek(500)
+
+        # The snapshot takes the nodes over, the tree gets a new root
+        snap = tree.snapshot()
+        self.assertIs(snap.root, root)
+        self.assertIsNot(tree.root, root)
+        self.assertIs(tree.root.left, root.left)
+        self.assertEqual(len(snap), 1000)
+        self.assertRaises(RuntimeError, snap.insert, 1000)
+        self.assertRaises(RuntimeError, snap.delete, 1)
+        self.assertRaises(RuntimeError, snap.cursor().delete_here)
+
+        # Changes copy the nodes on the way down only
+        shared = set(map(id, nodes(snap)))
+        tree.delete(500)
+        tree.insert(1000)
+        tree.insert(-1)
+        owned = [n for n in nodes(tree) if id(n) not in shared]
+        self.assertLess(len(owned), 4 * tree.height())
+        self.assertEqual(list(snap), range(1000))
+        self.assertEqual(list(tree), range(-1, 500) + range(501, 1001))
+        self.assertEqual(c.key, 501)
+        c.prev()
+        self.assertEqual(c.key, 499)
+        tree.root.traverse(check)
+        snap.root.traverse(check)
+
+        # Cursors and merges walk the snapshot while the tree changes
+        sc = snap.cursor()
+        self.assertTrue(sc.seek(500))
+        m = merge(snap, lo=990)
+        for i in xrange(0, 1000, 3):
+            tree.delete(i)
+        self.assertEqual(list(m), range(990, 1000))
+        self.assertTrue(sc.next())
+        self.assertEqual(sc.key, 501)
+        self.assertEqual(snap.rank(500), 500)
+        self.assertEqual(len(tree), 667)
+        self.assertEqual(list(tree), [i for i in xrange(-1, 1001)
+                                      if i % 3 and i != 500])
+        tree.root.traverse(check)
+
+        # Node API changes go through owned nodes only
+        self.assertRaises(RuntimeError, snap.search(3).insert, 1001)
+        self.assertRaises(RuntimeError, snap.search(3).delete, 3)
+        self.assertRaises(RuntimeError, snap.root.left.rotate_cw)
+        tree.search(1000).insert(1001)
+        self.assertIn(1001, tree)
+        self.assertNotIn(1001, snap)
+        self.assertEqual(list(snap), range(1000))
+
+        # Copies share nodes both ways
+        copy = tree.copy()
+        self.assertIsNot(copy.root, tree.root)
+        self.assertIs(copy.root.left, tree.root.left)
+        copy.insert(500)
+        tree.delete(1)
+        self.assertIn(500, copy)
+        self.assertNotIn(500, tree)
+        self.assertIn(1, copy)
+        self.assertNotIn(1, tree)
+        self.assertEqual(len(copy), 669)
+        self.assertEqual(len(tree), 667)
+        copy.root.traverse(check)
+        self.assertEqual(list(snap.copy()), range(1000))
+
+        # Nodes only the snapshot holds go with it
+        key = CKey(-2)
+        cmp_tree = AvlTree([CKey(i) for i in xrange(100)] + [key])
+        refs = sys.getrefcount(key)
+        cmp_snap = cmp_tree.snapshot()
+        cmp_tree.delete(key)
+        self.assertGreater(sys.getrefcount(key), refs - 1)
+        del cmp_snap
+        gc.collect()
+        self.assertEqual(sys.getrefcount(key), refs - 1)
+
+        # Lazy trees purge and compact around the shared nodes
+        tree = AvlTree(xrange(1000), lazy=0.25, index=True)
+        snap = tree.snapshot()
+        for i in xrange(0, 1000, 2):
+            tree.delete(i)
+        self.assertEqual(list(tree), range(1, 1000, 2))
+        self.assertLess(len(nodes(tree)), 1000)
+        tree.compact()
+        self.assertEqual(len(nodes(tree)), 500)
+        tree.root.traverse(self.check)
+        self.assertEqual(list(snap), range(1000))
+        self.assertEqual(tree.search(501).key, 501)
+
+    def test_23_index(self):
+        class HKey(CKey):
+            def __hash__(self):
+                return hash(self.v)
+
+        keys = [HKey(i) for i in xrange(1000)]
+        tree = AvlTree(keys, index=True)
+        CKey.compared = 0
+        for i in xrange(1000):
+            self.assertIn(HKey(i), tree)
+            self.assertEqual(tree.search(HKey(i)).key.v, i)
+        self.assertEqual(CKey.compared, 2000)
+        self.assertNotIn(HKey(1000), tree)
+
+        CKey.compared = 0
+        for i in xrange(0, 1000, 2):
+            tree.delete(HKey(i))
+        # No search descents, rebalancing still compares keys
+        self.assertLess(CKey.compared, 2500)
+        tree.root.traverse(self.check)
+        self.assertRaises(KeyError, tree.delete, HKey(0))
+        self.assertEqual(tree.count(HKey(1)), 1)
+        self.assertEqual(tree.count(HKey(2)), 0)
+
+        # The index follows inserts, tombstones, snapshots and rebuilds
+        tree = AvlTree(xrange(100), lazy=0.5, index=True)
+        for i in xrange(80):
+            tree.delete(i)
+        snap = tree.snapshot()
+        tree.insert(5)
+        tree.compact()
+        self.assertEqual(sorted(tree.to_dict()), [5] + range(80, 100))
+        self.assertIn(5, tree)
+        self.assertNotIn(5, snap)
+        self.assertIn(90, snap)
+        self.assertIs(tree.search(90).key, 90)
+        self.assertRaises(TypeError, tree.insert, [1])
+        self.assertEqual(len(tree), 21)
+
+        u = AvlTree([1, 2], index=True).union(AvlTree([3]))
+        self.assertIn(3, u)
+        t = AvlTree.from_list_raw(self.LIST, index=True)
+        self.assertIn(12, t)
+
+    def test_24_log(self):
+        def contents(tree):
+            return [(k, tree.count(k)) for k in sorted(tree.to_dict())]
+
+        d = tempfile.mkdtemp()
+        try:
+            snap, log = os.path.join(d, "snap"), os.path.join(d, "log")
+
+            tree = AvlTree.open(snap, log, multi=True, sync="always")
+            for i in xrange(100):
+                tree.insert(i)
+            tree.insert(5)
+            tree.delete(7)
+            c = tree.cursor()
+            c.seek(8)
+            c.delete_here()
+            self.assertEqual(tree.logged, 103)
+            self.assertRaises(ValueError, tree.insert, object())
+            self.assertEqual(len(tree), 99)
+            del tree, c
+
+            # Replay on top of an empty snapshot
+            tree = AvlTree.open(snap, log, multi=True)
+            self.assertEqual(len(tree), 99)
+            self.assertEqual(tree.count(5), 2)
+            self.assertNotIn(7, tree)
+            tree.root.traverse(self.check)
+
+            # The log is folded into the snapshot
+            tree.checkpoint()
+            self.assertEqual(tree.logged, 0)
+            self.assertEqual(os.path.getsize(log), 16)
+            for i in xrange(100, 110):
+                tree.insert(i)
+            tree.delete(5)
+            tree.sync()
+            expected = contents(tree)
+            tree.close_log()
+            tree.insert(200)
+
+            tree = AvlTree.open(snap, log, multi=True)
+            self.assertEqual(contents(tree), expected)
+            tree.close_log()
+
+            # A record cut short by a crash is dropped
+            size = os.path.getsize(log)
+            with open(log, "ab") as f:
+                f.write("+\x05\x00")
+            tree = AvlTree.open(snap, log, multi=True, sync="none")
+            self.assertEqual(contents(tree), expected)
+            self.assertEqual(os.path.getsize(log), size)
+            tree.insert(300)
+            tree.close_log()
+            self.assertIn(300, AvlTree.open(snap, log, multi=True))
+
+            # A log left over from before the last snapshot is ignored
+            shutil.copy(log, log + ".old")
+            tree = AvlTree.open(snap, log, multi=True)
+            tree.checkpoint()
+            tree.close_log()
+            shutil.copy(log + ".old", log)
+            tree = AvlTree.open(snap, log, multi=True)
+            self.assertEqual(contents(tree), expected + [(300, 1)])
+            tree.close_log()
+
+            # Any tree can start logging
+            keyed = AvlTree([(1, "a"), (2, "b")], key=lambda r: r[0], lazy=0.5)
+            keyed.checkpoint(snap, log, sync="batch", batch=2)
+            keyed.delete((1, None))
+            keyed.insert((3, "c"))
+            del keyed
+            keyed = AvlTree.open(snap, log, key=lambda r: r[0])
+            self.assertEqual(sorted(keyed.to_dict()), [2, 3])
+            self.assertEqual(keyed.search((3, None)).item, (3, "c"))
+
+            # Records still batched are written out when a dropped tree
+            # is collected, failed changes leave no records
+            snap2, log2 = snap + "2", log + "2"
+            tree = AvlTree.open(snap2, log2, sync="batch", batch=1000)
+            tree.insert(400)
+            tree.insert(401)
+            self.assertRaises(KeyError, tree.insert, 400)
+            self.assertRaises(KeyError, tree.delete, 402)
+            tree.delete(401)
+            self.assertEqual(tree.logged, 3)
+            self.assertEqual(os.path.getsize(log2), 16)
+            del tree
+            gc.collect()
+            self.assertGreater(os.path.getsize(log2), 16)
+            tree = AvlTree.open(snap2, log2)
+            self.assertEqual(sorted(tree.to_dict()), [400])
+            tree.close_log()
+
+            self.assertRaises(RuntimeError, AvlTree().checkpoint)
+            self.assertRaises(RuntimeError, keyed.snapshot().checkpoint, snap, log)
+            self.assertRaises(ValueError, AvlTree.open, snap, log, sync="never")
+            self.assertRaises(ValueError, AvlTree.open, log, snap)
+        finally:
+            shutil.rmtree(d)
+
+    def test_25_shared(self):
+        tree = AvlTree(xrange(1000), lazy=0.5)
+        tree.delete(500)
+        shared = tree.publish()
+        self.assertEqual(len(shared), 999)
+        self.assertIn(999, shared)
+        self.assertNotIn(500, shared)
+        self.assertEqual(shared.search(7), 7)
+        self.assertRaises(KeyError, shared.search, 500)
+        self.assertEqual(list(shared.range(495, 505)),
+                         [495, 496, 497, 498, 499, 501, 502, 503, 504, 505])
+        self.assertEqual(list(shared.range(hi=2)), [0, 1, 2])
+        self.assertEqual(list(shared.range(10, 5)), [])
+        self.assertEqual(list(shared), range(500) + range(501, 1000))
+
+        # The mapping is read-only, forked workers only read it
+        pid = os.fork()
+        if not pid:
+            os._exit(0 if all(i in shared for i in xrange(1, 1000, 7)) else 1)
+        self.assertEqual(os.waitpid(pid, 0)[1], 0)
+
+        tree = AvlTree([(1, "a"), (2, "b"), (2, "c"), ("x", "y")], multi=True,
+                       key=lambda r: r[0])
+        d = tempfile.mkdtemp()
+        try:
+            path = os.path.join(d, "tree")
+            tree.publish(path)
+            shared = SharedTree(path)
+
+            # Truncated and corrupt files are refused
+            with open(path, "rb") as f:
+                data = f.read()
+            bad = [data[:-3], data[:40], data[:24],
+                   # Offsets out of order
+                   data[:32] + data[40:48] + data[32:40] + data[48:],
+                   # Key length past its record
+                   data[:56 + 8] + "\xff\x00\x00\x00" + data[56 + 12:]]
+            for b in bad:
+                with open(path + ".bad", "wb") as f:
+                    f.write(b)
+                self.assertRaises(ValueError, SharedTree, path + ".bad")
+        finally:
+            shutil.rmtree(d)
+        # Lookups take keys, items are returned
+        self.assertEqual(shared.search("x"), ("x", "y"))
+        self.assertEqual(shared.count(2), 2)
+        self.assertEqual(list(shared), [(1, "a"), (2, "b"), (2, "b"), ("x", "y")])
+        self.assertEqual(len(shared), 4)
+        shared.close()
+        self.assertEqual(len(shared), 0)
+        self.assertRaises(RuntimeError, shared.search, 1)
+
+        self.assertRaises(ValueError, AvlTree([object()]).publish)
+        self.assertEqual(list(AvlTree().publish()), [])
+
+    def test_26_paged(self):
+        d = tempfile.mkdtemp()
+        try:
+            path = os.path.join(d, "tree")
+            tree = PagedTree(path, cache=16)
+            keys = range(0, 200000, 2)
+            random.shuffle(keys)
+            for i in keys:
+                tree.insert(i)
+            self.assertEqual(len(tree), 100000)
+            self.assertGreater(tree.height(), 2)
+            # Far more pages than fit in the cache
+            self.assertGreater(tree.page_writes, 16)
+            self.assertIn(1234, tree)
+            self.assertNotIn(1235, tree)
+            self.assertNotIn(-1, tree)
+            self.assertEqual(tree.search(4), 4)
+            self.assertRaises(KeyError, tree.search, 5)
+            self.assertRaises(KeyError, tree.insert, 4)
+            self.assertRaises(TypeError, tree.insert, "4")
+            self.assertEqual(list(tree.range(99, 107)), [100, 102, 104, 106])
+            self.assertEqual(list(tree.range(hi=4)), [0, 2, 4])
+            self.assertEqual(list(tree.range(199996)), [199996, 199998])
+            self.assertEqual(list(tree.range(10, 5)), [])
+
+            for i in xrange(0, 200000, 4):
+                tree.delete(i)
+            self.assertRaises(KeyError, tree.delete, 4)
+            self.assertEqual(list(tree), range(2, 200000, 4))
+
+            it = iter(tree)
+            next(it)
+            tree.insert(-10)
+            self.assertRaises(RuntimeError, next, it)
+            tree.close()
+            self.assertRaises(RuntimeError, tree.search, 2)
+
+            # Reads go through the cache
+            tree = PagedTree(path, cache=16)
+            self.assertEqual(len(tree), 50001)
+            self.assertEqual(list(tree.range(hi=6)), [-10, 2, 6])
+            reads = tree.page_reads
+            self.assertEqual(tree.search(6), 6)
+            self.assertEqual(tree.page_reads, reads)
+            self.assertEqual(list(tree), [-10] + range(2, 200000, 4))
+            del tree
+
+            # Corrupt files raise instead of crashing
+            data = open(path, "rb").read()
+            npages = len(data) // 4096
+            root = struct.unpack("=I", data[12:16])[0]
+            def corrupt(at, value):
+                open(path + ".bad", "wb").write(data[:at] + value +
+                                                data[at+len(value):])
+                return path + ".bad"
+            for at, v in [(16, 1000), (16, 0), (12, npages), (12, 0),
+                          (20, npages + 1)]:
+                self.assertRaises(ValueError, PagedTree,
+                                  corrupt(at, struct.pack("=I", v)))
+            open(path + ".bad", "wb").write(data[:-4096])
+            self.assertRaises(ValueError, PagedTree, path + ".bad")
+            for at, v in [(root * 4096 + 12, "\xff\xff"),
+                          (root * 4096 + 8, struct.pack("=I", npages)),
+                          (root * 4096, "\x01")]:
+                tree = PagedTree(corrupt(at, v))
+                self.assertRaises(ValueError, tree.__contains__, 1234)
+                self.assertRaises(ValueError, list, tree)
+                del tree
+
+            path = os.path.join(d, "keyed")
+            tree = PagedTree(path, key=lambda r: r[0])
+            for k in [u"b", u"a\0", u"\xe9", u"a", u""]:
+                tree.insert((k, [k, 1]))
+            self.assertEqual([r[0] for r in tree], [u"", u"a", u"a\0", u"b", u"\xe9"])
+            self.assertEqual(tree.search((u"b", None)), (u"b", [u"b", 1]))
+            self.assertEqual([r[0] for r in tree.range(u"a", u"b")],
+                             [u"a", u"a\0", u"b"])
+            self.assertRaises(ValueError, tree.insert, (u"big", "x" * 4096))
+            tree.sync()
+            tree = PagedTree(path, key=lambda r: r[0])
+            self.assertIn((u"\xe9", None), tree)
+
+            tree = PagedTree(os.path.join(d, "tuples"))
+            for k in [(1, "b"), (1, "a"), (0, "z", -1.5), (0, "z")]:
+                tree.insert(k)
+            self.assertEqual(list(tree), [(0, "z"), (0, "z", -1.5), (1, "a"), (1, "b")])
+            tree = PagedTree(os.path.join(d, "floats"))
+            for k in [2.5, -0.0, -3.25, 1e300]:
+                tree.insert(k)
+            self.assertEqual(list(tree), [-3.25, 0.0, 2.5, 1e300])
+            self.assertRaises(KeyError, tree.insert, 0.0)
+            self.assertRaises(ValueError, tree.insert, float("nan"))
+            self.assertRaises(TypeError, tree.insert, 1)
+
+            self.assertRaises(ValueError, PagedTree, path, cache=1)
+            open(os.path.join(d, "other"), "w").write("not a tree")
+            self.assertRaises(ValueError, PagedTree, os.path.join(d, "other"))
+            self.assertRaises(TypeError, PagedTree(os.path.join(d, "x")).insert,
+                              object())
+        finally:
+            shutil.rmtree(d)
+
+    def test_27_prefix(self):
+        # Long shared prefixes, keys prefixes of others, bytes above 0x7f
+        base = "http://example.com/" + "a" * 200
+        keys = [base + "/%d" % i for i in xrange(300)]
+        keys += [base, base[:-1], base + "\xff", base + "\x00", base + "/1\x80", ""]
+        shuffled = keys[:]
+        random.shuffle(shuffled)
+        tree = AvlTree(shuffled)
+        self.assertEqual(list(merge(tree)), sorted(keys))
+        for k in keys:
+            self.assertEqual(tree.search(k).key, k)
+            self.assertRaises(KeyError, tree.search, k + "?")
+            self.assertRaises(KeyError, tree.search, k[:-1] + "\x7f")
+        c = tree.cursor()
+        self.assertTrue(c.seek(base + "/0"))
+        self.assertFalse(c.seek(base + "/0?"))
+
+        # Other key types in the tree just don't narrow the prefix
+        class Str(str):
+            pass
+        tree = Avl(shuffled[0])
+        for k in shuffled[1:]:
+            tree.insert(Str(k) if len(k) % 3 else k)
+        tree.traverse(self.check)
+        for k in keys:
+            self.assertEqual(tree.search(k).key, k)
+            self.assertRaises(KeyError, tree.search, k + "?")
+
+    def test_28_hash(self):
+        keys = range(1000)
+        random.shuffle(keys)
+        a = AvlTree(keys)
+        b = AvlTree()
+        for k in keys:
+            b.insert(k)
+        # Same entries, different shapes
+        self.assertEqual(a.root_hash(), b.root_hash())
+        self.assertEqual(a.diff(b), [])
+        self.assertEqual(a.range_hash(10, 20), AvlTree(range(10, 21)).root_hash())
+        self.assertEqual(a.range_hash(hi=-1), 0)
+        self.assertEqual(a.range_hash(), a.root_hash())
+        self.assertEqual(AvlTree().root_hash(), 0)
+
+        # Kept up through inserts, deletes and the rotations they make
+        snap = a.snapshot()
+        h = a.root_hash()
+        a.delete(500)
+        a.insert(1000)
+        self.assertNotEqual(a.root_hash(), h)
+        self.assertEqual(snap.root_hash(), h)
+        self.assertEqual(a.diff(b), [500, 1000])
+        self.assertEqual(b.diff(a), [500, 1000])
+        self.assertEqual(a.range_hash(0, 499), b.range_hash(0, 499))
+        b.delete(500)
+        b.insert(1000)
+        self.assertEqual(a.root_hash(), b.root_hash())
+        self.assertEqual(a.diff(AvlTree()), range(500) + range(501, 1001))
+        self.assertEqual(AvlTree().diff(a), range(500) + range(501, 1001))
+
+        # Only the paths to the differences are compared
+        class HKey(CKey):
+            def __hash__(self):
+                return hash(self.v)
+        a = AvlTree([HKey(i) for i in xrange(4096)])
+        b = AvlTree([HKey(i) for i in xrange(4096)])
+        a.root_hash(), b.root_hash()
+        b.delete(HKey(77))
+        CKey.compared = 0
+        self.assertEqual([k.v for k in a.diff(b)], [77])
+        # O(log^2 n), going through all the keys would take 4096+
+        self.assertLess(CKey.compared, 1024)
+
+        # Items count, as do occurrences, tombstones don't
+        a = AvlTree([(1, "a"), (2, "b")], key=lambda r: r[0])
+        b = AvlTree([(1, "a"), (2, "c")], key=lambda r: r[0], lazy=0.5)
+        self.assertEqual(a.diff(b), [2])
+        b.insert((3, "x"))
+        b.delete((3, None))
+        b.delete((2, None))
+        b.insert((2, "b"))
+        self.assertEqual(a.root_hash(), b.root_hash())
+        a = AvlTree([1, 2, 2], multi=True)
+        self.assertEqual(a.diff(AvlTree([1, 2], multi=True)), [2])
+
+        self.assertRaises(TypeError, AvlTree([[1]]).root_hash)
+
+        # Hashes don't depend on the hash seed or the host, equal numbers
+        # hash the same whatever their types
+        code = ("from avl import AvlTree\n"
+                "print AvlTree([(1, 'a'), (2, u'b\\xe9'), (2.5, None), "
+                "(2**70, 'x')], key=lambda r: r[0]).root_hash()")
+        env = dict(os.environ, PYTHONPATH=os.pathsep.join(sys.path))
+        for i in xrange(2):
+            out = subprocess.check_output([sys.executable, "-R", "-c", code], env=env)
+            self.assertEqual(int(out), 12765993496770765838)
+        self.assertEqual(AvlTree([1, 2.0, 3L, -0.0]).root_hash(),
+                         AvlTree([1.0, 2, 3, 0]).root_hash())
+        for k in (2**63, -2**63 - 2048, 2**100):
+            self.assertEqual(AvlTree([k]).root_hash(),
+                             AvlTree([float(k)]).root_hash())
+        self.assertNotEqual(AvlTree([float("inf")]).root_hash(),
+                            AvlTree([2**1024]).root_hash())
+        self.assertRaises(TypeError, a.diff, [1, 2])
+
+    def test_29_comparisons(self):
+        # Descents from the root compare once per level, rebalancing
+        # finds sides by node identity
+        base = AvlTree([CKey(i) for i in xrange(0, 4096, 2)])
+        height = base.height()
+        for i in xrange(1, 4096, 14):
+            tree = base.copy()
+            CKey.compared = 0
+            tree.insert(CKey(i))
+            self.assertLessEqual(CKey.compared, height)
+        for i in xrange(0, 4096, 14):
+            tree = base.copy()
+            CKey.compared = 0
+            tree.delete(CKey(i))
+            self.assertLessEqual(CKey.compared, height)
+        # The copy shares the nodes the delete didn't change
+        tree.compact()
+        tree.root.traverse(self.check)
+
+        # Appends go by the finger, one comparison each
+        tree = AvlTree([CKey(0)])
+        for i in xrange(1, 1000):
+            CKey.compared = 0
+            tree.insert(CKey(i))
+            self.assertEqual(CKey.compared, 1)
+        tree.root.traverse(self.check)
+        c = tree.cursor()
+        CKey.compared = 0
+        self.assertFalse(c.seek(CKey(1000)))
+        self.assertTrue(c.seek(CKey(500)))
+        self.assertEqual(c.key.v, 500)
+
 if __name__ == "__main__":
     unittest.main()
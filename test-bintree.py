@@ -7,9 +7,15 @@ from bintree import *
 
 class TestCase(unittest.TestCase):
     LIST = [6, [4, [1, [0, None, None], [3, None, None]], None], [7, None, [9, None, [12, None, None]]]]
+    backend = "python"
+
     def setUp(self):
+        set_backend(self.backend)
         self.tree = Tree.from_list_raw(self.LIST)
 
+    def tearDown(self):
+        set_backend(backends[-1])
+
     def check(self, node):
         #print "%d: %d == %d" % (node.key, node.bf, node.calc_bf())
         self.assertEqual(node.bf, node.calc_bf())
@@ -188,6 +194,96 @@ class TestCase(unittest.TestCase):
         t.insert(60)
         t.traverse(self.check)
 
+    def test_13_from_list_raw(self):
+        def stream(l):
+            if l:
+                yield (l[0], bool(l[1]), bool(l[2]))
+                for e in stream(l[1]):
+                    yield e
+                for e in stream(l[2]):
+                    yield e
+
+        t = Tree.from_list_raw(stream(self.LIST), validate=True)
+        self.assertEqual(t.to_list(), self.LIST)
+        t.traverse(self.check)
+
+        # A skewed tree is imported in linear time, no height recursion
+        l = None
+        for i in xrange(500, 0, -1):
+            l = [i, None, l]
+        t = Tree.from_list_raw(l, validate=True)
+        self.assertEqual(t.root.bf, -499)
+
+        self.assertRaises(BalanceError, BalancedTree.from_list_raw, l, True)
+        self.assertRaises(ValueError, Tree.from_list_raw, [2, [3, None, None], None], True)
+        self.assertRaises(ValueError, Tree.from_list_raw, iter([(1, True, False)]))
+        self.assertRaises(ValueError, Tree.from_list_raw, iter([(1, False, False)] * 2))
+
+    def test_14_errors(self):
+        tree = BalancedTree.from_list([5, 3, 8])
+        self.assertIsInstance(tree, BalancedTree)
+        with self.assertRaises(KeyNotFound) as cm:
+            tree.search(4)
+        self.assertEqual(cm.exception.last_node.key, 3)
+        with self.assertRaises(KeyNotFound) as cm:
+            tree.delete(9)
+        self.assertEqual(cm.exception.last_node.key, 8)
+        with self.assertRaises(KeyPresent) as cm:
+            tree.insert(8)
+        self.assertIs(cm.exception.node, tree.search(8))
+        self.assertEqual(len(tree), 3)
+        self.assertFalse(tree)
+
+        empty = Tree()
+        self.assertEqual(len(empty), 0)
+        self.assertEqual(empty.to_list(), [])
+        self.assertEqual(empty.height(), 0)
+        self.assertNotIn(1, empty)
+        with self.assertRaises(KeyNotFound) as cm:
+            empty.search(1)
+        self.assertIsNone(cm.exception.last_node)
+        self.assertRaises(KeyNotFound, empty.delete, 1)
+
+    def test_15_comparisons(self):
+        class Key(object):
+            compared = 0
+            def __init__(self, v):
+                self.v = v
+            def __cmp__(self, other):
+                Key.compared += 1
+                return cmp(self.v, other.v)
+
+        keys = [Key(i) for i in xrange(1000)]
+        random.shuffle(keys)
+        tree = BalancedTree()
+        # Rebalancing finds sides by node identity, searches compare once
+        # per level
+        def descend(tree):
+            # The extension's finger searches climb up first, a compacted
+            # tree has no finger, so searches go down from the root
+            if self.backend == "c":
+                tree._tree.compact()
+        for k in keys:
+            descend(tree)
+            h = tree.height()
+            Key.compared = 0
+            tree.insert(k)
+            self.assertLessEqual(Key.compared, h + 1)
+        tree.traverse(self.check)
+        for k in keys[::2]:
+            descend(tree)
+            h = tree.height()
+            Key.compared = 0
+            tree.delete(k)
+            self.assertLessEqual(Key.compared, h + 1)
+        tree.traverse(self.check)
+        self.assertEqual(len(tree), 500)
+
+if "c" in backends:
+    class CTestCase(TestCase):
+        """ The same tests run against the avl extension """
+        backend = "c"
+
 import random
 
 if __name__ == "__main__":